@@ -1,13 +1,24 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
+#include <clox/aot.h>
+#include <clox/cache.h>
 #include <clox/chunk.h>
+#include <clox/compiler.h>
 #include <clox/debug.h>
+#include <clox/jit.h>
+#include <clox/profiler.h>
 #include <clox/vm.h>
 #include <sysexits.h>
 
-static void repl() {
+static void repl(Vm* vm) {
   char line[1024];
   for (;;) {
     fputs("> ", stdout);
@@ -18,10 +29,17 @@ static void repl() {
       break;
     }
 
-    interpret(line);
+    interpret(vm, strlen(line), line);
   }
 }
 
+// A script mapped read-only into memory. It is not NUL-terminated; the
+// scanner is bounded by `length` instead.
+typedef struct source_file_s {
+  const char* data;
+  size_t length;
+} SourceFile;
+
 typedef enum read_result_type_e
 {
   READ_RESULT_TYPE_OK,
@@ -31,7 +49,7 @@ typedef enum read_result_type_e
 typedef struct read_result_s {
   ReadResultType type;
   union read_result_u {
-    char* ok;
+    SourceFile ok;
     int err;
   } u;
 } ReadResult;
@@ -50,44 +68,72 @@ typedef struct read_result_s {
 #define READ_GET_OK(res) ((res).u.ok)
 #define READ_GET_ERR(res) ((res).u.err)
 
-static ReadResult readFile(const char path[static 1]) {
-  FILE* file = fopen(path, "rbe");
-  if (!file) {
+static ReadResult mapFile(const char path[static 1]) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
     fprintf(stderr, "Could not open file \"%s\".\n", path);
     return READ_ERR(EX_IOERR);
   }
 
-  fseek(file, 0, SEEK_END);
-  size_t fileSize = ftell(file);
-  rewind(file);
-
-  char* buffer = (char*)malloc(fileSize + 1);
-  if (!buffer) {
-    fclose(file);
-    fprintf(stderr, "Not enough memory to read \"%s\".\n", path);
+  struct stat info;
+  if (fstat(fd, &info) < 0) {
+    close(fd);
+    fprintf(stderr, "Could not read file \"%s\".\n", path);
     return READ_ERR(EX_IOERR);
   }
-  size_t bytesRead = fread(buffer, sizeof(char), fileSize, file);
-  if (bytesRead < fileSize) {
-    fprintf(stderr, "Could not read file \"%s\".\n", path);
+
+  // mmap() rejects empty mappings, and there is nothing to scan anyway
+  if (info.st_size == 0) {
+    close(fd);
+    return READ_OK(((SourceFile){.data = "", .length = 0}));
+  }
+
+  size_t length = (size_t)info.st_size;
+  void* data = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    fprintf(stderr, "Could not map file \"%s\".\n", path);
     return READ_ERR(EX_IOERR);
   }
-  buffer[bytesRead] = 0;
+  madvise(data, length, MADV_SEQUENTIAL);
 
-  fclose(file);
-  return READ_OK(buffer);
+  return READ_OK(((SourceFile){.data = data, .length = length}));
 }
 
-static int runFile(const char path[static 1]) {
-  ReadResult readResult = readFile(path);
-  if (READ_IS_ERR(readResult)) {
-    return READ_GET_ERR(readResult);
+static void unmapFile(SourceFile file) {
+  if (file.length > 0) {
+    munmap((void*)file.data, file.length);
+  }
+}
+
+static bool hasExtension(const char path[static 1], const char* extension) {
+  size_t pathLength = strlen(path);
+  size_t extensionLength = strlen(extension);
+  return pathLength >= extensionLength
+      && strcmp(path + pathLength - extensionLength, extension) == 0;
+}
+
+// script.lox caches to script.loxc, is translated to script.c and script.so,
+// and profiled to script.folded; anything else gets the extension added.
+static char* artifactPathFor(
+    const char path[static 1],
+    const char extension[static 1]) {
+  size_t pathLength = strlen(path);
+  if (hasExtension(path, ".lox")) {
+    pathLength -= strlen(".lox");
   }
-  char* source = READ_GET_OK(readResult);
-  InterpretResult result = interpret(source);
-  free(source);
+  size_t extensionLength = strlen(extension);
+  char* artifactPath = malloc(pathLength + extensionLength + 1);
+  if (!artifactPath) {
+    return NULL;
+  }
+  memcpy(artifactPath, path, pathLength);
+  memcpy(artifactPath + pathLength, extension, extensionLength + 1);
+  return artifactPath;
+}
 
-  if (result == INTERPRET_COMPILE_ERROR) {
+static int exitCode(InterpretResult result) {
+  if (result == INTERPRET_COMPILE_ERROR || result == INTERPRET_INVALID_CODE) {
     return EX_DATAERR;
   }
   if (result == INTERPRET_RUNTIME_ERROR) {
@@ -96,23 +142,292 @@ static int runFile(const char path[static 1]) {
   return EXIT_SUCCESS;
 }
 
+static int runCache(Vm* vm, const char path[static 1]) {
+  Chunk chunk;
+  initChunk(&chunk);
+  if (!loadCache(vm, path, 0, NULL, &chunk)) {
+    fprintf(stderr, "\"%s\" is not a usable bytecode cache.\n", path);
+    return EX_DATAERR;
+  }
+  InterpretResult result = interpretChunk(vm, &chunk, 0, NULL);
+  freeChunk(&chunk);
+  return exitCode(result);
+}
+
+static int runFile(Vm* vm, const char path[static 1]) {
+  if (hasExtension(path, CACHE_EXTENSION)) {
+    return runCache(vm, path);
+  }
+  if (hasExtension(path, AOT_EXTENSION)) {
+    return exitCode(runSharedObject(vm, path));
+  }
+
+  ReadResult readResult = mapFile(path);
+  if (READ_IS_ERR(readResult)) {
+    return READ_GET_ERR(readResult);
+  }
+  SourceFile source = READ_GET_OK(readResult);
+
+  // a cache compiled from exactly this source skips the compiler entirely
+  InterpretResult result;
+  Chunk chunk;
+  initChunk(&chunk);
+  char* cachePath = artifactPathFor(path, CACHE_EXTENSION);
+  if (cachePath
+      && loadCache(vm, cachePath, source.length, source.data, &chunk)) {
+    result = interpretChunk(vm, &chunk, source.length, source.data);
+    freeChunk(&chunk);
+  } else {
+    result = interpret(vm, source.length, source.data);
+  }
+  free(cachePath);
+  unmapFile(source);
+
+  return exitCode(result);
+}
+
+static int compileFile(Vm* vm, const char path[static 1]) {
+  ReadResult readResult = mapFile(path);
+  if (READ_IS_ERR(readResult)) {
+    return READ_GET_ERR(readResult);
+  }
+  SourceFile source = READ_GET_OK(readResult);
+
+  int ret = EXIT_SUCCESS;
+  Chunk chunk;
+  initChunk(&chunk);
+  if (!compile(vm, &g_COMPILER_OPTIONS, source.length, source.data, &chunk)) {
+    ret = EX_DATAERR;
+  } else {
+    char* cachePath = artifactPathFor(path, CACHE_EXTENSION);
+    if (!cachePath
+        || !writeCache(vm, cachePath, &chunk, source.length, source.data)) {
+      fprintf(stderr, "Could not write bytecode cache for \"%s\".\n", path);
+      ret = EX_CANTCREAT;
+    }
+    free(cachePath);
+  }
+  freeChunk(&chunk);
+  unmapFile(source);
+  return ret;
+}
+
+// Writes the C translation of a script, then builds it into a shared object.
+static int emitFile(Vm* vm, const char path[static 1]) {
+  ReadResult readResult = mapFile(path);
+  if (READ_IS_ERR(readResult)) {
+    return READ_GET_ERR(readResult);
+  }
+  SourceFile source = READ_GET_OK(readResult);
+
+  int ret = EXIT_SUCCESS;
+  Chunk chunk;
+  initChunk(&chunk);
+  char* cPath = artifactPathFor(path, ".c");
+  char* sharedObjectPath = artifactPathFor(path, AOT_EXTENSION);
+  if (!compile(vm, &g_COMPILER_OPTIONS, source.length, source.data, &chunk)) {
+    ret = EX_DATAERR;
+  } else if (
+      !cPath || !sharedObjectPath
+      || !emitC(vm, cPath, &chunk, source.length, source.data)) {
+    fprintf(stderr, "Could not write C for \"%s\".\n", path);
+    ret = EX_CANTCREAT;
+  } else if (!buildSharedObject(cPath, sharedObjectPath)) {
+    fprintf(stderr, "Could not compile \"%s\".\n", cPath);
+    ret = EX_SOFTWARE;
+  }
+  free(sharedObjectPath);
+  free(cPath);
+  freeChunk(&chunk);
+  unmapFile(source);
+  return ret;
+}
+
+// Runs a script with every instruction counted and the running one sampled,
+// then reports on stderr and, if any samples were taken, writes folded
+// stacks for flame graphs.
+static int profileFile(Vm* vm, const char path[static 1]) {
+  if (hasExtension(path, AOT_EXTENSION)) {
+    fprintf(stderr, "\"%s\" is machine code and can't be profiled.\n", path);
+    return EX_USAGE;
+  }
+
+  Profile profile;
+  initProfile(&profile);
+  vm->profile = &profile;
+  int ret = runFile(vm, path);
+  vm->profile = NULL;
+
+  // keep the script's own output ahead of the report
+  fflush(stdout);
+  printProfile(&profile, stderr);
+  // a run too short to sample leaves nothing to draw
+  if (profile.sampleCount == 0) {
+    fputs("\nNo samples taken, so no folded stacks written.\n", stderr);
+  } else {
+    char* foldedPath = artifactPathFor(path, PROFILE_EXTENSION);
+    if (!foldedPath || !writeFoldedStacks(&profile, path, foldedPath)) {
+      fprintf(stderr, "Could not write folded stacks for \"%s\".\n", path);
+      if (ret == EXIT_SUCCESS) {
+        ret = EX_CANTCREAT;
+      }
+    } else {
+      fprintf(stderr, "\nFolded stacks written to \"%s\".\n", foldedPath);
+    }
+    free(foldedPath);
+  }
+  freeProfile(&profile);
+  return ret;
+}
+
+#pragma region "batch mode"
+
+// Scripts run by `--jobs`. Each worker takes the next script not yet
+// claimed and runs it in a VM of its own.
+typedef struct batch_s {
+  int count;
+  const char** paths;
+  int* exitCodes;
+  atomic_int next;
+} Batch;
+
+static void* runBatchWorker(void* argument) {
+  Batch* batch = argument;
+  for (;;) {
+    int i = atomic_fetch_add(&batch->next, 1);
+    if (i >= batch->count) {
+      return NULL;
+    }
+    Vm vm;
+    initVm(&vm);
+    batch->exitCodes[i] = runFile(&vm, batch->paths[i]);
+    freeVm(&vm);
+  }
+}
+
+// Runs independent scripts on `jobs` threads. The exit code is that of the
+// first script, in command line order, that failed.
+static int runBatch(int jobs, int count, const char* paths[count]) {
+  Batch batch = {
+      .count = count,
+      .paths = paths,
+      .exitCodes = calloc((size_t)count, sizeof(int)),
+      .next = 0,
+  };
+  pthread_t* workers = calloc((size_t)jobs, sizeof(pthread_t));
+  if (!batch.exitCodes || !workers) {
+    free(workers);
+    free(batch.exitCodes);
+    return EX_OSERR;
+  }
+
+  int started = 0;
+  while (started < jobs && started < count
+         && pthread_create(&workers[started], NULL, runBatchWorker, &batch)
+             == 0) {
+    ++started;
+  }
+  // with no thread at all, this one does the work
+  if (started == 0) {
+    runBatchWorker(&batch);
+  }
+  for (int i = 0; i < started; ++i) {
+    pthread_join(workers[i], NULL);
+  }
+
+  int ret = EXIT_SUCCESS;
+  for (int i = 0; i < count && ret == EXIT_SUCCESS; ++i) {
+    ret = batch.exitCodes[i];
+  }
+  free(workers);
+  free(batch.exitCodes);
+  return ret;
+}
+
+#pragma endregion
+
+static int usage(void) {
+  fputs(
+      "Usage: clox [-O | -O2] [--strip-lines] [--no-jit] [--perf-map] "
+      "[--compile | --emit-c | --profile] [path]\n"
+      "       clox [options] --jobs N path...\n",
+      stderr);
+  return EX_USAGE;
+}
+
 int main(int argc, const char* argv[argc + 1]) {
-  initVm();
+  bool compileOnly = false;
+  bool emitOnly = false;
+  bool profiling = false;
+  int jobs = 0;
+  int pathCount = 0;
+  const char** paths = malloc(sizeof(const char*) * (size_t)argc);
+  if (!paths) {
+    return EX_OSERR;
+  }
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc) {
+      char* end;
+      long count = strtol(argv[++i], &end, 10);
+      if (*end != '\0' || count < 1 || count > 1024) {
+        free(paths);
+        return usage();
+      }
+      jobs = (int)count;
+    } else if (strcmp(argv[i], "--compile") == 0) {
+      compileOnly = true;
+    } else if (strcmp(argv[i], "--emit-c") == 0) {
+      emitOnly = true;
+    } else if (strcmp(argv[i], "--profile") == 0) {
+      profiling = true;
+    } else if (strcmp(argv[i], "--strip-lines") == 0) {
+      g_COMPILER_OPTIONS.stripLines = true;
+    } else if (strcmp(argv[i], "--no-jit") == 0) {
+      g_JIT_OPTIONS.enabled = false;
+    } else if (strcmp(argv[i], "--perf-map") == 0) {
+      g_JIT_OPTIONS.perfMap = true;
+    } else if (strcmp(argv[i], "-O") == 0) {
+      g_COMPILER_OPTIONS.optimize = 1;
+    } else if (strcmp(argv[i], "-O2") == 0) {
+      g_COMPILER_OPTIONS.optimize = 2;
+    } else if (argv[i][0] == '-' || (pathCount > 0 && jobs == 0)) {
+      free(paths);
+      return usage();
+    } else {
+      paths[pathCount++] = argv[i];
+    }
+  }
+  const char* path = pathCount > 0 ? paths[0] : NULL;
+  int modes = compileOnly + emitOnly + profiling + (jobs > 0);
+  if (modes > 1 || (modes == 1 && !path)) {
+    free(paths);
+    return usage();
+  }
 
+  // REPL lines see each other's globals; a file is the whole program
+  g_COMPILER_OPTIONS.wholeProgram = path != NULL;
   int ret = EXIT_SUCCESS;
+  if (jobs > 0) {
+    ret = runBatch(jobs, pathCount, paths);
+    free(paths);
+    return ret;
+  }
 
-  switch (argc) {
-    case 1:
-      repl();
-      break;
-    case 2:
-      ret = runFile(argv[1]);
-      break;
-    default:
-      fputs("Usage: clox [path]\n", stderr);
-      ret = EX_USAGE;
+  Vm vm;
+  initVm(&vm);
+  if (!path) {
+    repl(&vm);
+  } else if (compileOnly) {
+    ret = compileFile(&vm, path);
+  } else if (emitOnly) {
+    ret = emitFile(&vm, path);
+  } else if (profiling) {
+    ret = profileFile(&vm, path);
+  } else {
+    ret = runFile(&vm, path);
   }
 
-  freeVm();
+  freeVm(&vm);
+  free(paths);
   return ret;
 }
@@ -0,0 +1,300 @@
+// Times Lox scripts in-process and compares them against a stored baseline.
+//
+// Usage: bench_runner [--runs N] [--baseline FILE] [--threshold PERCENT]
+//                     [--write-baseline FILE] script...
+//
+// Each script is compiled and run N times (default 10), each time in a fresh
+// VM, and reported with its median and 95th percentile time. One more,
+// profiled run counts its instructions. With --baseline, a script whose
+// median is more than PERCENT (default 10) slower than its baseline makes
+// the exit status 1. If FILE doesn't exist yet, the run's medians are recorded
+// there for later runs to compare against. --write-baseline records them
+// regardless. What the scripts print is discarded.
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <clox/compiler.h>
+#include <clox/profiler.h>
+#include <clox/vm.h>
+
+#include "bench_util.h"
+
+#define MAX_NAME 64
+
+typedef struct result_s {
+  char name[MAX_NAME];
+  double median;
+  double p95;
+  uint64_t instructions;
+  bool failed;
+} Result;
+
+typedef struct baseline_s {
+  int count;
+  char (*names)[MAX_NAME];
+  double* medians;
+} Baseline;
+
+static char* readFile(const char* path, size_t* length) {
+  FILE* file = fopen(path, "rb");
+  if (!file) {
+    fprintf(stderr, "could not open \"%s\"\n", path);
+    exit(1);
+  }
+  fseek(file, 0L, SEEK_END);
+  *length = (size_t)ftell(file);
+  rewind(file);
+  char* buffer = checkedAlloc(*length + 1);
+  if (fread(buffer, 1, *length, file) != *length) {
+    fprintf(stderr, "could not read \"%s\"\n", path);
+    exit(1);
+  }
+  buffer[*length] = '\0';
+  fclose(file);
+  return buffer;
+}
+
+// script name without directory or .lox
+static void scriptName(const char* path, char name[MAX_NAME]) {
+  const char* base = strrchr(path, '/');
+  base = base ? base + 1 : path;
+  size_t length = strlen(base);
+  if (length > 4 && strcmp(base + length - 4, ".lox") == 0) {
+    length -= 4;
+  }
+  if (length >= MAX_NAME) {
+    length = MAX_NAME - 1;
+  }
+  memcpy(name, base, length);
+  name[length] = '\0';
+}
+
+// Points stdout at /dev/null while scripts run; returns the descriptor to
+// restore it from.
+static int silenceStdout(void) {
+  fflush(stdout);
+  int saved = dup(STDOUT_FILENO);
+  int null = open("/dev/null", O_WRONLY);
+  if (saved < 0 || null < 0) {
+    fputs("could not redirect stdout\n", stderr);
+    exit(1);
+  }
+  dup2(null, STDOUT_FILENO);
+  close(null);
+  return saved;
+}
+
+static void restoreStdout(int saved) {
+  fflush(stdout);
+  dup2(saved, STDOUT_FILENO);
+  close(saved);
+}
+
+static double runOnce(size_t length, const char* source, Profile* profile) {
+  Vm vm;
+  initVm(&vm);
+  vm.profile = profile;
+  double start = now();
+  InterpretResult result = interpret(&vm, length, source);
+  double seconds = now() - start;
+  freeVm(&vm);
+  return result == INTERPRET_OK ? seconds : -1.0;
+}
+
+static int compareDoubles(const void* a, const void* b) {
+  double left = *(const double*)a;
+  double right = *(const double*)b;
+  return (left > right) - (left < right);
+}
+
+static Result benchmark(const char* path, int runs) {
+  Result result = {.failed = false};
+  scriptName(path, result.name);
+  size_t length;
+  char* source = readFile(path, &length);
+  double* times = checkedAlloc(sizeof(double) * (size_t)runs);
+
+  int saved = silenceStdout();
+  Profile profile;
+  initProfile(&profile);
+  result.failed = runOnce(length, source, &profile) < 0;
+  result.instructions = profile.instructionCount;
+  freeProfile(&profile);
+  for (int i = 0; i < runs && !result.failed; ++i) {
+    times[i] = runOnce(length, source, NULL);
+    result.failed = times[i] < 0;
+  }
+  restoreStdout(saved);
+
+  if (!result.failed) {
+    qsort(times, (size_t)runs, sizeof(double), compareDoubles);
+    result.median = runs % 2 ? times[runs / 2]
+                             : (times[runs / 2 - 1] + times[runs / 2]) / 2;
+    // nearest rank
+    int rank = (95 * runs + 99) / 100;
+    result.p95 = times[rank - 1];
+  }
+  free(times);
+  free(source);
+  return result;
+}
+
+// false if there's no baseline at `path`
+static bool readBaseline(const char* path, Baseline* baseline) {
+  FILE* file = fopen(path, "r");
+  if (!file) {
+    fprintf(stderr, "no baseline at \"%s\" yet\n", path);
+    return false;
+  }
+  char line[256];
+  int capacity = 0;
+  while (fgets(line, sizeof(line), file)) {
+    char name[MAX_NAME];
+    double median;
+    if (line[0] == '#' || sscanf(line, "%63s %lf", name, &median) != 2) {
+      continue;
+    }
+    if (baseline->count == capacity) {
+      capacity = capacity < 8 ? 8 : capacity * 2;
+      baseline->names
+          = realloc(baseline->names, sizeof(*baseline->names) * capacity);
+      baseline->medians
+          = realloc(baseline->medians, sizeof(double) * capacity);
+      if (!baseline->names || !baseline->medians) {
+        fputs("out of memory\n", stderr);
+        exit(1);
+      }
+    }
+    strcpy(baseline->names[baseline->count], name);
+    baseline->medians[baseline->count++] = median;
+  }
+  fclose(file);
+  return true;
+}
+
+static bool findBaseline(
+    const Baseline* baseline,
+    const char* name,
+    double* median) {
+  for (int i = 0; i < baseline->count; ++i) {
+    if (strcmp(baseline->names[i], name) == 0) {
+      *median = baseline->medians[i];
+      return true;
+    }
+  }
+  return false;
+}
+
+static bool writeBaseline(const char* path, int count, Result results[]) {
+  FILE* file = fopen(path, "w");
+  if (!file) {
+    return false;
+  }
+  fputs("# bench_runner baseline: median seconds per benchmark\n", file);
+  for (int i = 0; i < count; ++i) {
+    if (!results[i].failed) {
+      fprintf(file, "%s %.6f\n", results[i].name, results[i].median);
+    }
+  }
+  return fclose(file) == 0;
+}
+
+static int usage(void) {
+  fputs(
+      "Usage: bench_runner [--runs N] [--baseline FILE] "
+      "[--threshold PERCENT]\n"
+      "                    [--write-baseline FILE] script...\n",
+      stderr);
+  return 2;
+}
+
+int main(int argc, const char* argv[argc + 1]) {
+  int runs = 10;
+  double threshold = 10.0;
+  const char* baselinePath = NULL;
+  const char* writePath = NULL;
+  int first = 1;
+  for (; first < argc && argv[first][0] == '-'; ++first) {
+    if (first + 1 >= argc) {
+      return usage();
+    }
+    if (strcmp(argv[first], "--runs") == 0) {
+      runs = atoi(argv[++first]);
+    } else if (strcmp(argv[first], "--threshold") == 0) {
+      threshold = atof(argv[++first]);
+    } else if (strcmp(argv[first], "--baseline") == 0) {
+      baselinePath = argv[++first];
+    } else if (strcmp(argv[first], "--write-baseline") == 0) {
+      writePath = argv[++first];
+    } else {
+      return usage();
+    }
+  }
+  if (first == argc || runs < 1) {
+    return usage();
+  }
+
+  // like clox running a file
+  g_COMPILER_OPTIONS.wholeProgram = true;
+  Baseline baseline = {.count = 0, .names = NULL, .medians = NULL};
+  // the first run with a baseline is the baseline
+  if (baselinePath && !readBaseline(baselinePath, &baseline) && !writePath) {
+    writePath = baselinePath;
+  }
+
+  int count = argc - first;
+  Result* results = checkedAlloc(sizeof(Result) * (size_t)count);
+  bool ok = true;
+  printf(
+      "%-12s %5s %12s %12s %12s %14s %8s\n",
+      "benchmark",
+      "runs",
+      "median (ms)",
+      "p95 (ms)",
+      "Minstr/s",
+      "baseline (ms)",
+      "change");
+  for (int i = 0; i < count; ++i) {
+    Result* result = &results[i];
+    *result = benchmark(argv[first + i], runs);
+    if (result->failed) {
+      printf("%-12s failed\n", result->name);
+      ok = false;
+      continue;
+    }
+    printf(
+        "%-12s %5d %12.2f %12.2f %12.1f",
+        result->name,
+        runs,
+        result->median * 1e3,
+        result->p95 * 1e3,
+        (double)result->instructions / result->median / 1e6);
+    double expected;
+    if (findBaseline(&baseline, result->name, &expected)) {
+      double change = (result->median / expected - 1.0) * 100.0;
+      printf(" %14.2f %+7.1f%%", expected * 1e3, change);
+      if (change > threshold) {
+        fputs("  REGRESSED", stdout);
+        ok = false;
+      }
+    }
+    fputs("\n", stdout);
+  }
+
+  if (writePath) {
+    if (writeBaseline(writePath, count, results)) {
+      fprintf(stderr, "baseline recorded in \"%s\"\n", writePath);
+    } else {
+      fprintf(stderr, "could not write \"%s\"\n", writePath);
+      ok = false;
+    }
+  }
+  free(results);
+  free(baseline.names);
+  free(baseline.medians);
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
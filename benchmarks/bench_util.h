@@ -0,0 +1,47 @@
+#ifndef BENCH_UTIL_H_
+#define BENCH_UTIL_H_
+
+// What the benchmark programs share. Each is built against its own variant
+// of libclox, so these are compiled into each program rather than into a
+// library of their own.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <clox/object.h>
+
+// Seconds on the monotonic clock.
+static inline double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+// malloc() that exits rather than returning NULL.
+static inline void* checkedAlloc(size_t size) {
+  void* pointer = malloc(size);
+  if (!pointer) {
+    fputs("out of memory\n", stderr);
+    exit(1);
+  }
+  return pointer;
+}
+
+// The string "<prefix><index>", built outside the VM heap so that only the
+// table it is used with gets measured. Nothing frees it.
+static inline ObjString* makeKey(const char* prefix, int index) {
+  char buffer[32];
+  int length = snprintf(buffer, sizeof(buffer), "%s%d", prefix, index);
+  ObjString* key = checkedAlloc(STRING_SIZE(length));
+  key->obj.type = OBJ_STRING;
+  key->obj.isMarked = false;
+  key->obj.next = NULL;
+  key->length = length;
+  key->hash = hashString(length, buffer);
+  memcpy(key->chars, buffer, length + 1);
+  return key;
+}
+
+#endif
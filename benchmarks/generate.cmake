@@ -0,0 +1,136 @@
+# Generates a straight-line Lox benchmark script.
+#
+# Usage: cmake -DKIND=<kind> -DCOUNT=<n> -DOUTPUT=<file> -P generate.cmake
+#
+# where <kind> is stack, table, arithmetic, strings, constants or compile.
+
+if(NOT DEFINED KIND OR NOT DEFINED COUNT OR NOT DEFINED OUTPUT)
+  message(FATAL_ERROR "KIND, COUNT and OUTPUT must be defined")
+endif()
+
+file(WRITE "${OUTPUT}" "")
+set(source "")
+math(EXPR last "${COUNT} - 1")
+
+# Appending to one huge string is quadratic, so flush to the file regularly.
+macro(flush_source)
+  file(APPEND "${OUTPUT}" "${source}")
+  set(source "")
+endmacro()
+
+if(KIND STREQUAL "stack")
+  # Blocks full of locals and deeply nested arithmetic keep the VM stack busy.
+  foreach(i RANGE ${last})
+    string(
+      APPEND
+      source
+      "{\n"
+      "  var a = ${i}; var b = 2; var c = 3; var d = 4;\n"
+      "  a = (a + b) * (c - d) / (a + (b * (c + (d - a))));\n"
+      "  b = ((((a - b) + (c - d)) * ((a + c) - (b + d))) + 1) / 2;\n"
+      "  c = a < b == !(c >= d);\n"
+      "}\n"
+    )
+    math(EXPR batch "${i} % 256")
+    if(batch EQUAL 0)
+      flush_source()
+    endif()
+  endforeach()
+elseif(KIND STREQUAL "table")
+  # Many globals, read and written in a scattered order, stress the globals
+  # table.
+  set(globals 512)
+  math(EXPR last_global "${globals} - 1")
+  foreach(i RANGE ${last_global})
+    string(APPEND source "var g${i} = ${i};\n")
+  endforeach()
+  foreach(i RANGE ${last})
+    math(EXPR dst "(${i} * 7919) % ${globals}")
+    math(EXPR lhs "(${i} * 104729) % ${globals}")
+    math(EXPR rhs "(${i} * 1299709) % ${globals}")
+    string(APPEND source "g${dst} = g${lhs} + g${rhs} - g${dst};\n")
+    math(EXPR batch "${i} % 256")
+    if(batch EQUAL 0)
+      flush_source()
+    endif()
+  endforeach()
+elseif(KIND STREQUAL "arithmetic")
+  # Number-only expressions on a few globals, which quickening turns into the
+  # _NUM instructions.
+  string(APPEND source "var x = 1; var y = 2; var z = 3;\n")
+  foreach(i RANGE ${last})
+    math(EXPR k "${i} % 7 + 1")
+    string(
+      APPEND
+      source
+      "x = x * 0.5 + y / ${k} - z;\n"
+      "y = (y + x * ${k}) / (z + 1) - x;\n"
+      "z = x < y == z >= ${k};\n"
+      "z = ${k};\n"
+    )
+    math(EXPR batch "${i} % 256")
+    if(batch EQUAL 0)
+      flush_source()
+    endif()
+  endforeach()
+elseif(KIND STREQUAL "strings")
+  # Strings built up piece by piece (ropes, then flattening) and short
+  # concatenations that intern their result.
+  string(APPEND source "var s = \"\"; var t = \"\"; var same = false;\n")
+  foreach(i RANGE ${last})
+    math(EXPR k "${i} % 97")
+    string(
+      APPEND
+      source
+      "s = s + \"piece ${k} \";\n"
+      "t = \"key\" + \"${k}\";\n"
+      "same = t == \"key${k}\";\n"
+    )
+    math(EXPR flatten "${i} % 1024")
+    if(flatten EQUAL 0)
+      # comparing forces the rope to be flattened
+      string(APPEND source "same = s == t;\n")
+      flush_source()
+    endif()
+  endforeach()
+elseif(KIND STREQUAL "constants")
+  # Every literal is distinct, so the pool outgrows OP_CONSTANT's one-byte
+  # operand and most loads are OP_CONSTANT_LONG.
+  string(APPEND source "var n = 0; var s = \"\";\n")
+  foreach(i RANGE ${last})
+    string(APPEND source "n = ${i}.25 + ${i}.5 - n;\n" "s = \"c${i}\";\n")
+    math(EXPR batch "${i} % 256")
+    if(batch EQUAL 0)
+      flush_source()
+    endif()
+  endforeach()
+elseif(KIND STREQUAL "compile")
+  # A huge program that does little when run, to time the scanner and
+  # compiler: comments, long names, thousands of globals and nested
+  # expressions.
+  foreach(i RANGE ${last})
+    math(EXPR previous "${i} - 1")
+    if(i EQUAL 0)
+      set(operand "0")
+    else()
+      set(operand "generated_global_${previous}")
+    endif()
+    string(
+      APPEND
+      source
+      "// declaration ${i}: each global reads the one before it\n"
+      "var generated_global_${i} = (${operand} + ${i}) * (1 - (2 + (3 * 4)))"
+      " / 1000;\n"
+      "var generated_text_${i} = \"text ${i}\" == \"text\";\n"
+    )
+    math(EXPR batch "${i} % 256")
+    if(batch EQUAL 0)
+      flush_source()
+    endif()
+  endforeach()
+else()
+  message(FATAL_ERROR "Unknown benchmark kind '${KIND}'")
+endif()
+
+string(APPEND source "print \"done\";\n")
+flush_source()
@@ -0,0 +1,355 @@
+// Micro-benchmarks for the pieces end-to-end scripts exercise all at once:
+// the scanner, the compiler, table operations, string interning and
+// reallocate().
+//
+// Usage: micro_bench [name...]
+// Runs the benchmarks whose names contain any of the given words, or all of
+// them. Each one is repeated with doubling iteration counts until a run
+// takes MIN_SECONDS, then timed REPEATS times at that count; the fastest
+// run is reported.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <clox/chunk.h>
+#include <clox/compiler.h>
+#include <clox/memory.h>
+#include <clox/object.h>
+#include <clox/scanner.h>
+#include <clox/table.h>
+#include <clox/vm.h>
+
+#include "bench_util.h"
+
+#define MIN_SECONDS 0.1
+#define REPEATS 5
+#define KEY_COUNT (1 << 16)
+#define SOURCE_LINES 20000
+
+#pragma region "harness"
+
+typedef void BenchFn(void* context, long iterations);
+
+typedef struct bench_filter_s {
+  int count;
+  const char** words;
+} BenchFilter;
+
+static BenchFilter g_FILTER;
+
+static bool selected(const char* name) {
+  for (int i = 0; i < g_FILTER.count; ++i) {
+    if (strstr(name, g_FILTER.words[i])) {
+      return true;
+    }
+  }
+  return g_FILTER.count == 0;
+}
+
+static double timeRun(BenchFn* fn, void* context, long iterations) {
+  double start = now();
+  fn(context, iterations);
+  return now() - start;
+}
+
+// Reports time per iteration and, given a unit, how many of those units
+// (`units` per iteration, scaled by 1/`scale`) go through per second.
+static void measure(
+    const char* name,
+    BenchFn* fn,
+    void* context,
+    double units,
+    double scale,
+    const char* unit) {
+  if (!selected(name)) {
+    return;
+  }
+  long iterations = 1;
+  while (timeRun(fn, context, iterations) < MIN_SECONDS) {
+    iterations *= 2;
+  }
+  double best = timeRun(fn, context, iterations);
+  for (int i = 1; i < REPEATS; ++i) {
+    double seconds = timeRun(fn, context, iterations);
+    if (seconds < best) {
+      best = seconds;
+    }
+  }
+
+  double perIteration = best / (double)iterations;
+  printf("  %-24s %12.2f ns/op", name, perIteration * 1e9);
+  if (unit) {
+    printf(" %12.2f %s", units / perIteration / scale, unit);
+  }
+  fputs("\n", stdout);
+}
+
+#pragma endregion
+
+#pragma region "scanner and compiler"
+
+typedef struct source_s {
+  char* text;
+  size_t length;
+  int lines;
+} Source;
+
+// A mix of what programs are made of: comments, declarations, long and
+// short names, numbers, strings and nested expressions.
+static Source makeSource(int lines) {
+  size_t capacity = (size_t)lines * 160;
+  Source source = {
+      .text = checkedAlloc(capacity),
+      .length = 0,
+      .lines = 0,
+  };
+  for (int i = 0; i < lines; i += 2) {
+    source.length += (size_t)snprintf(
+        source.text + source.length,
+        capacity - source.length,
+        "// line %d of the generated program\n"
+        "var variable_%d = (%d.5 + x) * (y - %d) / \"text %d\" == !nil;\n",
+        i,
+        i,
+        i,
+        i % 97,
+        i);
+    source.lines += 2;
+  }
+  return source;
+}
+
+static void scanSource(void* context, long iterations) {
+  const Source* source = context;
+  for (long i = 0; i < iterations; ++i) {
+    Scanner scanner;
+    initScanner(&scanner, source->length, source->text);
+    while (scanToken(&scanner).type != TOKEN_EOF) {
+    }
+  }
+}
+
+typedef struct compile_context_s {
+  Vm* vm;
+  const Source* source;
+} CompileContext;
+
+static void compileSource(void* context, long iterations) {
+  CompileContext* compiling = context;
+  CompilerOptions options = {.wholeProgram = true};
+  for (long i = 0; i < iterations; ++i) {
+    Chunk chunk;
+    initChunk(&chunk);
+    if (!compile(
+            compiling->vm,
+            &options,
+            compiling->source->length,
+            compiling->source->text,
+            &chunk)) {
+      fputs("the generated program does not compile\n", stderr);
+      exit(1);
+    }
+    freeChunk(&chunk);
+  }
+}
+
+#pragma endregion
+
+#pragma region "tables"
+
+typedef struct table_context_s {
+  Table table;
+  ObjString** keys;
+  ObjString** misses;
+} TableContext;
+
+static void tableInsert(void* context, long iterations) {
+  TableContext* tables = context;
+  Table table;
+  initTable(&table);
+  for (long i = 0; i < iterations; ++i) {
+    // start over once every key is in, so each set is an insert
+    if (i % KEY_COUNT == 0) {
+      freeTable(&table);
+      initTable(&table);
+    }
+    tableSet(&table, tables->keys[i % KEY_COUNT], NUMBER_VAL(i));
+  }
+  freeTable(&table);
+}
+
+static void tableUpdate(void* context, long iterations) {
+  TableContext* tables = context;
+  for (long i = 0; i < iterations; ++i) {
+    tableSet(&tables->table, tables->keys[i % KEY_COUNT], NUMBER_VAL(i));
+  }
+}
+
+static void tableGetHit(void* context, long iterations) {
+  TableContext* tables = context;
+  Value value;
+  for (long i = 0; i < iterations; ++i) {
+    tableGet(&tables->table, tables->keys[i % KEY_COUNT], &value);
+  }
+}
+
+static void tableGetMiss(void* context, long iterations) {
+  TableContext* tables = context;
+  Value value;
+  for (long i = 0; i < iterations; ++i) {
+    tableGet(&tables->table, tables->misses[i % KEY_COUNT], &value);
+  }
+}
+
+static void findStringHit(void* context, long iterations) {
+  TableContext* tables = context;
+  for (long i = 0; i < iterations; ++i) {
+    ObjString* key = tables->keys[i % KEY_COUNT];
+    tableFindString(&tables->table, key->length, key->chars, key->hash);
+  }
+}
+
+static void findStringMiss(void* context, long iterations) {
+  TableContext* tables = context;
+  for (long i = 0; i < iterations; ++i) {
+    ObjString* key = tables->misses[i % KEY_COUNT];
+    tableFindString(&tables->table, key->length, key->chars, key->hash);
+  }
+}
+
+#pragma endregion
+
+#pragma region "interning and allocation"
+
+typedef struct intern_context_s {
+  Vm* vm;
+  char (*texts)[16];
+  // makes every miss a string not seen before
+  uint64_t next;
+} InternContext;
+
+static void internHit(void* context, long iterations) {
+  InternContext* intern = context;
+  for (long i = 0; i < iterations; ++i) {
+    const char* text = intern->texts[i % KEY_COUNT];
+    copyString(intern->vm, (int)strlen(text), text);
+  }
+}
+
+static void internMiss(void* context, long iterations) {
+  InternContext* intern = context;
+  char text[16] = "fresh-";
+  for (long i = 0; i < iterations; ++i) {
+    uint64_t n = intern->next++;
+    int length = 6;
+    do {
+      text[length++] = (char)('a' + n % 26);
+      n /= 26;
+    } while (n != 0);
+    copyString(intern->vm, length, text);
+  }
+}
+
+static void allocateAndFree(void* context, long iterations) {
+  (void)context;
+  for (long i = 0; i < iterations; ++i) {
+    size_t size = 16 + (size_t)(i % 8) * 16;
+    void* pointer = reallocate(NULL, 0, size);
+    reallocate(pointer, size, 0);
+  }
+}
+
+// an array grown GROW_CAPACITY-style to 1024 values, then freed
+static void growArray(void* context, long iterations) {
+  (void)context;
+  for (long i = 0; i < iterations; ++i) {
+    Value* values = NULL;
+    int capacity = 0;
+    while (capacity < 1024) {
+      int oldCapacity = capacity;
+      capacity = GROW_CAPACITY(oldCapacity);
+      values = GROW_ARRAY(Value, values, oldCapacity, capacity);
+    }
+    FREE_ARRAY(Value, values, capacity);
+  }
+}
+
+#pragma endregion
+
+int main(int argc, const char* argv[argc + 1]) {
+  g_FILTER.count = argc - 1;
+  g_FILTER.words = argv + 1;
+
+  Vm vm;
+  initVm(&vm);
+
+  puts("scanner and compiler");
+  Source source = makeSource(SOURCE_LINES);
+  measure(
+      "scanToken",
+      scanSource,
+      &source,
+      (double)source.length,
+      1e6,
+      "MB/s");
+  CompileContext compileContext = {.vm = &vm, .source = &source};
+  measure(
+      "compile",
+      compileSource,
+      &compileContext,
+      source.lines,
+      1,
+      "lines/s");
+  free(source.text);
+
+  printf("tables (%d keys)\n", KEY_COUNT);
+  TableContext tables = {
+      .keys = checkedAlloc(sizeof(ObjString*) * KEY_COUNT),
+      .misses = checkedAlloc(sizeof(ObjString*) * KEY_COUNT),
+  };
+  initTable(&tables.table);
+  for (int i = 0; i < KEY_COUNT; ++i) {
+    tables.keys[i] = makeKey("key", i);
+    tables.misses[i] = makeKey("miss", i);
+    tableSet(&tables.table, tables.keys[i], NUMBER_VAL(i));
+  }
+  measure("tableSet insert", tableInsert, &tables, 1, 1, NULL);
+  measure("tableSet update", tableUpdate, &tables, 1, 1, NULL);
+  measure("tableGet hit", tableGetHit, &tables, 1, 1, NULL);
+  measure("tableGet miss", tableGetMiss, &tables, 1, 1, NULL);
+  measure("tableFindString hit", findStringHit, &tables, 1, 1, NULL);
+  measure("tableFindString miss", findStringMiss, &tables, 1, 1, NULL);
+  freeTable(&tables.table);
+  for (int i = 0; i < KEY_COUNT; ++i) {
+    free(tables.keys[i]);
+    free(tables.misses[i]);
+  }
+  free(tables.keys);
+  free(tables.misses);
+
+  puts("interning and allocation");
+  InternContext intern = {
+      .vm = &vm,
+      .texts = checkedAlloc(sizeof(*intern.texts) * KEY_COUNT),
+      .next = 0,
+  };
+  // nothing roots the interned strings, so a collection would turn hits
+  // into misses; hold it off while they are looked up
+  size_t nextGC = vm.nextGC;
+  vm.nextGC = SIZE_MAX;
+  for (int i = 0; i < KEY_COUNT; ++i) {
+    snprintf(intern.texts[i], sizeof(*intern.texts), "interned%d", i);
+    copyString(&vm, (int)strlen(intern.texts[i]), intern.texts[i]);
+  }
+  measure("copyString hit", internHit, &intern, 1, 1, NULL);
+  vm.nextGC = nextGC;
+  measure("copyString miss", internMiss, &intern, 1, 1, NULL);
+  free(intern.texts);
+  measure("reallocate", allocateAndFree, NULL, 1, 1, NULL);
+  measure("reallocate grow", growArray, NULL, 1, 1, NULL);
+
+  freeVm(&vm);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,105 @@
+// Micro-benchmark for whichever table implementation libclox was built with.
+//
+// Usage: table_bench [key count...]
+// Defaults to 1K, 1M and 10M keys. Keys are built outside the VM heap so
+// only the table itself is measured.
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <clox/object.h>
+#include <clox/table.h>
+#include <clox/vm.h>
+
+#include "bench_util.h"
+
+static void report(const char* name, int count, double seconds) {
+  printf("  %-16s %10.2f ns/op\n", name, seconds * 1e9 / count);
+}
+
+static void benchmark(int count) {
+  ObjString** keys = checkedAlloc(sizeof(ObjString*) * count);
+  ObjString** misses = checkedAlloc(sizeof(ObjString*) * count);
+  for (int i = 0; i < count; ++i) {
+    keys[i] = makeKey("key", i);
+    misses[i] = makeKey("miss", i);
+  }
+
+  printf("%d keys\n", count);
+
+  Table table;
+  initTable(&table);
+
+  double start = now();
+  for (int i = 0; i < count; ++i) {
+    tableSet(&table, keys[i], NUMBER_VAL(i));
+  }
+  report("tableSet", count, now() - start);
+
+  int found = 0;
+  start = now();
+  for (int i = 0; i < count; ++i) {
+    Value value;
+    found += tableGet(&table, keys[i], &value);
+  }
+  report("tableGet hit", count, now() - start);
+
+  start = now();
+  for (int i = 0; i < count; ++i) {
+    found += tableGet(&table, misses[i], NULL);
+  }
+  report("tableGet miss", count, now() - start);
+
+  start = now();
+  for (int i = 0; i < count; ++i) {
+    ObjString* key = keys[i];
+    found += tableFindString(&table, key->length, key->chars, key->hash)
+        != NULL;
+  }
+  report("findString hit", count, now() - start);
+
+  start = now();
+  for (int i = 0; i < count; ++i) {
+    ObjString* key = misses[i];
+    found += tableFindString(&table, key->length, key->chars, key->hash)
+        != NULL;
+  }
+  report("findString miss", count, now() - start);
+
+  start = now();
+  for (int i = 0; i < count; ++i) {
+    tableDelete(&table, keys[i]);
+  }
+  report("tableDelete", count, now() - start);
+
+  if (found != 2 * count) {
+    fprintf(stderr, "expected %d hits, got %d\n", 2 * count, found);
+    exit(1);
+  }
+
+  freeTable(&table);
+  for (int i = 0; i < count; ++i) {
+    free(keys[i]);
+    free(misses[i]);
+  }
+  free(keys);
+  free(misses);
+}
+
+int main(int argc, const char* argv[argc + 1]) {
+  Vm vm;
+  initVm(&vm);
+
+  if (argc > 1) {
+    for (int i = 1; i < argc; ++i) {
+      benchmark(atoi(argv[i]));
+    }
+  } else {
+    benchmark(1000);
+    benchmark(1000000);
+    benchmark(10000000);
+  }
+
+  freeVm(&vm);
+  return EXIT_SUCCESS;
+}
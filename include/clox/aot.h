@@ -0,0 +1,34 @@
+#ifndef CLOX_AOT_H_
+#define CLOX_AOT_H_
+
+#include "attributes.h"
+#include "chunk.h"
+#include "common.h"
+#include "vm.h"
+
+// `clox --emit-c script.lox` translates the compiled chunk into script.c and
+// has the system C compiler build that into script.so, which `clox
+// script.so` loads and runs in place of the bytecode. The C file embeds the
+// chunk's .loxc image, for its constants, global names and line table.
+#define AOT_EXTENSION ".so"
+
+// Writes C source for `chunk`, compiled from `source` by `vm`, to `path`.
+// The global slot names are taken from the VM, as for writeCache().
+bool emitC(
+    Vm* vm,
+    const char path[static 1],
+    Chunk* chunk,
+    size_t sourceLength,
+    const char source[sourceLength]) ATTR_NONNULL(1, 3);
+// Compiles the C file at `sourcePath` into a shared object at `path` with
+// $CC, or cc if that is unset.
+bool buildSharedObject(
+    const char sourcePath[static 1],
+    const char path[static 1]);
+// Loads a shared object built from emitC() output and runs its chunk.
+// Reports INTERPRET_INVALID_CODE if it can't be loaded or was built for a
+// different VM.
+InterpretResult runSharedObject(Vm* vm, const char path[static 1])
+    ATTR_NONNULL(1);
+
+#endif
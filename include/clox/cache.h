@@ -0,0 +1,55 @@
+#ifndef CLOX_CACHE_H_
+#define CLOX_CACHE_H_
+
+#include <stdio.h>
+
+#include "attributes.h"
+#include "chunk.h"
+#include "common.h"
+
+// A .loxc file holds a compiled top-level chunk: its code, line table,
+// constants (with string hashes) and the names of the global slots the code
+// refers to. It is keyed by a hash of the VM's opcode set and string hash,
+// plus a hash of the source it was compiled from and the compiler options
+// it was compiled with.
+#define CACHE_EXTENSION ".loxc"
+#define CACHE_FORMAT_VERSION 2
+
+// Writes `chunk`, compiled from `source` by `vm`, to `path`. The global
+// slot names are taken from the VM, so it must not have run other code.
+bool writeCache(
+    Vm* vm,
+    const char path[static 1],
+    Chunk* chunk,
+    size_t sourceLength,
+    const char source[sourceLength]) ATTR_NONNULL(1, 3);
+
+// Writes the same image to an open `file`, e.g. to embed it elsewhere.
+bool writeCacheImage(
+    Vm* vm,
+    FILE* file,
+    Chunk* chunk,
+    size_t sourceLength,
+    const char source[sourceLength]) ATTR_NONNULL(1, 2, 3);
+
+// Maps `path` and fills `chunk` from it for `vm` if the file was written by
+// a compatible VM from the same `source`, with the current
+// g_COMPILER_OPTIONS. Pass a NULL source to skip those checks and run
+// whatever the cache holds. Returns false, leaving `chunk` empty, if the
+// cache can't be used.
+bool loadCache(
+    Vm* vm,
+    const char path[static 1],
+    size_t sourceLength,
+    const char source[sourceLength],
+    Chunk* chunk) ATTR_NONNULL(1, 5);
+// Like loadCache(), for an image already in memory.
+bool loadCacheImage(
+    Vm* vm,
+    size_t size,
+    const uint8_t data[size],
+    size_t sourceLength,
+    const char source[sourceLength],
+    Chunk* chunk) ATTR_NONNULL(1, 6);
+
+#endif
@@ -13,12 +13,12 @@
   X(TRUE) \
   X(FALSE) \
   X(POP) \
-  X(DEFINE_GLOBAL) \
-  X(DEFINE_GLOBAL_LONG) \
-  X(GET_GLOBAL) \
-  X(GET_GLOBAL_LONG) \
-  X(SET_GLOBAL) \
-  X(SET_GLOBAL_LONG) \
+  X(DEFINE_GLOBAL_SLOT) \
+  X(DEFINE_GLOBAL_SLOT_LONG) \
+  X(GET_GLOBAL_SLOT) \
+  X(GET_GLOBAL_SLOT_LONG) \
+  X(SET_GLOBAL_SLOT) \
+  X(SET_GLOBAL_SLOT_LONG) \
   X(GET_LOCAL) \
   X(GET_LOCAL_LONG) \
   X(SET_LOCAL) \
@@ -33,7 +33,24 @@
   X(NOT) \
   X(NEGATE) \
   X(PRINT) \
-  X(RETURN)
+  X(RETURN) \
+\
+  X(NOT_EQUAL) \
+  X(GREATER_EQUAL) \
+  X(LESS_EQUAL) \
+  X(GET_LOCAL2) \
+  X(ADD_LOCAL_CONST) \
+  X(SET_GLOBAL_SLOT_POP) \
+  X(SET_LOCAL_POP) \
+\
+  X(ADD_NUM) \
+  X(SUBTRACT_NUM) \
+  X(MULTIPLY_NUM) \
+  X(DIVIDE_NUM) \
+  X(GREATER_NUM) \
+  X(LESS_NUM) \
+  X(GREATER_EQUAL_NUM) \
+  X(LESS_EQUAL_NUM)
 
 typedef enum op_code_e
 {
@@ -42,20 +59,57 @@ typedef enum op_code_e
 #undef X
 } OpCode;
 
+enum
+{
+#define X(x) +1
+  OP_CODE_COUNT = 0 OPCODES_
+#undef X
+};
+
 extern const char* const g_OP_CODE_NAMES[];
 
+// Operand types seen by an arithmetic or comparison instruction. run()
+// rewrites a site that has only seen numbers into its _NUM form.
+typedef enum type_profile_e
+{
+  TYPE_PROFILE_NUMBER = 1 << 0,
+  TYPE_PROFILE_TEXT = 1 << 1,
+  TYPE_PROFILE_OTHER = 1 << 2,
+} TypeProfile;
+
 typedef struct chunk_s {
   int count;
   int capacity;
   uint8_t* code;
   LineArray lines;
   ValueArray constants;
+  // Open-addressed index over `constants` so a repeated literal reuses its
+  // slot. Each entry is a constant's index + 1, or 0 when empty.
+  int* constantSlots;
+  int constantSlotCapacity;
+  // deepest the stack gets, set by verifyChunk(); -1 until then
+  int maxStack;
+  // TypeProfile bits per code offset, allocated when the chunk first runs
+  uint8_t* typeProfiles;
 } Chunk;
 
 void initChunk(Chunk* chunk) ATTR_NONNULL(1);
 void writeChunk(Chunk* chunk, uint8_t byte, int line) ATTR_NONNULL(1);
+// Appends a whole instruction with a single line table update.
+void writeChunkCode(Chunk* chunk, const uint8_t* code, int length, int line)
+    ATTR_NONNULL(1, 2);
 void freeChunk(Chunk* chunk) ATTR_NONNULL(1);
-int addConstant(Chunk* chunk, Value value) ATTR_NONNULL(1);
-int writeConstant(Chunk* chunk, Value value, int line) ATTR_NONNULL(1);
+void truncateChunk(Chunk* chunk, int count) ATTR_NONNULL(1);
+// Returns the index of `value` in the constant pool, adding it if no
+// identical constant (same number bits or same interned string) exists yet.
+// `vm` keeps the value reachable while the pool grows.
+int addConstant(Vm* vm, Chunk* chunk, Value value) ATTR_NONNULL(1, 2);
+int writeConstant(Vm* vm, Chunk* chunk, Value value, int line)
+    ATTR_NONNULL(1, 2);
+// Size in bytes of an instruction with opcode `op`, operands included.
+int instructionLength(uint8_t op);
+// The instruction a quickened opcode was rewritten from; other opcodes are
+// returned unchanged.
+uint8_t genericOpcode(uint8_t op);
 
 #endif
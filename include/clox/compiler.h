@@ -9,6 +9,29 @@
 #include "object.h"
 #include "vm.h"
 
-bool compile(const char source[static 1], Chunk* chunk) ATTR_NONNULL(2);
+typedef struct compiler_options_s {
+  // 1: fold literal expressions while compiling, then run the peephole pass
+  // 2: also run the IR passes (see ir.h) before the peephole pass
+  int optimize;
+  // the chunk is a whole program, not a REPL line
+  bool wholeProgram;
+  // drop the line table once compiled; runtime errors recover the line by
+  // compiling the source again
+  bool stripLines;
+} CompilerOptions;
+
+// The options given on the command line, for whatever compiles on their
+// behalf. compile() itself only reads the options it is passed.
+extern CompilerOptions g_COMPILER_OPTIONS;
+
+// Compiles `source` into `chunk`, interning its strings and resolving its
+// globals in `vm`.
+bool compile(
+    Vm* vm,
+    const CompilerOptions* options,
+    size_t length,
+    const char source[length],
+    Chunk* chunk) ATTR_NONNULL(1, 2, 4, 5);
+void markCompilerRoots(Vm* vm) ATTR_NONNULL(1);
 
 #endif    // COMPILER_H_
@@ -4,7 +4,12 @@
 #include "attributes.h"
 #include "chunk.h"
 
-void disassembleChunk(Chunk* chunk, const char* name) ATTR_NONNULL(1);
-int disassembleInstruction(Chunk* chunk, int offset) ATTR_NONNULL(1);
+// `vm` names the chunk's global slots.
+void disassembleChunk(Vm* vm, Chunk* chunk, const char* name)
+    ATTR_NONNULL(1, 2);
+int disassembleInstruction(Vm* vm, Chunk* chunk, int offset)
+    ATTR_NONNULL(1, 2);
+// Lists the instructions that recorded operand types while the chunk ran.
+void disassembleTypeProfiles(Vm* vm, Chunk* chunk) ATTR_NONNULL(1, 2);
 
 #endif
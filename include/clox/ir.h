@@ -0,0 +1,25 @@
+#ifndef CLOX_IR_H_
+#define CLOX_IR_H_
+
+#include "attributes.h"
+#include "chunk.h"
+#include "common.h"
+
+// The optimizing tier. A finished chunk of straight-line code is lifted into
+// SSA form, where locals disappear into the values they hold, and optimized
+// there:
+// - literal operations exposed by copy propagation are folded;
+// - pure operations and global loads are value-numbered, so a repeated
+//   computation reuses the first result;
+// - stores to globals that are overwritten before anything can observe them
+//   are removed, and so are instructions whose results are never used and
+//   cannot raise an error.
+// The SSA form is then lowered back into the chunk, using stack slots as
+// registers for values that are used more than once.
+//
+// When `wholeProgram` is set nothing runs after the chunk, so a global that
+// is not read again is dead as well: this removes definitions of globals the
+// program never uses. It must not be set for REPL lines.
+void optimizeIr(Vm* vm, Chunk* chunk, bool wholeProgram) ATTR_NONNULL(1, 2);
+
+#endif
@@ -0,0 +1,58 @@
+#ifndef CLOX_JIT_H_
+#define CLOX_JIT_H_
+
+#include "attributes.h"
+#include "chunk.h"
+#include "common.h"
+#include "vm.h"
+
+// the JIT emits x86-64 code for the System V calling convention
+#if defined(JIT) && !(defined(__x86_64__) && defined(__unix__))
+#  undef JIT
+#endif
+
+typedef struct jit_options_s {
+  // compile chunks to machine code before running them; only has an effect
+  // when built with JIT
+  bool enabled;
+  // append each compiled chunk to /tmp/perf-<pid>.map, so perf can name it
+  bool perfMap;
+} JitOptions;
+
+extern JitOptions g_JIT_OPTIONS;
+
+// A place in compiled code that hands an instruction over to the VM.
+typedef struct jit_site_s {
+  // where its call returns to, from the start of the code
+  uint32_t native;
+  // offset of the instruction in the chunk
+  uint32_t bytecode;
+} JitSite;
+
+typedef struct jit_code_s {
+  // the VM slow paths run on
+  Vm* vm;
+  uint8_t* code;
+  size_t size;
+  const uint8_t* bytecode;
+  // in code order
+  JitSite* sites;
+  int siteCount;
+  int siteCapacity;
+} JitCode;
+
+// Translates a verified chunk into machine code in executable memory, one
+// native sequence per instruction. Returns false if the memory could not be
+// mapped; the chunk is then interpreted instead.
+bool compileJit(Vm* vm, const Chunk* chunk, JitCode* jit)
+    ATTR_NONNULL(1, 2, 3);
+// Runs compiled code with the VM's stack, which must be empty and have room
+// for the chunk's maxStack values, and its globals.
+InterpretResult runJit(
+    const JitCode* jit,
+    Value* stack,
+    Value* constants,
+    Value* globals) ATTR_NONNULL(1, 2);
+void freeJit(JitCode* jit) ATTR_NONNULL(1);
+
+#endif
@@ -2,21 +2,65 @@
 #define CLOX_LINE_H_
 
 #include "attributes.h"
+#include "common.h"
 
-typedef struct line_s {
+// Bytecode offsets map to source lines through runs of bytes that share a
+// line. Finished runs are delta-encoded as two varints, the run's length and
+// the zigzagged change of line, so most take two bytes. Every
+// LINE_CHECKPOINT_INTERVAL runs, a checkpoint records where a run starts;
+// lookups binary-search the checkpoints and decode at most that many runs.
+#define LINE_CHECKPOINT_INTERVAL 16
+
+typedef struct line_checkpoint_s {
+  // first byte of code the run covers
+  int offset;
+  // line of the run before it, which its delta is relative to
   int line;
-  int length;
-} Line;
+  // where the run is encoded in `runs`
+  int position;
+} LineCheckpoint;
 
 typedef struct line_array_s {
-  int count;
-  int capacity;
-  Line* lines;
+  uint8_t* runs;
+  int runBytes;
+  int runCapacity;
+  int runCount;
+  LineCheckpoint* checkpoints;
+  int checkpointCount;
+  int checkpointCapacity;
+  // line of the last finished run
+  int lastLine;
+  // the run still being added to, kept decoded
+  int line;
+  int start;
+  int length;
 } LineArray;
 
+// Walks a line table from the start.
+typedef struct line_cursor_s {
+  const LineArray* array;
+  int run;
+  int position;
+  // the run the cursor is on
+  int line;
+  int start;
+  int length;
+} LineCursor;
+
 void initLineArray(LineArray* array) ATTR_NONNULL(1);
 void freeLineArray(LineArray* array) ATTR_NONNULL(1);
-void addLineArray(LineArray* array, int line) ATTR_NONNULL(1);
-int getLine(LineArray* array, int offset) ATTR_NONNULL(1);
+// Records that the next `length` bytes of code come from `line`.
+void addLineArray(LineArray* array, int line, int length) ATTR_NONNULL(1);
+void truncateLineArray(LineArray* array, int removed) ATTR_NONNULL(1);
+// Returns 0 for an offset the table doesn't cover.
+int getLine(const LineArray* array, int offset) ATTR_NONNULL(1);
+
+void initLineCursor(LineCursor* cursor, const LineArray* array)
+    ATTR_NONNULL(1, 2);
+// Moves to the next run. Returns false at the end of the table.
+bool nextLineRun(LineCursor* cursor) ATTR_NONNULL(1);
+// Line of the byte at `offset`, which must not be before the previous
+// call's; 0 past the end of the table.
+int lineAt(LineCursor* cursor, int offset) ATTR_NONNULL(1);
 
 #endif
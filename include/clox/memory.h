@@ -2,6 +2,13 @@
 #define CLOX_MEMORY_H_
 
 #include "common.h"
+#include "value.h"
+
+#ifndef GC_HEAP_GROW_FACTOR
+#  define GC_HEAP_GROW_FACTOR 2
+#endif
+
+#define GC_INITIAL_HEAP_SIZE (1024 * 1024)
 
 #define ALLOCATE(type, count) (type*)reallocate(NULL, 0, sizeof(type) * (count))
 
@@ -16,7 +23,12 @@
   reallocate(pointer, sizeof(type) * (oldCount), 0)
 #define FREE(type, pointer) reallocate(pointer, sizeof(type), 0)
 
+// Charges the allocation to the VM bound to the calling thread (see
+// initVm()), which it may collect first.
 void* reallocate(void* pointer, size_t oldSize, size_t newSize);
-void freeObjects(void);
+void markObject(Vm* vm, Obj* object) ATTR_NONNULL(1);
+void markValue(Vm* vm, Value value) ATTR_NONNULL(1);
+void collectGarbage(Vm* vm) ATTR_NONNULL(1);
+void freeObjects(Vm* vm) ATTR_NONNULL(1);
 
 #endif
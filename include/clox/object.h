@@ -5,27 +5,67 @@
 #ifndef CLOX_OBJECT_H_
 #define CLOX_OBJECT_H_
 
+#include "attributes.h"
 #include "common.h"
 #include "value.h"
 
 typedef enum obj_type_e
-{ OBJ_STRING, } ObjType;
+{
+  OBJ_STRING,
+  OBJ_ROPE,
+} ObjType;
 
 struct obj_s {
   ObjType type;
+  bool isMarked;
   struct obj_s* next;
 };
 
 struct obj_string_s {
   Obj obj;
   int length;
-  char* chars;
   uint32_t hash;
+  // NUL-terminated, stored in the same allocation as the header
+  char chars[];
 };
 
-ObjString* copyString(int length, const char chars[length]);
-ObjString* takeString(int length, char chars[length]);
-void printObject(Value value);
+#define STRING_SIZE(length) (sizeof(ObjString) + (size_t)(length) + 1)
+
+// Concatenations at least this long produce a rope instead of a string.
+#define ROPE_MIN_LENGTH 64
+
+// A lazy concatenation of two strings or ropes. The characters only get
+// copied, hashed and interned once something needs to look at them.
+typedef struct obj_rope_s {
+  Obj obj;
+  int length;
+  Obj* left;
+  Obj* right;
+  // set by flattenRope(), which also drops left and right
+  ObjString* flattened;
+} ObjRope;
+
+uint64_t hashBytes(size_t length, const char key[length]);
+uint32_t hashString(int length, const char key[length]);
+// Objects belong to the VM that allocates them, and strings are interned in
+// its table.
+ObjString* copyString(Vm* vm, int length, const char chars[length])
+    ATTR_NONNULL(1);
+// copyString() for callers that already know the hash, e.g. a bytecode cache.
+ObjString* copyHashedString(
+    Vm* vm,
+    int length,
+    const char chars[length],
+    uint32_t hash) ATTR_NONNULL(1);
+// Returns a fresh, uninterned string for the caller to fill in; pass it to
+// takeString() before any other allocation happens.
+ObjString* makeString(Vm* vm, int length) ATTR_NONNULL(1);
+ObjString* takeString(Vm* vm, ObjString* string) ATTR_NONNULL(1, 2);
+ObjRope* makeRope(Vm* vm, Obj* left, Obj* right, int length)
+    ATTR_NONNULL(1, 2, 3);
+ObjString* flattenRope(Vm* vm, ObjRope* rope) ATTR_NONNULL(1, 2);
+int textLength(Obj* text) ATTR_NONNULL(1);
+void printObject(Vm* vm, Value value) ATTR_NONNULL(1);
 
 #define IS_OBJ_TYPE(value, objType) \
   ({ \
@@ -35,8 +75,18 @@ void printObject(Value value);
 
 #define OBJ_TYPE(value) (AS_OBJ(value)->type)
 #define IS_STRING(value) IS_OBJ_TYPE(value, OBJ_STRING)
+#define IS_ROPE(value) IS_OBJ_TYPE(value, OBJ_ROPE)
+// anything `+` can concatenate
+#define IS_TEXT(value) \
+  ({ \
+    __typeof(value) text_ = (value); \
+    IS_OBJ(text_) \
+        && (AS_OBJ(text_)->type == OBJ_STRING \
+            || AS_OBJ(text_)->type == OBJ_ROPE); \
+  })
 
 #define AS_STRING(value) ((ObjString*)AS_OBJ(value))
 #define AS_CSTRING(value) (((ObjString*)AS_OBJ(value))->chars)
+#define AS_ROPE(value) ((ObjRope*)AS_OBJ(value))
 
 #endif    // CLOX_OBJECT_H_
@@ -0,0 +1,29 @@
+#ifndef CLOX_OPTIMIZER_H_
+#define CLOX_OPTIMIZER_H_
+
+#include "attributes.h"
+#include "chunk.h"
+#include "common.h"
+#include "value.h"
+
+// If the instruction at `offset` pushes a literal (a constant, nil, true or
+// false), stores it in `value` and returns true.
+bool instructionConstant(Chunk* chunk, int offset, Value* value)
+    ATTR_NONNULL(1, 3);
+
+// Evaluate `op` on literal operands at compile time. They return false,
+// leaving the work for run time, when the operation would raise an error,
+// has no compile-time meaning or would build a very long string. String
+// results are interned in `vm`, so the caller's chunk must be reachable by
+// its collector.
+bool foldUnary(OpCode op, Value operand, Value* result) ATTR_NONNULL(3);
+bool foldBinary(Vm* vm, OpCode op, Value a, Value b, Value* result)
+    ATTR_NONNULL(1, 5);
+
+// Peephole pass over a finished chunk: drops pushes that are immediately
+// popped and redundant NOT pairs, folds literal operations the compiler
+// could not see, and re-forms superinstructions. Lines are carried over
+// instruction by instruction. The chunk must contain straight-line code.
+void optimizeChunk(Vm* vm, Chunk* chunk) ATTR_NONNULL(1, 2);
+
+#endif
@@ -0,0 +1,17 @@
+#ifndef CLOX_POOL_H_
+#define CLOX_POOL_H_
+
+#include "common.h"
+
+// Requests up to this size are served from per-size-class free lists carved
+// out of bump-allocated slabs; anything bigger goes to libc.
+#define POOL_MAX_SIZE 256
+#define POOL_GRANULARITY 16
+#define POOL_SLAB_SIZE (64 * 1024)
+
+// Each thread has one pool; initializing it again before freeing it aborts.
+void initPool(void);
+void freePool(void);
+void* poolReallocate(void* pointer, size_t oldSize, size_t newSize);
+
+#endif
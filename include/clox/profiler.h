@@ -0,0 +1,63 @@
+#ifndef CLOX_PROFILER_H_
+#define CLOX_PROFILER_H_
+
+#include <signal.h>
+#include <stdio.h>
+
+#include "attributes.h"
+#include "chunk.h"
+#include "common.h"
+
+// script.lox's folded stacks go to script.folded
+#define PROFILE_EXTENSION ".folded"
+
+// How often SIGPROF samples the running instruction, in microseconds of CPU
+// time.
+#define PROFILE_SAMPLE_INTERVAL 1000
+
+// Where a run spent its instructions and its time. run() counts every
+// instruction it dispatches while vm->profile is set, and a SIGPROF timer
+// samples which one is running. One chunk is profiled at a time; the
+// per-instruction data is that of the last chunk run.
+typedef struct profile_s {
+  uint64_t opcodes[OP_CODE_COUNT];
+  // [a][b] counts b dispatched right after a
+  uint64_t pairs[OP_CODE_COUNT][OP_CODE_COUNT];
+  uint64_t instructionCount;
+  uint64_t sampleCount;
+  // per byte of the profiled chunk's code, nonzero only where an
+  // instruction starts
+  int codeSize;
+  uint64_t* executions;
+  uint64_t* samples;
+  // filled in by stopProfile(), while the chunk still exists
+  uint8_t* code;
+  int* lines;
+  // offset of the instruction last dispatched, or -1 before the first;
+  // read by the SIGPROF handler
+  volatile sig_atomic_t current;
+  uint8_t previous;
+  struct sigaction previousAction;
+} Profile;
+
+void initProfile(Profile* profile) ATTR_NONNULL(1);
+void freeProfile(Profile* profile) ATTR_NONNULL(1);
+// Sizes the per-instruction data for `chunk` and starts sampling. Only one
+// profile can sample at a time.
+void startProfile(Profile* profile, const Chunk* chunk) ATTR_NONNULL(1, 2);
+// Stops sampling, and resolves the line of each instruction through the
+// chunk's line table.
+void stopProfile(Profile* profile, const Chunk* chunk) ATTR_NONNULL(1, 2);
+void countInstruction(Profile* profile, uint8_t instruction, int offset)
+    ATTR_NONNULL(1);
+
+// Opcode counts, the most frequent opcode pairs, and the hottest lines.
+void printProfile(const Profile* profile, FILE* out) ATTR_NONNULL(1, 2);
+// Writes the samples as "script;line N;OP_X count" lines, the folded stack
+// format flame graph tools read.
+bool writeFoldedStacks(
+    const Profile* profile,
+    const char* script,
+    const char* path) ATTR_NONNULL(1, 2, 3);
+
+#endif
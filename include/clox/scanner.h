@@ -5,6 +5,10 @@
 #ifndef SCANNER_H_
 #define SCANNER_H_
 
+#include <stddef.h>
+
+#include "attributes.h"
+
 #define TOKENS_ \
   X(LEFT_PAREN) \
   X(RIGHT_PAREN) \
@@ -65,9 +69,21 @@ typedef struct token_s {
   int line;
 } Token;
 
+typedef struct scanner_s {
+  const char* start;
+  const char* current;
+  // one past the last byte; the source need not be NUL-terminated, so
+  // nothing may read at or beyond this
+  const char* end;
+  int line;
+} Scanner;
+
 extern const char* g_TOKEN_NAMES[];
 
-void initScanner(const char source[static 1]);
-Token scanToken(void);
+void initScanner(
+    Scanner* scanner,
+    size_t length,
+    const char source[length]) ATTR_NONNULL(1);
+Token scanToken(Scanner* scanner) ATTR_NONNULL(1);
 
 #endif    // SCANNER_H_
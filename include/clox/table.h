@@ -18,6 +18,10 @@ typedef struct table_s {
   int count;
   int capacity;
   Entry* entries;
+#ifdef SWISS_TABLE
+  // one control byte per entry; see table.c
+  uint8_t* control;
+#endif
 } Table;
 
 void initTable(Table* table) ATTR_NONNULL(1);
@@ -31,5 +35,7 @@ ObjString* tableFindString(
     int length,
     const char chars[length],
     uint32_t hash) ATTR_NONNULL(1);
+void tableRemoveWhite(Table* table) ATTR_NONNULL(1);
+void markTable(Vm* vm, Table* table) ATTR_NONNULL(1, 2);
 
 #endif    // TABLE_H_
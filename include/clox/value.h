@@ -6,6 +6,59 @@
 
 typedef struct obj_s Obj;
 typedef struct obj_string_s ObjString;
+// see vm.h
+typedef struct vm_s Vm;
+
+#ifdef NAN_BOXING
+
+#  include <string.h>
+
+// A Value is a single 64-bit word. Numbers are stored as-is; everything else
+// lives inside the payload of a quiet NaN. Objects additionally set the sign
+// bit and keep their pointer in the low 48 bits.
+typedef uint64_t Value;
+
+#  define SIGN_BIT ((uint64_t)0x8000000000000000)
+#  define QNAN ((uint64_t)0x7ffc000000000000)
+
+#  define TAG_NIL 1
+#  define TAG_FALSE 2
+#  define TAG_TRUE 3
+#  define TAG_UNDEFINED 4
+
+#  define FALSE_VAL ((Value)(uint64_t)(QNAN | TAG_FALSE))
+#  define TRUE_VAL ((Value)(uint64_t)(QNAN | TAG_TRUE))
+
+#  define BOOL_VAL(value) ((value) ? TRUE_VAL : FALSE_VAL)
+#  define NIL_VAL ((Value)(uint64_t)(QNAN | TAG_NIL))
+#  define UNDEFINED_VAL ((Value)(uint64_t)(QNAN | TAG_UNDEFINED))
+#  define NUMBER_VAL(value) numToValue(value)
+#  define OBJ_VAL(object) \
+    ((Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(object)))
+
+#  define IS_BOOL(value) (((value) | 1) == TRUE_VAL)
+#  define IS_NIL(value) ((value) == NIL_VAL)
+#  define IS_UNDEFINED(value) ((value) == UNDEFINED_VAL)
+#  define IS_NUMBER(value) (((value)&QNAN) != QNAN)
+#  define IS_OBJ(value) (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
+
+#  define AS_BOOL(value) ((value) == TRUE_VAL)
+#  define AS_NUMBER(value) valueToNum(value)
+#  define AS_OBJ(value) ((Obj*)(uintptr_t)((value) & ~(SIGN_BIT | QNAN)))
+
+static inline double valueToNum(Value value) {
+  double num;
+  memcpy(&num, &value, sizeof(Value));
+  return num;
+}
+
+static inline Value numToValue(double num) {
+  Value value;
+  memcpy(&value, &num, sizeof(double));
+  return value;
+}
+
+#else
 
 typedef enum value_type_e
 {
@@ -13,6 +66,8 @@ typedef enum value_type_e
   VAL_NIL,
   VAL_NUMBER,
   VAL_OBJ,
+  // never visible to Lox code: marks a global slot nothing has defined yet
+  VAL_UNDEFINED,
 } ValueType;
 
 typedef struct value_s {
@@ -24,21 +79,26 @@ typedef struct value_s {
   } as;
 } Value;
 
-#define BOOL_VAL(value) ((Value){.type = VAL_BOOL, .as = {.boolean = (value)}})
-#define NIL_VAL ((Value){.type = VAL_NIL, .as = {.number = 0}})
-#define NUMBER_VAL(value) \
-  ((Value){.type = VAL_NUMBER, .as = {.number = (value)}})
-#define OBJ_VAL(object) \
-  ((Value){.type = VAL_OBJ, .as = {.obj = (Obj*)(object)}})
+#  define BOOL_VAL(value) \
+    ((Value){.type = VAL_BOOL, .as = {.boolean = (value)}})
+#  define NIL_VAL ((Value){.type = VAL_NIL, .as = {.number = 0}})
+#  define UNDEFINED_VAL ((Value){.type = VAL_UNDEFINED, .as = {.number = 0}})
+#  define NUMBER_VAL(value) \
+    ((Value){.type = VAL_NUMBER, .as = {.number = (value)}})
+#  define OBJ_VAL(object) \
+    ((Value){.type = VAL_OBJ, .as = {.obj = (Obj*)(object)}})
+
+#  define IS_BOOL(value) ((value).type == VAL_BOOL)
+#  define IS_NIL(value) ((value).type == VAL_NIL)
+#  define IS_UNDEFINED(value) ((value).type == VAL_UNDEFINED)
+#  define IS_NUMBER(value) ((value).type == VAL_NUMBER)
+#  define IS_OBJ(value) ((value).type == VAL_OBJ)
 
-#define IS_BOOL(value) ((value).type == VAL_BOOL)
-#define IS_NIL(value) ((value).type == VAL_NIL)
-#define IS_NUMBER(value) ((value).type == VAL_NUMBER)
-#define IS_OBJ(value) ((value).type == VAL_OBJ)
+#  define AS_BOOL(value) ((value).as.boolean)
+#  define AS_NUMBER(value) ((value).as.number)
+#  define AS_OBJ(value) ((value).as.obj)
 
-#define AS_BOOL(value) ((value).as.boolean)
-#define AS_NUMBER(value) ((value).as.number)
-#define AS_OBJ(value) ((value).as.obj)
+#endif
 
 typedef struct value_array_s {
   int capacity;
@@ -49,6 +109,6 @@ typedef struct value_array_s {
 void initValueArray(ValueArray* array) ATTR_NONNULL(1);
 void writeValueArray(ValueArray* array, Value value) ATTR_NONNULL(1);
 void freeValueArray(ValueArray* array) ATTR_NONNULL(1);
-void printValue(Value value);
+void printValue(Vm* vm, Value value) ATTR_NONNULL(1);
 
 #endif
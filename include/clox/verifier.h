@@ -0,0 +1,23 @@
+#ifndef CLOX_VERIFIER_H_
+#define CLOX_VERIFIER_H_
+
+#include "attributes.h"
+#include "chunk.h"
+#include "common.h"
+
+typedef struct verification_s {
+  // what is wrong with the chunk, or NULL if it is valid
+  const char* error;
+  // offset of the offending instruction
+  int offset;
+} Verification;
+
+// Checks, in one pass over the code, everything run() takes on trust: that
+// each opcode exists and its operands fit in the code, that constant, global
+// and local operands are in range, that the stack never underflows and is
+// empty again at OP_RETURN, and that the code ends with one. On success
+// records the deepest the stack gets in `chunk->maxStack`; the chunk must not
+// change afterwards.
+Verification verifyChunk(Chunk* chunk, uint32_t globalCount) ATTR_NONNULL(1);
+
+#endif
@@ -6,14 +6,35 @@
 
 #define STACK_MAX 256
 
+// All of an interpreter's state. Any number of them can exist, each used by
+// one thread at a time.
 typedef struct vm_s {
   Chunk* chunk;
   uint8_t* ip;
+  // what the running chunk was compiled from, if known
+  const char* source;
+  size_t sourceLength;
   ValueArray stack;
   Value* stackTop;
   Obj* objects;
   Table strings;
-  Table globals;
+  // Globals are resolved to slots at compile time: globalSlots maps each
+  // name to its index in globalValues, whose unassigned slots hold
+  // UNDEFINED_VAL. globalNames maps back for error messages.
+  Table globalSlots;
+  ValueArray globalValues;
+  ValueArray globalNames;
+  size_t bytesAllocated;
+  size_t nextGC;
+  int grayCount;
+  int grayCapacity;
+  Obj** grayStack;
+  // the compile() calls in progress, innermost first; their constants are
+  // roots
+  struct compiler_s* compiler;
+  // when set, chunks are interpreted (not compiled) and every instruction
+  // they run is counted in it; see profiler.h
+  struct profile_s* profile;
 } Vm;
 
 typedef enum interpret_result_e
@@ -21,12 +42,52 @@ typedef enum interpret_result_e
   INTERPRET_OK,
   INTERPRET_COMPILE_ERROR,
   INTERPRET_RUNTIME_ERROR,
+  // the chunk failed verification and was not run
+  INTERPRET_INVALID_CODE,
 } InterpretResult;
 
-void initVm();
-void freeVm();
-InterpretResult interpret(const char source[static 1]);
-void push(Value value);
-Value pop(void);
+// Also binds `vm` to the calling thread until freeVm(): reallocate() charges
+// the thread's allocations to it. A thread can have one VM at a time, and
+// must use no other; initializing a second one aborts.
+void initVm(Vm* vm) ATTR_NONNULL(1);
+void freeVm(Vm* vm) ATTR_NONNULL(1);
+InterpretResult interpret(Vm* vm, size_t length, const char source[length])
+    ATTR_NONNULL(1);
+// Runs an already compiled chunk, e.g. one loaded from a bytecode cache.
+// It is verified first unless that has already been done.
+// `source` may be NULL; if given, it must be what the chunk was compiled
+// from, and is used to find lines for errors when they were stripped.
+InterpretResult interpretChunk(
+    Vm* vm,
+    Chunk* chunk,
+    size_t sourceLength,
+    const char source[sourceLength]) ATTR_NONNULL(1, 2);
+// Code for a chunk that was compiled outside the VM, e.g. a shared object
+// built by aot.c. It runs with the VM's stack, constants and globals, hands
+// the instructions it can't finish to `slowPath` (runSlowPath()) with their
+// address in `code`, and returns INTERPRET_OK or INTERPRET_RUNTIME_ERROR.
+typedef InterpretResult (*NativeChunk)(
+    Vm* vm,
+    Value* stack,
+    Value* constants,
+    Value* globals,
+    const uint8_t* code,
+    Value* (*slowPath)(Vm* vm, Value* stackTop, const uint8_t* ip));
+// Like interpretChunk(), but runs `native` in place of the chunk's code.
+InterpretResult interpretNativeChunk(
+    Vm* vm,
+    Chunk* chunk,
+    NativeChunk native,
+    size_t sourceLength,
+    const char source[sourceLength]) ATTR_NONNULL(1, 2, 3);
+uint32_t globalSlot(Vm* vm, ObjString* name) ATTR_NONNULL(1, 2);
+void push(Vm* vm, Value value) ATTR_NONNULL(1);
+Value pop(Vm* vm) ATTR_NONNULL(1);
+// For code compiled by jit.c or aot.c: finishes the instruction at `ip` where
+// its native sequence hands over to the VM, i.e. equality, printing, string
+// concatenation and runtime errors. The stack ends at `stackTop`. Returns the
+// new stack top, or NULL after a runtime error.
+Value* runSlowPath(Vm* vm, Value* stackTop, const uint8_t* ip)
+    ATTR_NONNULL(1, 2, 3);
 
 #endif
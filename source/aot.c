@@ -0,0 +1,523 @@
+#include <assert.h>
+#include <dlfcn.h>
+#include <inttypes.h>
+#include <math.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+
+#include <clox/aot.h>
+#include <clox/cache.h>
+#include <clox/memory.h>
+#include <clox/object.h>
+
+extern char** environ;
+
+// Instructions per generated function. The C compiler's optimizer is
+// superlinear in function size, so long chunks are split up.
+#define PART_INSTRUCTIONS 512
+
+// Names the value representation the generated code was written for; a
+// shared object only runs on a VM that gives the same one.
+#ifdef NAN_BOXING
+#  define AOT_ABI "clox-aot 2 nan-boxing"
+#else
+#  define AOT_ABI "clox-aot 2 tagged-union"
+#endif
+
+#pragma region "emitting"
+
+// The generated file repeats the VM's Value layout, since it is built
+// without clox's headers.
+static void emitValueType(FILE* file) {
+#ifdef NAN_BOXING
+  fprintf(
+      file,
+      "typedef uint64_t Value;\n"
+      "\n"
+      "#define QNAN UINT64_C(0x%016" PRIx64 ")\n"
+      "#define NIL_VAL UINT64_C(0x%016" PRIx64 ")\n"
+      "#define FALSE_VAL UINT64_C(0x%016" PRIx64 ")\n"
+      "#define TRUE_VAL UINT64_C(0x%016" PRIx64 ")\n"
+      "#define UNDEFINED_VAL UINT64_C(0x%016" PRIx64 ")\n"
+      "\n"
+      "static inline int isNumber(Value value) {\n"
+      "  return (value & QNAN) != QNAN;\n"
+      "}\n"
+      "static inline double asNumber(Value value) {\n"
+      "  double number;\n"
+      "  memcpy(&number, &value, sizeof(number));\n"
+      "  return number;\n"
+      "}\n"
+      "static inline Value number(double number) {\n"
+      "  Value value;\n"
+      "  memcpy(&value, &number, sizeof(value));\n"
+      "  return value;\n"
+      "}\n"
+      "static inline Value boolean(int boolean) {\n"
+      "  return boolean ? TRUE_VAL : FALSE_VAL;\n"
+      "}\n"
+      "static inline int isUndefined(Value value) {\n"
+      "  return value == UNDEFINED_VAL;\n"
+      "}\n"
+      "static inline int isFalsey(Value value) {\n"
+      "  return value == NIL_VAL || value == FALSE_VAL;\n"
+      "}\n",
+      QNAN,
+      NIL_VAL,
+      FALSE_VAL,
+      TRUE_VAL,
+      UNDEFINED_VAL);
+#else
+  fprintf(
+      file,
+      "typedef struct {\n"
+      "  int type;\n"
+      "  union {\n"
+      "    _Bool boolean;\n"
+      "    double number;\n"
+      "    void* obj;\n"
+      "  } as;\n"
+      "} Value;\n"
+      "\n"
+      "enum { VAL_BOOL = %d, VAL_NIL = %d, VAL_NUMBER = %d, "
+      "VAL_UNDEFINED = %d };\n"
+      "\n"
+      "#define NIL_VAL ((Value){.type = VAL_NIL})\n"
+      "\n"
+      "static inline int isNumber(Value value) {\n"
+      "  return value.type == VAL_NUMBER;\n"
+      "}\n"
+      "static inline double asNumber(Value value) {\n"
+      "  return value.as.number;\n"
+      "}\n"
+      "static inline Value number(double number) {\n"
+      "  return (Value){.type = VAL_NUMBER, .as = {.number = number}};\n"
+      "}\n"
+      "static inline Value boolean(int boolean) {\n"
+      "  return (Value){.type = VAL_BOOL, .as = {.boolean = boolean}};\n"
+      "}\n"
+      "static inline int isUndefined(Value value) {\n"
+      "  return value.type == VAL_UNDEFINED;\n"
+      "}\n"
+      "static inline int isFalsey(Value value) {\n"
+      "  return value.type == VAL_NIL\n"
+      "      || (value.type == VAL_BOOL && !value.as.boolean);\n"
+      "}\n",
+      VAL_BOOL,
+      VAL_NIL,
+      VAL_NUMBER,
+      VAL_UNDEFINED);
+#endif
+  fprintf(
+      file,
+      "\n_Static_assert(sizeof(Value) == %zu, \"clox Value layout\");\n",
+      sizeof(Value));
+}
+
+// One macro per instruction, each the fast path of its run() case. What they
+// can't finish goes to the VM through SLOW(), as in compiled JIT code.
+static const char g_PRIMITIVES[] =
+    "typedef struct vm_s Vm;\n"
+    "typedef Value* (*SlowPath)(Vm* vm, Value* stackTop, const uint8_t* ip);\n"
+    "\n"
+    "typedef struct {\n"
+    "  Vm* vm;\n"
+    "  Value* stack;\n"
+    "  const Value* constants;\n"
+    "  Value* globals;\n"
+    "  const uint8_t* code;\n"
+    "  SlowPath slowPath;\n"
+    "} Frame;\n"
+    "\n"
+    "#define SLOW(offset) \\\n"
+    "  do { \\\n"
+    "    if (!(top = f->slowPath(f->vm, top, f->code + (offset)))) { \\\n"
+    "      return 0; \\\n"
+    "    } \\\n"
+    "  } while (0)\n"
+    "#define PUSH(value) (*top++ = (value))\n"
+    "#define CONSTANT(index) PUSH(f->constants[index])\n"
+    "#define NUMBER(literal) PUSH(number(literal))\n"
+    "#define POP() (--top)\n"
+    "#define DEFINE_GLOBAL(slot) (f->globals[slot] = *--top)\n"
+    "#define GET_GLOBAL(offset, slot) \\\n"
+    "  do { \\\n"
+    "    if (isUndefined(f->globals[slot])) { \\\n"
+    "      SLOW(offset); \\\n"
+    "    } else { \\\n"
+    "      PUSH(f->globals[slot]); \\\n"
+    "    } \\\n"
+    "  } while (0)\n"
+    "#define SET_GLOBAL(offset, slot, drop) \\\n"
+    "  do { \\\n"
+    "    if (isUndefined(f->globals[slot])) { \\\n"
+    "      SLOW(offset); \\\n"
+    "    } else { \\\n"
+    "      f->globals[slot] = top[-1]; \\\n"
+    "      top -= (drop); \\\n"
+    "    } \\\n"
+    "  } while (0)\n"
+    "#define GET_LOCAL(slot) PUSH(f->stack[slot])\n"
+    "#define SET_LOCAL(slot, drop) \\\n"
+    "  (f->stack[slot] = top[-1], top -= (drop))\n"
+    "/* the second slot may be the one the first push fills */\n"
+    "#define GET_LOCAL2(first, second) \\\n"
+    "  (top[0] = f->stack[first], top[1] = f->stack[second], top += 2)\n"
+    "#define BINARY(offset, result) \\\n"
+    "  do { \\\n"
+    "    if (isNumber(top[-2]) && isNumber(top[-1])) { \\\n"
+    "      double a = asNumber(top[-2]); \\\n"
+    "      double b = asNumber(top[-1]); \\\n"
+    "      top[-2] = (result); \\\n"
+    "      --top; \\\n"
+    "    } else { \\\n"
+    "      SLOW(offset); \\\n"
+    "    } \\\n"
+    "  } while (0)\n"
+    "#define NEGATE(offset) \\\n"
+    "  do { \\\n"
+    "    if (isNumber(top[-1])) { \\\n"
+    "      top[-1] = number(-asNumber(top[-1])); \\\n"
+    "    } else { \\\n"
+    "      SLOW(offset); \\\n"
+    "    } \\\n"
+    "  } while (0)\n"
+    "#define NOT() (top[-1] = boolean(isFalsey(top[-1])))\n"
+    "#define ADD_LOCAL_NUMBER(offset, slot, literal) \\\n"
+    "  do { \\\n"
+    "    if (isNumber(f->stack[slot])) { \\\n"
+    "      PUSH(number(asNumber(f->stack[slot]) + (literal))); \\\n"
+    "    } else { \\\n"
+    "      SLOW(offset); \\\n"
+    "    } \\\n"
+    "  } while (0)\n";
+
+// The instruction's first operand, a slot or constant index; 0 if it has
+// none.
+static uint32_t readOperand(const uint8_t* ip) {
+  switch (instructionLength(ip[0])) {
+    case 1:
+      return 0;
+    case 4:
+      return ip[1] | (ip[2] << 8) | ((uint32_t)ip[3] << 16);
+    default:
+      return ip[1];
+  }
+}
+
+// Numbers are written into the code as exact hex literals. Infinities and
+// NaNs, which only constant folding makes, are read from the table instead.
+static void emitNumber(FILE* file, const Chunk* chunk, uint32_t constant) {
+  double number = AS_NUMBER(chunk->constants.values[constant]);
+  if (isfinite(number)) {
+    fprintf(file, "%a", number);
+  } else {
+    fprintf(file, "asNumber(f->constants[%" PRIu32 "])", constant);
+  }
+}
+
+static void emitInstruction(
+    FILE* file,
+    const Chunk* chunk,
+    const uint8_t* ip) {
+  int offset = (int)(ip - chunk->code);
+  uint32_t operand = readOperand(ip);
+  fputs("  ", file);
+  switch (genericOpcode(ip[0])) {
+    case OP_CONSTANT:
+    case OP_CONSTANT_LONG:
+      if (IS_NUMBER(chunk->constants.values[operand])) {
+        fputs("NUMBER(", file);
+        emitNumber(file, chunk, operand);
+        fputs(")", file);
+      } else {
+        fprintf(file, "CONSTANT(%" PRIu32 ")", operand);
+      }
+      break;
+    case OP_NIL:
+      fputs("PUSH(NIL_VAL)", file);
+      break;
+    case OP_TRUE:
+      fputs("PUSH(boolean(1))", file);
+      break;
+    case OP_FALSE:
+      fputs("PUSH(boolean(0))", file);
+      break;
+    case OP_POP:
+      fputs("POP()", file);
+      break;
+    case OP_DEFINE_GLOBAL_SLOT:
+    case OP_DEFINE_GLOBAL_SLOT_LONG:
+      fprintf(file, "DEFINE_GLOBAL(%" PRIu32 ")", operand);
+      break;
+    case OP_GET_GLOBAL_SLOT:
+    case OP_GET_GLOBAL_SLOT_LONG:
+      fprintf(file, "GET_GLOBAL(%d, %" PRIu32 ")", offset, operand);
+      break;
+    case OP_SET_GLOBAL_SLOT:
+    case OP_SET_GLOBAL_SLOT_LONG:
+      fprintf(file, "SET_GLOBAL(%d, %" PRIu32 ", 0)", offset, operand);
+      break;
+    case OP_SET_GLOBAL_SLOT_POP:
+      fprintf(file, "SET_GLOBAL(%d, %" PRIu32 ", 1)", offset, operand);
+      break;
+    case OP_GET_LOCAL:
+    case OP_GET_LOCAL_LONG:
+      fprintf(file, "GET_LOCAL(%" PRIu32 ")", operand);
+      break;
+    case OP_SET_LOCAL:
+    case OP_SET_LOCAL_LONG:
+      fprintf(file, "SET_LOCAL(%" PRIu32 ", 0)", operand);
+      break;
+    case OP_SET_LOCAL_POP:
+      fprintf(file, "SET_LOCAL(%" PRIu32 ", 1)", operand);
+      break;
+    case OP_GET_LOCAL2:
+      fprintf(file, "GET_LOCAL2(%d, %d)", ip[1], ip[2]);
+      break;
+    case OP_ADD:
+      fprintf(file, "BINARY(%d, number(a + b))", offset);
+      break;
+    case OP_SUBTRACT:
+      fprintf(file, "BINARY(%d, number(a - b))", offset);
+      break;
+    case OP_MULTIPLY:
+      fprintf(file, "BINARY(%d, number(a * b))", offset);
+      break;
+    case OP_DIVIDE:
+      fprintf(file, "BINARY(%d, number(a / b))", offset);
+      break;
+    case OP_GREATER:
+      fprintf(file, "BINARY(%d, boolean(a > b))", offset);
+      break;
+    case OP_LESS:
+      fprintf(file, "BINARY(%d, boolean(a < b))", offset);
+      break;
+    case OP_GREATER_EQUAL:
+      // written as run() computes it, which matters for NaN
+      fprintf(file, "BINARY(%d, boolean(!(a < b)))", offset);
+      break;
+    case OP_LESS_EQUAL:
+      fprintf(file, "BINARY(%d, boolean(!(a > b)))", offset);
+      break;
+    case OP_EQUAL:
+      // anything but two numbers may involve a rope, which the VM flattens
+      fprintf(file, "BINARY(%d, boolean(a == b))", offset);
+      break;
+    case OP_NOT_EQUAL:
+      fprintf(file, "BINARY(%d, boolean(a != b))", offset);
+      break;
+    case OP_NEGATE:
+      fprintf(file, "NEGATE(%d)", offset);
+      break;
+    case OP_NOT:
+      fputs("NOT()", file);
+      break;
+    case OP_ADD_LOCAL_CONST:
+      if (IS_NUMBER(chunk->constants.values[ip[2]])) {
+        fprintf(file, "ADD_LOCAL_NUMBER(%d, %d, ", offset, ip[1]);
+        emitNumber(file, chunk, ip[2]);
+        fputs(")", file);
+      } else {
+        fprintf(file, "SLOW(%d)", offset);
+      }
+      break;
+    case OP_PRINT:
+      fprintf(file, "SLOW(%d)", offset);
+      break;
+    default:
+      assert(false);
+  }
+  fputs(";\n", file);
+}
+
+// Emits the code up to the chunk's first OP_RETURN as functions of at most
+// PART_INSTRUCTIONS instructions each, and returns how many there are.
+static int emitParts(FILE* file, const Chunk* chunk) {
+  int parts = 0;
+  const uint8_t* ip = chunk->code;
+  while (*ip != OP_RETURN) {
+    fprintf(
+        file,
+        "\nstatic Value* part%d(Value* top, const Frame* f) {\n",
+        parts++);
+    for (int i = 0; i < PART_INSTRUCTIONS && *ip != OP_RETURN; ++i) {
+      emitInstruction(file, chunk, ip);
+      ip += instructionLength(*ip);
+    }
+    fputs("  return top;\n}\n", file);
+  }
+  return parts;
+}
+
+static bool emitImage(
+    Vm* vm,
+    FILE* file,
+    Chunk* chunk,
+    size_t sourceLength,
+    const char source[sourceLength]) {
+  char* image;
+  size_t size;
+  FILE* stream = open_memstream(&image, &size);
+  if (!stream) {
+    return false;
+  }
+  bool ok = writeCacheImage(vm, stream, chunk, sourceLength, source);
+  ok = fclose(stream) == 0 && ok;
+  if (ok) {
+    fputs("\nconst unsigned char lox_image[] = {", file);
+    for (size_t i = 0; i < size; ++i) {
+      fprintf(file, "%s0x%02x,", i % 12 == 0 ? "\n   " : "", image[i] & 0xff);
+    }
+    fputs("\n};\nconst size_t lox_image_size = sizeof(lox_image);\n", file);
+  }
+  free(image);
+  return ok;
+}
+
+bool emitC(
+    Vm* vm,
+    const char path[static 1],
+    Chunk* chunk,
+    size_t sourceLength,
+    const char source[sourceLength]) {
+  FILE* file = fopen(path, "we");
+  if (!file) {
+    return false;
+  }
+
+  fputs(
+      "// Generated by clox --emit-c. Build it with\n"
+      "//   cc -O2 -shared -fPIC -o script.so script.c\n"
+      "// and run it with clox script.so.\n"
+      "\n"
+      "#include <stddef.h>\n"
+      "#include <stdint.h>\n"
+      "#include <string.h>\n"
+      "\n",
+      file);
+  emitValueType(file);
+  fprintf(file, "\n%s", g_PRIMITIVES);
+  fprintf(file, "\nconst char lox_abi[] = \"%s\";\n", AOT_ABI);
+  bool ok = emitImage(vm, file, chunk, sourceLength, source);
+
+  int parts = emitParts(file, chunk);
+  fputs(
+      "\nstatic Value* (*const g_PARTS[])(Value*, const Frame*) = {\n",
+      file);
+  for (int i = 0; i < parts; ++i) {
+    fprintf(file, "    part%d,\n", i);
+  }
+  // an empty initializer list is not C
+  fputs("    0,\n};\n", file);
+  fprintf(
+      file,
+      "\n"
+      "int lox_run(\n"
+      "    Vm* vm,\n"
+      "    Value* stack,\n"
+      "    const Value* constants,\n"
+      "    Value* globals,\n"
+      "    const uint8_t* code,\n"
+      "    SlowPath slowPath) {\n"
+      "  const Frame frame = {vm, stack, constants, globals, code, slowPath};\n"
+      "  Value* top = stack;\n"
+      "  for (int i = 0; g_PARTS[i]; ++i) {\n"
+      "    if (!(top = g_PARTS[i](top, &frame))) {\n"
+      "      return %d;\n"
+      "    }\n"
+      "  }\n"
+      "  return %d;\n"
+      "}\n",
+      INTERPRET_RUNTIME_ERROR,
+      INTERPRET_OK);
+
+  ok = !ferror(file) && ok;
+  ok = fclose(file) == 0 && ok;
+  if (!ok) {
+    remove(path);
+  }
+  return ok;
+}
+
+#pragma endregion
+
+#pragma region "building and loading"
+
+bool buildSharedObject(
+    const char sourcePath[static 1],
+    const char path[static 1]) {
+  const char* compiler = getenv("CC");
+  if (!compiler || !*compiler) {
+    compiler = "cc";
+  }
+  char* const argv[] = {
+      (char*)compiler,
+      "-O2",
+      "-shared",
+      "-fPIC",
+      "-o",
+      (char*)path,
+      (char*)sourcePath,
+      NULL,
+  };
+  pid_t pid;
+  if (posix_spawnp(&pid, compiler, NULL, NULL, argv, environ) != 0) {
+    return false;
+  }
+  int status;
+  if (waitpid(pid, &status, 0) < 0) {
+    return false;
+  }
+  return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+// dlopen() searches the library path for a bare file name
+static void* openSharedObject(const char path[static 1]) {
+  if (strchr(path, '/')) {
+    return dlopen(path, RTLD_NOW | RTLD_LOCAL);
+  }
+  size_t length = strlen(path);
+  char* relative = malloc(length + sizeof("./"));
+  if (!relative) {
+    return NULL;
+  }
+  memcpy(relative, "./", 2);
+  memcpy(relative + 2, path, length + 1);
+  void* handle = dlopen(relative, RTLD_NOW | RTLD_LOCAL);
+  free(relative);
+  return handle;
+}
+
+InterpretResult runSharedObject(Vm* vm, const char path[static 1]) {
+  void* handle = openSharedObject(path);
+  if (!handle) {
+    fprintf(stderr, "Could not load \"%s\": %s\n", path, dlerror());
+    return INTERPRET_INVALID_CODE;
+  }
+
+  const char* abi = dlsym(handle, "lox_abi");
+  const uint8_t* image = dlsym(handle, "lox_image");
+  const size_t* imageSize = dlsym(handle, "lox_image_size");
+  // POSIX guarantees a function's address survives the trip through void*
+  NativeChunk native;
+  *(void**)&native = dlsym(handle, "lox_run");
+
+  InterpretResult result = INTERPRET_INVALID_CODE;
+  Chunk chunk;
+  initChunk(&chunk);
+  if (!abi || !image || !imageSize || !native || strcmp(abi, AOT_ABI) != 0
+      || !loadCacheImage(vm, *imageSize, image, 0, NULL, &chunk)) {
+    fprintf(stderr, "\"%s\" was not built for this VM.\n", path);
+  } else {
+    result = interpretNativeChunk(vm, &chunk, native, 0, NULL);
+    freeChunk(&chunk);
+  }
+  dlclose(handle);
+  return result;
+}
+
+#pragma endregion
@@ -0,0 +1,336 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <clox/cache.h>
+#include <clox/compiler.h>
+#include <clox/memory.h>
+#include <clox/object.h>
+#include <clox/verifier.h>
+#include <clox/vm.h>
+
+// Everything is stored in native byte order: a cache is a local artifact,
+// not something to ship between machines.
+typedef struct cache_header_s {
+  char magic[4];
+  uint32_t format;
+  // the CompilerOptions the code was compiled with
+  uint32_t optimize;
+  uint32_t stripLines;
+  uint64_t vmKey;
+  uint64_t sourceKey;
+  uint64_t sourceLength;
+  uint32_t codeCount;
+  uint32_t lineCount;
+  uint32_t constantCount;
+  uint32_t globalCount;
+} CacheHeader;
+
+typedef enum cache_constant_e
+{
+  CACHE_CONSTANT_NUMBER,
+  CACHE_CONSTANT_STRING,
+} CacheConstant;
+
+static const char g_CACHE_MAGIC[4] = {'L', 'O', 'X', 'C'};
+
+static uint64_t vmKey(void) {
+  static const char signature[] =
+#define X(x) #x ","
+      OPCODES_
+#undef X
+      ;
+  // the stored string hashes are only valid for the same hash function
+  return hashBytes(sizeof(signature) - 1, signature) ^ hashString(4, "clox");
+}
+
+#pragma region "writing"
+
+static void writeString(FILE* file, ObjString* string) {
+  uint32_t header[2] = {(uint32_t)string->length, string->hash};
+  fwrite(header, sizeof(header), 1, file);
+  fwrite(string->chars, sizeof(char), string->length, file);
+}
+
+static bool writeConstants(FILE* file, ValueArray* constants) {
+  for (int i = 0; i < constants->count; ++i) {
+    Value value = constants->values[i];
+    if (IS_NUMBER(value)) {
+      uint8_t tag = CACHE_CONSTANT_NUMBER;
+      double number = AS_NUMBER(value);
+      fwrite(&tag, sizeof(tag), 1, file);
+      fwrite(&number, sizeof(number), 1, file);
+    } else if (IS_STRING(value)) {
+      uint8_t tag = CACHE_CONSTANT_STRING;
+      fwrite(&tag, sizeof(tag), 1, file);
+      writeString(file, AS_STRING(value));
+    } else {
+      // the compiler only makes number and string constants
+      return false;
+    }
+  }
+  return true;
+}
+
+bool writeCacheImage(
+    Vm* vm,
+    FILE* file,
+    Chunk* chunk,
+    size_t sourceLength,
+    const char source[sourceLength]) {
+  LineArray* lines = &chunk->lines;
+  CacheHeader header = {
+      .format = CACHE_FORMAT_VERSION,
+      .optimize = (uint32_t)g_COMPILER_OPTIONS.optimize,
+      .stripLines = g_COMPILER_OPTIONS.stripLines,
+      .vmKey = vmKey(),
+      .sourceKey = hashBytes(sourceLength, source),
+      .sourceLength = sourceLength,
+      .codeCount = (uint32_t)chunk->count,
+      .lineCount = (uint32_t)(lines->runCount + (lines->length > 0)),
+      .constantCount = (uint32_t)chunk->constants.count,
+      .globalCount = (uint32_t)vm->globalNames.count,
+  };
+  memcpy(header.magic, g_CACHE_MAGIC, sizeof(header.magic));
+  fwrite(&header, sizeof(header), 1, file);
+
+  fwrite(chunk->code, sizeof(uint8_t), chunk->count, file);
+  LineCursor cursor;
+  initLineCursor(&cursor, lines);
+  while (nextLineRun(&cursor)) {
+    int32_t line[2] = {cursor.line, cursor.length};
+    fwrite(line, sizeof(line), 1, file);
+  }
+  bool ok = writeConstants(file, &chunk->constants);
+  for (int i = 0; i < vm->globalNames.count; ++i) {
+    writeString(file, AS_STRING(vm->globalNames.values[i]));
+  }
+  return !ferror(file) && ok;
+}
+
+bool writeCache(
+    Vm* vm,
+    const char path[static 1],
+    Chunk* chunk,
+    size_t sourceLength,
+    const char source[sourceLength]) {
+  // write next to the target and rename, so a reader never maps half a file
+  size_t pathLength = strlen(path);
+  char* tempPath = malloc(pathLength + sizeof(".tmp"));
+  if (!tempPath) {
+    return false;
+  }
+  memcpy(tempPath, path, pathLength);
+  memcpy(tempPath + pathLength, ".tmp", sizeof(".tmp"));
+
+  FILE* file = fopen(tempPath, "wbe");
+  if (!file) {
+    free(tempPath);
+    return false;
+  }
+
+  bool ok = writeCacheImage(vm, file, chunk, sourceLength, source);
+  ok = fclose(file) == 0 && ok;
+  ok = ok && rename(tempPath, path) == 0;
+  if (!ok) {
+    remove(tempPath);
+  }
+  free(tempPath);
+  return ok;
+}
+
+#pragma endregion
+
+#pragma region "loading"
+
+typedef struct reader_s {
+  // interns the strings and binds the globals
+  Vm* vm;
+  const uint8_t* current;
+  const uint8_t* end;
+} Reader;
+
+static bool readBytes(Reader* reader, void* out, size_t size) {
+  if ((size_t)(reader->end - reader->current) < size) {
+    return false;
+  }
+  memcpy(out, reader->current, size);
+  reader->current += size;
+  return true;
+}
+
+static ObjString* readString(Reader* reader) {
+  uint32_t header[2];
+  if (!readBytes(reader, header, sizeof(header)) || header[0] > INT_MAX
+      || (size_t)(reader->end - reader->current) < header[0]) {
+    return NULL;
+  }
+  int length = (int)header[0];
+  // the characters are interned straight out of the mapping, and the stored
+  // hash saves rehashing them
+  ObjString* string = copyHashedString(
+      reader->vm,
+      length,
+      (const char*)reader->current,
+      header[1]);
+  reader->current += length;
+  return string;
+}
+
+// addConstant() deduplicates, so a pool with repeats can't be rebuilt with
+// the same indices; such a file is rejected rather than run with the wrong
+// operands.
+static bool readConstants(Reader* reader, Chunk* chunk, uint32_t count) {
+  for (uint32_t i = 0; i < count; ++i) {
+    uint8_t tag;
+    if (!readBytes(reader, &tag, sizeof(tag))) {
+      return false;
+    }
+    switch (tag) {
+      case CACHE_CONSTANT_NUMBER:
+        {
+          double number;
+          if (!readBytes(reader, &number, sizeof(number))) {
+            return false;
+          }
+          if (addConstant(reader->vm, chunk, NUMBER_VAL(number)) != (int)i) {
+            return false;
+          }
+          break;
+        }
+      case CACHE_CONSTANT_STRING:
+        {
+          ObjString* string = readString(reader);
+          if (!string) {
+            return false;
+          }
+          if (addConstant(reader->vm, chunk, OBJ_VAL(string)) != (int)i) {
+            return false;
+          }
+          break;
+        }
+      default:
+        return false;
+    }
+  }
+  return true;
+}
+
+// Globals are bound to slots by first use, so the code is only valid if this
+// VM hands out the same slot for every name. A fresh VM always does.
+static bool readGlobals(Reader* reader, uint32_t count) {
+  for (uint32_t i = 0; i < count; ++i) {
+    ObjString* name = readString(reader);
+    if (!name || globalSlot(reader->vm, name) != i) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool readChunk(
+    Reader* reader,
+    size_t sourceLength,
+    const char source[sourceLength],
+    Chunk* chunk) {
+  CacheHeader header;
+  if (!readBytes(reader, &header, sizeof(header))
+      || memcmp(header.magic, g_CACHE_MAGIC, sizeof(header.magic)) != 0
+      || header.format != CACHE_FORMAT_VERSION || header.vmKey != vmKey()
+      || header.codeCount > INT_MAX || header.lineCount > INT_MAX) {
+    return false;
+  }
+  // code compiled from the source with other options is not what compiling
+  // it now would produce
+  if (source
+      && (header.sourceLength != sourceLength
+          || header.sourceKey != hashBytes(sourceLength, source)
+          || header.optimize != (uint32_t)g_COMPILER_OPTIONS.optimize
+          || header.stripLines != g_COMPILER_OPTIONS.stripLines)) {
+    return false;
+  }
+
+  if ((size_t)(reader->end - reader->current) < header.codeCount) {
+    return false;
+  }
+  chunk->code = GROW_ARRAY(uint8_t, NULL, 0, header.codeCount);
+  chunk->capacity = (int)header.codeCount;
+  readBytes(reader, chunk->code, header.codeCount);
+  chunk->count = (int)header.codeCount;
+
+  // the runs must cover the code exactly, unless lines were stripped
+  int64_t covered = 0;
+  for (uint32_t i = 0; i < header.lineCount; ++i) {
+    int32_t line[2];
+    if (!readBytes(reader, line, sizeof(line)) || line[1] <= 0) {
+      return false;
+    }
+    covered += line[1];
+    if (covered > chunk->count) {
+      return false;
+    }
+    addLineArray(&chunk->lines, line[0], line[1]);
+  }
+  if (header.lineCount > 0 && covered != chunk->count) {
+    return false;
+  }
+
+  return readConstants(reader, chunk, header.constantCount)
+      && readGlobals(reader, header.globalCount)
+      && reader->current == reader->end
+      && !verifyChunk(chunk, header.globalCount).error;
+}
+
+bool loadCacheImage(
+    Vm* vm,
+    size_t size,
+    const uint8_t data[size],
+    size_t sourceLength,
+    const char source[sourceLength],
+    Chunk* chunk) {
+  // the constants read so far must survive collections triggered by the
+  // ones still to come
+  Chunk* running = vm->chunk;
+  vm->chunk = chunk;
+  Reader reader = {.vm = vm, .current = data, .end = data + size};
+  bool ok = readChunk(&reader, sourceLength, source, chunk);
+  vm->chunk = running;
+
+  if (!ok) {
+    freeChunk(chunk);
+  }
+  return ok;
+}
+
+bool loadCache(
+    Vm* vm,
+    const char path[static 1],
+    size_t sourceLength,
+    const char source[sourceLength],
+    Chunk* chunk) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat info;
+  if (fstat(fd, &info) < 0 || (size_t)info.st_size < sizeof(CacheHeader)) {
+    close(fd);
+    return false;
+  }
+  size_t size = (size_t)info.st_size;
+  void* data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    return false;
+  }
+
+  bool ok = loadCacheImage(vm, size, data, sourceLength, source, chunk);
+  munmap(data, size);
+  return ok;
+}
+
+#pragma endregion
@@ -1,9 +1,12 @@
 #include <stdlib.h>
+#include <string.h>
 
 #include <clox/chunk.h>
 #include <clox/line.h>
 #include <clox/memory.h>
+#include <clox/object.h>
 #include <clox/value.h>
+#include <clox/vm.h>
 
 const char* const g_OP_CODE_NAMES[] = {
 #define STRINGIZE(x) #x
@@ -19,6 +22,10 @@ void initChunk(Chunk* chunk) {
   chunk->code = NULL;
   initLineArray(&chunk->lines);
   initValueArray(&chunk->constants);
+  chunk->constantSlots = NULL;
+  chunk->constantSlotCapacity = 0;
+  chunk->maxStack = -1;
+  chunk->typeProfiles = NULL;
 }
 
 void writeChunk(Chunk* chunk, uint8_t byte, int line) {
@@ -29,24 +36,131 @@ void writeChunk(Chunk* chunk, uint8_t byte, int line) {
         = GROW_ARRAY(uint8_t, chunk->code, oldCapacity, chunk->capacity);
   }
   chunk->code[chunk->count] = byte;
-  addLineArray(&chunk->lines, line);
+  addLineArray(&chunk->lines, line, 1);
   chunk->count++;
 }
 
+void writeChunkCode(Chunk* chunk, const uint8_t* code, int length, int line) {
+  if (chunk->capacity < chunk->count + length) {
+    int oldCapacity = chunk->capacity;
+    chunk->capacity = GROW_CAPACITY(oldCapacity);
+    while (chunk->capacity < chunk->count + length) {
+      chunk->capacity *= 2;
+    }
+    chunk->code
+        = GROW_ARRAY(uint8_t, chunk->code, oldCapacity, chunk->capacity);
+  }
+  memcpy(chunk->code + chunk->count, code, length);
+  addLineArray(&chunk->lines, line, length);
+  chunk->count += length;
+}
+
 void freeChunk(Chunk* chunk) {
   FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
   freeLineArray(&chunk->lines);
   freeValueArray(&chunk->constants);
+  FREE_ARRAY(int, chunk->constantSlots, chunk->constantSlotCapacity);
+  // only chunks that ran have profiles; don't uncharge what was never
+  // allocated
+  if (chunk->typeProfiles) {
+    FREE_ARRAY(uint8_t, chunk->typeProfiles, chunk->count);
+  }
   initChunk(chunk);
 }
 
-int addConstant(Chunk* chunk, Value value) {
-  writeValueArray(&chunk->constants, value);
-  return chunk->constants.count - 1;
+void truncateChunk(Chunk* chunk, int count) {
+  truncateLineArray(&chunk->lines, chunk->count - count);
+  chunk->count = count;
+}
+
+// Constants are numbers and interned strings, so comparing representations
+// is enough: equal strings are the same object.
+static bool sameConstant(Value a, Value b) {
+#ifdef NAN_BOXING
+  return a == b;
+#else
+  if (a.type != b.type) {
+    return false;
+  }
+  if (IS_NUMBER(a)) {
+    return memcmp(&a.as.number, &b.as.number, sizeof(double)) == 0;
+  }
+  if (IS_OBJ(a)) {
+    return AS_OBJ(a) == AS_OBJ(b);
+  }
+  return true;
+#endif
+}
+
+static uint32_t constantHash(Value value) {
+  uint64_t bits;
+#ifdef NAN_BOXING
+  bits = value;
+#else
+  if (IS_OBJ(value)) {
+    bits = (uint64_t)(uintptr_t)AS_OBJ(value);
+  } else if (IS_NUMBER(value)) {
+    memcpy(&bits, &value.as.number, sizeof(bits));
+  } else {
+    bits = value.type;
+  }
+#endif
+  return (uint32_t)hashBytes(sizeof(bits), (const char*)&bits);
 }
 
-int writeConstant(Chunk* chunk, Value value, int line) {
-  int constant = addConstant(chunk, value);
+static int* findConstantSlot(
+    int* slots,
+    int capacity,
+    Chunk* chunk,
+    Value value) {
+  uint32_t mask = (uint32_t)capacity - 1;
+  for (uint32_t i = constantHash(value) & mask;; i = (i + 1) & mask) {
+    if (slots[i] == 0
+        || sameConstant(chunk->constants.values[slots[i] - 1], value)) {
+      return &slots[i];
+    }
+  }
+}
+
+static void growConstantSlots(Chunk* chunk) {
+  int capacity = GROW_CAPACITY(chunk->constantSlotCapacity);
+  int* slots = GROW_ARRAY(int, NULL, 0, capacity);
+  memset(slots, 0, sizeof(int) * capacity);
+  for (int i = 0; i < chunk->constantSlotCapacity; ++i) {
+    int index = chunk->constantSlots[i];
+    if (index != 0) {
+      Value value = chunk->constants.values[index - 1];
+      *findConstantSlot(slots, capacity, chunk, value) = index;
+    }
+  }
+  FREE_ARRAY(int, chunk->constantSlots, chunk->constantSlotCapacity);
+  chunk->constantSlots = slots;
+  chunk->constantSlotCapacity = capacity;
+}
+
+int addConstant(Vm* vm, Chunk* chunk, Value value) {
+  // growing the constant pool or its index may collect; keep the value
+  // reachable until it is in the pool
+  push(vm, value);
+  // keep the index at most half full
+  if ((chunk->constants.count + 1) * 2 > chunk->constantSlotCapacity) {
+    growConstantSlots(chunk);
+  }
+  int* slot = findConstantSlot(
+      chunk->constantSlots,
+      chunk->constantSlotCapacity,
+      chunk,
+      value);
+  if (*slot == 0) {
+    writeValueArray(&chunk->constants, value);
+    *slot = chunk->constants.count;
+  }
+  pop(vm);
+  return *slot - 1;
+}
+
+int writeConstant(Vm* vm, Chunk* chunk, Value value, int line) {
+  int constant = addConstant(vm, chunk, value);
   if (constant > UINT8_MAX) {
     writeChunk(chunk, OP_CONSTANT_LONG, line);
     writeChunk(chunk, constant % UINT8_COUNT, line);
@@ -60,3 +174,52 @@ int writeConstant(Chunk* chunk, Value value, int line) {
   }
   return constant;
 }
+
+int instructionLength(uint8_t op) {
+  switch (op) {
+    case OP_CONSTANT:
+    case OP_DEFINE_GLOBAL_SLOT:
+    case OP_GET_GLOBAL_SLOT:
+    case OP_SET_GLOBAL_SLOT:
+    case OP_SET_GLOBAL_SLOT_POP:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_SET_LOCAL_POP:
+      return 2;
+    case OP_GET_LOCAL2:
+    case OP_ADD_LOCAL_CONST:
+      return 3;
+    case OP_CONSTANT_LONG:
+    case OP_DEFINE_GLOBAL_SLOT_LONG:
+    case OP_GET_GLOBAL_SLOT_LONG:
+    case OP_SET_GLOBAL_SLOT_LONG:
+    case OP_GET_LOCAL_LONG:
+    case OP_SET_LOCAL_LONG:
+      return 4;
+    default:
+      return 1;
+  }
+}
+
+uint8_t genericOpcode(uint8_t op) {
+  switch (op) {
+    case OP_ADD_NUM:
+      return OP_ADD;
+    case OP_SUBTRACT_NUM:
+      return OP_SUBTRACT;
+    case OP_MULTIPLY_NUM:
+      return OP_MULTIPLY;
+    case OP_DIVIDE_NUM:
+      return OP_DIVIDE;
+    case OP_GREATER_NUM:
+      return OP_GREATER;
+    case OP_LESS_NUM:
+      return OP_LESS;
+    case OP_GREATER_EQUAL_NUM:
+      return OP_GREATER_EQUAL;
+    case OP_LESS_EQUAL_NUM:
+      return OP_LESS_EQUAL;
+    default:
+      return op;
+  }
+}
@@ -12,6 +12,9 @@
 #include <clox/chunk.h>
 #include <clox/common.h>
 #include <clox/compiler.h>
+#include <clox/ir.h>
+#include <clox/memory.h>
+#include <clox/optimizer.h>
 #include <clox/scanner.h>
 #ifdef DEBUG_PRINT_CODE
 #  include <clox/debug.h>
@@ -48,7 +51,9 @@ typedef enum precedence_e
 #undef X
 } Precedence;
 
-typedef void ParseFn(bool canAssign);
+typedef struct compiler_s Compiler;
+
+typedef void ParseFn(Compiler* compiler, bool canAssign);
 
 typedef struct parse_rule_s {
   ParseFn* prefix;
@@ -61,25 +66,37 @@ typedef struct local_s {
   int depth;
 } Local;
 
-typedef struct compiler_s {
+// Everything one compile() call works on. It lives on that call's stack, so
+// any number of threads can compile at once.
+struct compiler_s {
+  Vm* vm;
+  const CompilerOptions* options;
+  Scanner scanner;
+  Parser parser;
+  Chunk* chunk;
+  // the compile() this one interrupted on the same VM, if any
+  Compiler* enclosing;
   Local locals[UINT8_COUNT];
   int localCount;
   int scopeDepth;
-} Compiler;
+  // offsets of the two most recently emitted instructions, or -1
+  int lastInstruction;
+  int previousInstruction;
+};
 
 #pragma endregion
 
 #pragma region "pre-declarations"
 
-static void grouping(bool canAssign);
-static void unary(bool canAssign);
-static void binary(bool canAssign);
-static void number(bool canAssign);
-static void literal(bool canAssign);
-static void string(bool canAssign);
-static void declaration(void);
-static void statement(void);
-static void variable(bool canAssign);
+static void grouping(Compiler* compiler, bool canAssign);
+static void unary(Compiler* compiler, bool canAssign);
+static void binary(Compiler* compiler, bool canAssign);
+static void number(Compiler* compiler, bool canAssign);
+static void literal(Compiler* compiler, bool canAssign);
+static void string(Compiler* compiler, bool canAssign);
+static void declaration(Compiler* compiler);
+static void statement(Compiler* compiler);
+static void variable(Compiler* compiler, bool canAssign);
 
 #pragma endregion
 
@@ -138,23 +155,30 @@ const char* const g_PRECEDENCE_NAMES[] = {
 #undef X
 };
 
-Parser g_PARSER;
-Compiler* g_CURRENT = NULL;
-Chunk* g_COMPILING_CHUNK;
+CompilerOptions g_COMPILER_OPTIONS = {
+    .optimize = 0,
+    .wholeProgram = false,
+    .stripLines = false,
+};
 
 #pragma endregion
 
-static Chunk* currentChunk() {
-  return g_COMPILING_CHUNK;
+static Chunk* currentChunk(Compiler* compiler) {
+  return compiler->chunk;
 }
 
 #pragma region "error handling"
 
-static void errorAt(Token* token, const char message[static 1]) {
-  if (g_PARSER.panicMode) {
+static void errorAt(
+    Compiler* compiler,
+    Token* token,
+    const char message[static 1]) {
+  if (compiler->parser.panicMode) {
     return;
   }
-  g_PARSER.panicMode = true;
+  compiler->parser.panicMode = true;
+  // one line, whatever other threads report
+  flockfile(stderr);
   fprintf(stderr, "[line %d] Error", token->line);
 
   if (token->type == TOKEN_EOF) {
@@ -164,53 +188,57 @@ static void errorAt(Token* token, const char message[static 1]) {
   }
 
   fprintf(stderr, ": %s\n", message);
-  g_PARSER.hadError = true;
+  funlockfile(stderr);
+  compiler->parser.hadError = true;
 }
 
-static void error(const char message[static 1]) {
-  errorAt(&g_PARSER.previous, message);
+static void error(Compiler* compiler, const char message[static 1]) {
+  errorAt(compiler, &compiler->parser.previous, message);
 }
 
-static void errorAtCurrent(const char message[static 1]) {
-  errorAt(&g_PARSER.current, message);
+static void errorAtCurrent(Compiler* compiler, const char message[static 1]) {
+  errorAt(compiler, &compiler->parser.current, message);
 }
 
 #pragma endregion
 
 #pragma region "parser helpers"
 
-static void advance() {
-  g_PARSER.previous = g_PARSER.current;
+static void advance(Compiler* compiler) {
+  compiler->parser.previous = compiler->parser.current;
 
   for (;;) {
-    g_PARSER.current = scanToken();
-    if (g_PARSER.current.type != TOKEN_ERROR) {
+    compiler->parser.current = scanToken(&compiler->scanner);
+    if (compiler->parser.current.type != TOKEN_ERROR) {
       break;
     }
 
-    errorAtCurrent(g_PARSER.current.start);
+    errorAtCurrent(compiler, compiler->parser.current.start);
   }
 }
 
-static void consume(TokenType type, const char message[static 1]) {
-  if (g_PARSER.current.type == type) {
-    advance();
+static void consume(
+    Compiler* compiler,
+    TokenType type,
+    const char message[static 1]) {
+  if (compiler->parser.current.type == type) {
+    advance(compiler);
     return;
   }
 
-  errorAtCurrent(message);
+  errorAtCurrent(compiler, message);
 }
 
-static bool check(TokenType type) {
-  return g_PARSER.current.type == type;
+static bool check(Compiler* compiler, TokenType type) {
+  return compiler->parser.current.type == type;
 }
 
-static bool match(TokenType type) {
-  if (!check(type)) {
+static bool match(Compiler* compiler, TokenType type) {
+  if (!check(compiler, type)) {
     return false;
   }
 
-  advance();
+  advance(compiler);
   return true;
 }
 
@@ -218,64 +246,216 @@ static bool match(TokenType type) {
 
 #pragma region "compiler plumbing"
 
-static void emitByte(uint8_t byte) {
-  writeChunk(currentChunk(), byte, g_PARSER.previous.line);
+static void emitByte(Compiler* compiler, uint8_t byte) {
+  writeChunk(currentChunk(compiler), byte, compiler->parser.previous.line);
 }
 
-static void emitBytes(uint8_t b1, uint8_t b2) {
-  emitByte(b1);
-  emitByte(b2);
+static uint8_t* lastOp(Compiler* compiler, int distance) {
+  int offset = distance == 0 ? compiler->lastInstruction
+                             : compiler->previousInstruction;
+  return offset == -1 ? NULL : &currentChunk(compiler)->code[offset];
 }
 
-static void emitReturn() {
-  emitByte(OP_RETURN);
+// Tries to merge `op` into the instruction(s) just emitted. Returns true if
+// the superinstruction was formed and `op` must not be emitted; any operands
+// of `op` are still emitted by the caller and land after the fused opcode.
+static bool fuseInstruction(Compiler* compiler, OpCode op) {
+  uint8_t* last = lastOp(compiler, 0);
+  if (!last) {
+    return false;
+  }
+
+  switch (op) {
+    case OP_NOT:
+      switch (*last) {
+        case OP_EQUAL:
+          *last = OP_NOT_EQUAL;
+          return true;
+        case OP_LESS:
+          *last = OP_GREATER_EQUAL;
+          return true;
+        case OP_GREATER:
+          *last = OP_LESS_EQUAL;
+          return true;
+        default:
+          return false;
+      }
+    case OP_POP:
+      switch (*last) {
+        case OP_SET_GLOBAL_SLOT:
+          *last = OP_SET_GLOBAL_SLOT_POP;
+          return true;
+        case OP_SET_LOCAL:
+          *last = OP_SET_LOCAL_POP;
+          return true;
+        default:
+          return false;
+      }
+    case OP_GET_LOCAL:
+      if (*last == OP_GET_LOCAL) {
+        *last = OP_GET_LOCAL2;
+        return true;
+      }
+      return false;
+    case OP_ADD:
+      {
+        uint8_t* previous = lastOp(compiler, 1);
+        if (*last != OP_CONSTANT || !previous || *previous != OP_GET_LOCAL) {
+          return false;
+        }
+        // GET_LOCAL slot, CONSTANT index -> ADD_LOCAL_CONST slot index
+        previous[0] = OP_ADD_LOCAL_CONST;
+        previous[2] = last[1];
+        truncateChunk(
+            currentChunk(compiler),
+            currentChunk(compiler)->count - 1);
+        compiler->lastInstruction = compiler->previousInstruction;
+        compiler->previousInstruction = -1;
+        return true;
+      }
+    default:
+      return false;
+  }
 }
 
-static uint32_t makeConstant(Value value) {
-  return addConstant(currentChunk(), value);
+static void emitOp(Compiler* compiler, OpCode op) {
+  if (fuseInstruction(compiler, op)) {
+    return;
+  }
+
+  compiler->previousInstruction = compiler->lastInstruction;
+  compiler->lastInstruction = currentChunk(compiler)->count;
+  emitByte(compiler, op);
 }
 
-static void emitConstant(Value value) {
-  uint32_t constant = makeConstant(value);
+static void emitBytes(Compiler* compiler, OpCode op, uint8_t operand) {
+  emitOp(compiler, op);
+  emitByte(compiler, operand);
+}
+
+static void emitReturn(Compiler* compiler) {
+  emitOp(compiler, OP_RETURN);
+}
+
+static uint32_t makeConstant(Compiler* compiler, Value value) {
+  return addConstant(compiler->vm, currentChunk(compiler), value);
+}
+
+static void emitConstant(Compiler* compiler, Value value) {
+  uint32_t constant = makeConstant(compiler, value);
   if (constant > UINT8_MAX) {
-    emitByte(OP_CONSTANT_LONG);
-    emitByte(constant % UINT8_COUNT);
+    emitOp(compiler, OP_CONSTANT_LONG);
+    emitByte(compiler, constant % UINT8_COUNT);
     constant /= UINT8_COUNT;
-    emitByte(constant % UINT8_COUNT);
+    emitByte(compiler, constant % UINT8_COUNT);
     constant /= UINT8_COUNT;
-    emitByte(constant % UINT8_COUNT);
+    emitByte(compiler, constant % UINT8_COUNT);
   } else {
-    emitBytes(OP_CONSTANT, constant);
+    emitBytes(compiler, OP_CONSTANT, constant);
   }
 }
 
-static void initCompiler(Compiler* compiler) {
-  compiler->localCount = 0;
-  compiler->scopeDepth = 0;
-  g_CURRENT = compiler;
+static void emitValue(Compiler* compiler, Value value) {
+  if (IS_NIL(value)) {
+    emitOp(compiler, OP_NIL);
+  } else if (IS_BOOL(value)) {
+    emitOp(compiler, AS_BOOL(value) ? OP_TRUE : OP_FALSE);
+  } else {
+    emitConstant(compiler, value);
+  }
 }
 
-static void endCompiler() {
-  emitReturn();
+// The operands of the operator being compiled are the instructions just
+// emitted. When those are literals, `op` is evaluated now and its operands
+// are replaced by the result. Returns false if `op` still has to be emitted.
+static bool foldOp(Compiler* compiler, OpCode op, int arity) {
+  if (!compiler->options->optimize) {
+    return false;
+  }
+
+  int first = arity == 1 ? compiler->lastInstruction
+                         : compiler->previousInstruction;
+  Value operands[2];
+  Value result;
+  if (first == -1
+      || !instructionConstant(currentChunk(compiler), first, &operands[0])
+      || (arity == 2
+          && !instructionConstant(
+              currentChunk(compiler),
+              compiler->lastInstruction,
+              &operands[1]))) {
+    return false;
+  }
+  if (arity == 1
+          ? !foldUnary(op, operands[0], &result)
+          : !foldBinary(compiler->vm, op, operands[0], operands[1], &result)) {
+    return false;
+  }
+
+  truncateChunk(currentChunk(compiler), first);
+  // whatever preceded the operands is no longer tracked
+  compiler->lastInstruction = -1;
+  compiler->previousInstruction = -1;
+  emitValue(compiler, result);
+  return true;
+}
+
+static void initCompiler(
+    Compiler* compiler,
+    Vm* vm,
+    const CompilerOptions* options,
+    size_t length,
+    const char source[length],
+    Chunk* chunk) {
+  compiler->vm = vm;
+  compiler->options = options;
+  initScanner(&compiler->scanner, length, source);
+  compiler->parser.hadError = false;
+  compiler->parser.panicMode = false;
+  compiler->chunk = chunk;
+  compiler->localCount = 0;
+  compiler->scopeDepth = 0;
+  compiler->lastInstruction = -1;
+  compiler->previousInstruction = -1;
+  // the collector marks the constants of every chunk being compiled
+  compiler->enclosing = vm->compiler;
+  vm->compiler = compiler;
+}
+
+static void endCompiler(Compiler* compiler) {
+  emitReturn(compiler);
+  const CompilerOptions* options = compiler->options;
+  if (options->optimize >= 2 && !compiler->parser.hadError) {
+    optimizeIr(
+        compiler->vm,
+        currentChunk(compiler),
+        options->wholeProgram);
+  }
+  if (options->optimize >= 1 && !compiler->parser.hadError) {
+    optimizeChunk(compiler->vm, currentChunk(compiler));
+  }
+  if (options->stripLines) {
+    freeLineArray(&currentChunk(compiler)->lines);
+  }
 #ifdef DEBUG_PRINT_CODE
-  if (!g_PARSER.hadError) {
-    disassembleChunk(currentChunk(), "code");
+  if (!compiler->parser.hadError) {
+    disassembleChunk(compiler->vm, currentChunk(compiler), "code");
   }
 #endif
 }
 
-static void beginScope() {
-  g_CURRENT->scopeDepth++;
+static void beginScope(Compiler* compiler) {
+  compiler->scopeDepth++;
 }
 
-static void endScope() {
-  g_CURRENT->scopeDepth--;
+static void endScope(Compiler* compiler) {
+  compiler->scopeDepth--;
 
-  while (g_CURRENT->localCount > 0
-         && g_CURRENT->locals[g_CURRENT->localCount - 1].depth
-             > g_CURRENT->scopeDepth) {
-    emitByte(OP_POP);
-    g_CURRENT->localCount--;
+  while (compiler->localCount > 0
+         && compiler->locals[compiler->localCount - 1].depth
+             > compiler->scopeDepth) {
+    emitOp(compiler, OP_POP);
+    compiler->localCount--;
   }
 }
 
@@ -283,15 +463,33 @@ static void endScope() {
 
 #pragma region "parsing functions"
 
-static void number(bool canAssign) {
-  double value = strtod(g_PARSER.previous.start, NULL);
-  emitConstant(NUMBER_VAL(value));
+// number literals at least this long are copied to the heap to be parsed
+#define MAX_SHORT_NUMBER 64
+
+static void number(Compiler* compiler, bool canAssign) {
+  // The source needn't be NUL-terminated (a mapped file isn't), so strtod()
+  // gets a terminated copy of the lexeme rather than reading past its end.
+  const Token* token = &compiler->parser.previous;
+  size_t length = (size_t)token->length;
+  char shortLexeme[MAX_SHORT_NUMBER];
+  char* lexeme = length < MAX_SHORT_NUMBER ? shortLexeme : malloc(length + 1);
+  if (lexeme == NULL) {
+    exit(1);
+  }
+  memcpy(lexeme, token->start, length);
+  lexeme[length] = '\0';
+  double value = strtod(lexeme, NULL);
+  if (lexeme != shortLexeme) {
+    free(lexeme);
+  }
+  emitConstant(compiler, NUMBER_VAL(value));
 }
 
-static void parsePrecedence(Precedence precedence);
+static void parsePrecedence(Compiler* compiler, Precedence precedence);
 
-static uint32_t identifierConstant(Token* name) {
-  return makeConstant(OBJ_VAL(copyString(name->length, name->start)));
+static uint32_t identifierSlot(Compiler* compiler, Token* name) {
+  Vm* vm = compiler->vm;
+  return globalSlot(vm, copyString(vm, name->length, name->start));
 }
 
 static bool identifiersEqual(Token* a, Token* b) {
@@ -306,7 +504,7 @@ static int resolveLocal(Compiler* compiler, Token* name) {
     Local* local = &compiler->locals[i];
     if (identifiersEqual(name, &local->name)) {
       if (local->depth == -1) {
-        error("Can't read local variable in its own initializer.");
+        error(compiler, "Can't read local variable in its own initializer.");
       }
       return i;
     }
@@ -315,111 +513,119 @@ static int resolveLocal(Compiler* compiler, Token* name) {
   return -1;
 }
 
-static void addLocal(Token name) {
-  if (g_CURRENT->localCount == UINT8_COUNT) {
-    error("Too many local variables in function.");
+static void addLocal(Compiler* compiler, Token name) {
+  if (compiler->localCount == UINT8_COUNT) {
+    error(compiler, "Too many local variables in function.");
     return;
   }
 
-  Local* local = &g_CURRENT->locals[g_CURRENT->localCount++];
+  Local* local = &compiler->locals[compiler->localCount++];
   local->name = name;
   local->depth = -1;
 }
 
-static void declareVariable() {
-  if (g_CURRENT->scopeDepth == 0) {
+static void declareVariable(Compiler* compiler) {
+  if (compiler->scopeDepth == 0) {
     return;
   }
 
-  Token* name = &g_PARSER.previous;
+  Token* name = &compiler->parser.previous;
 
-  for (int i = g_CURRENT->localCount - 1; i >= 0; --i) {
-    Local* local = &g_CURRENT->locals[i];
-    if (local->depth != -1 && local->depth < g_CURRENT->scopeDepth) {
+  for (int i = compiler->localCount - 1; i >= 0; --i) {
+    Local* local = &compiler->locals[i];
+    if (local->depth != -1 && local->depth < compiler->scopeDepth) {
       break;
     }
 
     if (identifiersEqual(name, &local->name)) {
-      error("Already a variable with this name in this scope.");
+      error(compiler, "Already a variable with this name in this scope.");
     }
   }
 
-  addLocal(*name);
+  addLocal(compiler, *name);
 }
 
-static uint32_t parseVariable(const char errorMessage[static 1]) {
-  consume(TOKEN_IDENTIFIER, errorMessage);
-  return identifierConstant(&g_PARSER.previous);
+static uint32_t parseVariable(
+    Compiler* compiler,
+    const char errorMessage[static 1]) {
+  consume(compiler, TOKEN_IDENTIFIER, errorMessage);
+
+  declareVariable(compiler);
+  if (compiler->scopeDepth > 0) {
+    return 0;
+  }
+
+  return identifierSlot(compiler, &compiler->parser.previous);
 }
 
-static void markInitialized() {
-  g_CURRENT->locals[g_CURRENT->localCount - 1].depth = g_CURRENT->scopeDepth;
+static void markInitialized(Compiler* compiler) {
+  compiler->locals[compiler->localCount - 1].depth = compiler->scopeDepth;
 }
 
-static void defineVariable(uint32_t global) {
-  if (g_CURRENT->scopeDepth > 0) {
-    markInitialized();
+static void defineVariable(Compiler* compiler, uint32_t global) {
+  if (compiler->scopeDepth > 0) {
+    markInitialized(compiler);
     return;
   }
 
   if (global <= UINT8_MAX) {
-    emitByte(OP_DEFINE_GLOBAL);
-    emitByte(global);
+    emitOp(compiler, OP_DEFINE_GLOBAL_SLOT);
+    emitByte(compiler, global);
   } else {
-    emitByte(OP_DEFINE_GLOBAL_LONG);
-    emitByte(global % UINT8_COUNT);
+    emitOp(compiler, OP_DEFINE_GLOBAL_SLOT_LONG);
+    emitByte(compiler, global % UINT8_COUNT);
     global /= UINT8_COUNT;
-    emitByte(global % UINT8_COUNT);
+    emitByte(compiler, global % UINT8_COUNT);
     global /= UINT8_COUNT;
-    emitByte(global % UINT8_COUNT);
+    emitByte(compiler, global % UINT8_COUNT);
   }
 }
 
-static void expression() {
-  parsePrecedence(PREC_ASSIGNMENT);
+static void expression(Compiler* compiler) {
+  parsePrecedence(compiler, PREC_ASSIGNMENT);
 }
 
-static void block() {
-  while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)) {
-    declaration();
+static void block(Compiler* compiler) {
+  while (!check(compiler, TOKEN_RIGHT_BRACE) && !check(compiler, TOKEN_EOF)) {
+    declaration(compiler);
   }
 
-  consume(TOKEN_RIGHT_BRACE, "Expect '}' after block.");
+  consume(compiler, TOKEN_RIGHT_BRACE, "Expect '}' after block.");
 }
 
-static void varDeclaration() {
-  uint32_t global = parseVariable("Expect variable name.");
+static void varDeclaration(Compiler* compiler) {
+  uint32_t global = parseVariable(compiler, "Expect variable name.");
 
-  if (match(TOKEN_EQUAL)) {
-    expression();
+  if (match(compiler, TOKEN_EQUAL)) {
+    expression(compiler);
   } else {
-    emitByte(OP_NIL);
+    emitOp(compiler, OP_NIL);
   }
 
-  consume(TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
+  consume(compiler, TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
 
-  defineVariable(global);
+  defineVariable(compiler, global);
 }
 
-static void expressionStatement() {
-  expression();
-  consume(TOKEN_SEMICOLON, "Expect ';' after expression.");
-  emitByte(OP_POP);
+static void expressionStatement(Compiler* compiler) {
+  expression(compiler);
+  consume(compiler, TOKEN_SEMICOLON, "Expect ';' after expression.");
+  emitOp(compiler, OP_POP);
 }
 
-static void printStatement() {
-  expression();
-  consume(TOKEN_SEMICOLON, "Expect ';' after value.");
-  emitByte(OP_PRINT);
+static void printStatement(Compiler* compiler) {
+  expression(compiler);
+  consume(compiler, TOKEN_SEMICOLON, "Expect ';' after value.");
+  emitOp(compiler, OP_PRINT);
 }
 
-static void synchronize() {
-  g_PARSER.panicMode = false;
-  while (g_PARSER.current.type != TOKEN_EOF) {
-    if (g_PARSER.previous.type == TOKEN_SEMICOLON) {
+static void synchronize(Compiler* compiler) {
+  compiler->parser.panicMode = false;
+  while (compiler->parser.current.type != TOKEN_EOF) {
+    if (compiler->parser.previous.type == TOKEN_SEMICOLON) {
       return;
     }
-    switch (g_PARSER.current.type) {
+    switch (compiler->parser.current.type) {
       case TOKEN_CLASS:
       case TOKEN_FUN:
       case TOKEN_VAR:
@@ -433,196 +639,219 @@ static void synchronize() {
         break;
     }
 
-    advance();
+    advance(compiler);
   }
 }
 
-static void declaration() {
-  if (match(TOKEN_VAR)) {
-    varDeclaration();
+static void declaration(Compiler* compiler) {
+  if (match(compiler, TOKEN_VAR)) {
+    varDeclaration(compiler);
   } else {
-    statement();
+    statement(compiler);
   }
 
-  if (g_PARSER.panicMode) {
-    synchronize();
+  if (compiler->parser.panicMode) {
+    synchronize(compiler);
   }
 }
 
-static void statement() {
-  if (match(TOKEN_PRINT)) {
-    printStatement();
-  } else if (match(TOKEN_LEFT_BRACE)) {
-    beginScope();
-    block();
-    endScope();
+static void statement(Compiler* compiler) {
+  if (match(compiler, TOKEN_PRINT)) {
+    printStatement(compiler);
+  } else if (match(compiler, TOKEN_LEFT_BRACE)) {
+    beginScope(compiler);
+    block(compiler);
+    endScope(compiler);
   } else {
-    expressionStatement();
+    expressionStatement(compiler);
   }
 }
 
-static void namedVariable(Token name, bool canAssign) {
-  OpCode get_op = OP_GET_GLOBAL;
-  OpCode get_op_long = OP_GET_GLOBAL_LONG;
-  OpCode set_op = OP_SET_GLOBAL;
-  OpCode set_op_long = OP_SET_GLOBAL_LONG;
+static void namedVariable(Compiler* compiler, Token name, bool canAssign) {
+  OpCode get_op = OP_GET_GLOBAL_SLOT;
+  OpCode get_op_long = OP_GET_GLOBAL_SLOT_LONG;
+  OpCode set_op = OP_SET_GLOBAL_SLOT;
+  OpCode set_op_long = OP_SET_GLOBAL_SLOT_LONG;
 
-  int arg = resolveLocal(g_CURRENT, &name);
+  int arg = resolveLocal(compiler, &name);
   if (arg != -1) {
     get_op = OP_GET_LOCAL;
     get_op_long = OP_GET_LOCAL_LONG;
     set_op = OP_SET_LOCAL;
     set_op_long = OP_SET_LOCAL_LONG;
   } else {
-    arg = identifierConstant(&name);
+    arg = identifierSlot(compiler, &name);
   }
 
   OpCode op = get_op;
   OpCode op_long = get_op_long;
 
-  if (canAssign && match(TOKEN_EQUAL)) {
-    expression();
+  if (canAssign && match(compiler, TOKEN_EQUAL)) {
+    expression(compiler);
     op = set_op;
     op_long = set_op_long;
   }
   if (arg <= UINT8_MAX) {
-    emitBytes(op, arg);
+    emitBytes(compiler, op, arg);
   } else {
-    emitBytes(op_long, arg % UINT8_COUNT);
+    emitBytes(compiler, op_long, arg % UINT8_COUNT);
     arg /= UINT8_COUNT;
-    emitByte(arg % UINT8_COUNT);
+    emitByte(compiler, arg % UINT8_COUNT);
     arg /= UINT8_COUNT;
-    emitByte(arg % UINT8_COUNT);
+    emitByte(compiler, arg % UINT8_COUNT);
   }
 }
 
-static void variable(bool canAssign) {
-  namedVariable(g_PARSER.previous, canAssign);
+static void variable(Compiler* compiler, bool canAssign) {
+  namedVariable(compiler, compiler->parser.previous, canAssign);
 }
 
-static void grouping(bool canAssign) {
-  expression();
-  consume(TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
+static void grouping(Compiler* compiler, bool canAssign) {
+  expression(compiler);
+  consume(compiler, TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
 }
 
-static void unary(bool canAssign) {
-  TokenType operatorType = g_PARSER.previous.type;
+static void unary(Compiler* compiler, bool canAssign) {
+  TokenType operatorType = compiler->parser.previous.type;
 
-  parsePrecedence(PREC_UNARY);
+  parsePrecedence(compiler, PREC_UNARY);
 
+  OpCode op;
   switch (operatorType) {
     case TOKEN_BANG:
-      emitByte(OP_NOT);
+      op = OP_NOT;
       break;
     case TOKEN_MINUS:
-      emitByte(OP_NEGATE);
+      op = OP_NEGATE;
       break;
     default:
       assert(false);
+      return;
+  }
+  if (!foldOp(compiler, op, 1)) {
+    emitOp(compiler, op);
   }
 }
 
-static void binary(bool canAssign) {
-  TokenType operatorType = g_PARSER.previous.type;
+static void binary(Compiler* compiler, bool canAssign) {
+  TokenType operatorType = compiler->parser.previous.type;
   const ParseRule* rule = getRule(operatorType);
-  parsePrecedence((Precedence)(rule->precedence + 1));
+  parsePrecedence(compiler, (Precedence)(rule->precedence + 1));
 
+  OpCode op;
   switch (operatorType) {
     case TOKEN_BANG_EQUAL:
-      emitBytes(OP_EQUAL, OP_NOT);
+      op = OP_NOT_EQUAL;
       break;
     case TOKEN_EQUAL_EQUAL:
-      emitByte(OP_EQUAL);
+      op = OP_EQUAL;
       break;
     case TOKEN_GREATER:
-      emitByte(OP_GREATER);
+      op = OP_GREATER;
       break;
     case TOKEN_GREATER_EQUAL:
-      emitBytes(OP_LESS, OP_NOT);
+      op = OP_GREATER_EQUAL;
       break;
     case TOKEN_LESS:
-      emitByte(OP_LESS);
+      op = OP_LESS;
       break;
     case TOKEN_LESS_EQUAL:
-      emitBytes(OP_GREATER, OP_NOT);
+      op = OP_LESS_EQUAL;
       break;
     case TOKEN_PLUS:
-      emitByte(OP_ADD);
+      op = OP_ADD;
       break;
     case TOKEN_MINUS:
-      emitByte(OP_SUBTRACT);
+      op = OP_SUBTRACT;
       break;
     case TOKEN_STAR:
-      emitByte(OP_MULTIPLY);
+      op = OP_MULTIPLY;
       break;
     case TOKEN_SLASH:
-      emitByte(OP_DIVIDE);
+      op = OP_DIVIDE;
       break;
     default:
       assert(false);
+      return;
+  }
+  if (!foldOp(compiler, op, 2)) {
+    emitOp(compiler, op);
   }
 }
 
-static void parsePrecedence(Precedence precedence) {
-  advance();
-  ParseFn* prefixRule = getRule(g_PARSER.previous.type)->prefix;
+static void parsePrecedence(Compiler* compiler, Precedence precedence) {
+  advance(compiler);
+  ParseFn* prefixRule = getRule(compiler->parser.previous.type)->prefix;
   if (!prefixRule) {
-    error("Expect expression.");
+    error(compiler, "Expect expression.");
     return;
   }
 
   bool canAssign = precedence <= PREC_ASSIGNMENT;
-  prefixRule(canAssign);
+  prefixRule(compiler, canAssign);
 
-  while (precedence <= getRule(g_PARSER.current.type)->precedence) {
-    advance();
-    ParseFn* infixRule = getRule(g_PARSER.previous.type)->infix;
-    infixRule(canAssign);
+  while (precedence <= getRule(compiler->parser.current.type)->precedence) {
+    advance(compiler);
+    ParseFn* infixRule = getRule(compiler->parser.previous.type)->infix;
+    infixRule(compiler, canAssign);
   }
 
-  if (canAssign && match(TOKEN_EQUAL)) {
-    error("Invalid assignment target.");
+  if (canAssign && match(compiler, TOKEN_EQUAL)) {
+    error(compiler, "Invalid assignment target.");
   }
 }
 
-void literal(bool canAssign) {
-  switch (g_PARSER.previous.type) {
+void literal(Compiler* compiler, bool canAssign) {
+  switch (compiler->parser.previous.type) {
     case TOKEN_FALSE:
-      emitByte(OP_FALSE);
+      emitOp(compiler, OP_FALSE);
       break;
     case TOKEN_NIL:
-      emitByte(OP_NIL);
+      emitOp(compiler, OP_NIL);
       break;
     case TOKEN_TRUE:
-      emitByte(OP_TRUE);
+      emitOp(compiler, OP_TRUE);
       break;
     default:
       assert(false);
   }
 }
 
-void string(bool canAssign) {
-  emitConstant(OBJ_VAL(
-      copyString(g_PARSER.previous.length - 2, g_PARSER.previous.start + 1)));
+void string(Compiler* compiler, bool canAssign) {
+  Token* token = &compiler->parser.previous;
+  emitConstant(
+      compiler,
+      OBJ_VAL(copyString(compiler->vm, token->length - 2, token->start + 1)));
 }
 
 #pragma endregion
 
-bool compile(const char source[static 1], Chunk* chunk) {
-  initScanner(source);
-
+bool compile(
+    Vm* vm,
+    const CompilerOptions* options,
+    size_t length,
+    const char source[length],
+    Chunk* chunk) {
   Compiler compiler;
-  initCompiler(&compiler);
-  g_COMPILING_CHUNK = chunk;
-  g_PARSER.hadError = false;
-  g_PARSER.panicMode = false;
+  initCompiler(&compiler, vm, options, length, source, chunk);
 
-  advance();
+  advance(&compiler);
 
-  while (!match(TOKEN_EOF)) {
-    declaration();
+  while (!match(&compiler, TOKEN_EOF)) {
+    declaration(&compiler);
   }
 
-  endCompiler();
-  return !g_PARSER.hadError;
+  endCompiler(&compiler);
+  vm->compiler = compiler.enclosing;
+  return !compiler.parser.hadError;
+}
+
+void markCompilerRoots(Vm* vm) {
+  for (Compiler* compiler = vm->compiler; compiler;
+       compiler = compiler->enclosing) {
+    ValueArray* constants = &compiler->chunk->constants;
+    for (int i = 0; i < constants->count; ++i) {
+      markValue(vm, constants->values[i]);
+    }
+  }
 }
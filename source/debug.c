@@ -2,30 +2,72 @@
 
 #include <clox/debug.h>
 #include <clox/value.h>
+#include <clox/vm.h>
 
 static int simpleInstruction(const char* name, int offset) {
   printf("%s\n", name);
   return offset + 1;
 }
 
-static int constantInstruction(const char* name, Chunk* chunk, int offset) {
+static int constantInstruction(
+    Vm* vm,
+    const char* name,
+    Chunk* chunk,
+    int offset) {
   uint8_t constant = chunk->code[offset + 1];
   printf("%-16s %4d '", name, constant);
-  printValue(chunk->constants.values[constant]);
+  printValue(vm, chunk->constants.values[constant]);
   fputs("'\n", stdout);
   return offset + 2;
 }
 
-static int constantLongInstruction(const char* name, Chunk* chunk, int offset) {
+static int constantLongInstruction(
+    Vm* vm,
+    const char* name,
+    Chunk* chunk,
+    int offset) {
   uint32_t constant = chunk->code[offset + 1];
   constant += (uint32_t)(chunk->code[offset + 2]) * UINT8_COUNT;
   constant += (uint32_t)(chunk->code[offset + 3]) * UINT8_COUNT * UINT8_COUNT;
   printf("%-16s %4ud '", name, constant);
-  printValue(chunk->constants.values[constant]);
+  printValue(vm, chunk->constants.values[constant]);
   fputs("'\n", stdout);
   return offset + 4;
 }
 
+static void printGlobalName(Vm* vm, uint32_t slot) {
+  if (slot < (uint32_t)vm->globalNames.count) {
+    fputs(" '", stdout);
+    printValue(vm, vm->globalNames.values[slot]);
+    fputs("'", stdout);
+  }
+  fputs("\n", stdout);
+}
+
+static int globalInstruction(
+    Vm* vm,
+    const char* name,
+    Chunk* chunk,
+    int offset) {
+  uint8_t slot = chunk->code[offset + 1];
+  printf("%-16s %4d", name, slot);
+  printGlobalName(vm, slot);
+  return offset + 2;
+}
+
+static int globalLongInstruction(
+    Vm* vm,
+    const char* name,
+    Chunk* chunk,
+    int offset) {
+  uint32_t slot = chunk->code[offset + 1]
+      + chunk->code[offset + 2] * UINT8_COUNT
+      + chunk->code[offset + 3] * UINT8_COUNT * UINT8_COUNT;
+  printf("%-16s %4u", name, slot);
+  printGlobalName(vm, slot);
+  return offset + 4;
+}
+
 static int byteInstruction(
     const char name[static 1],
     Chunk* chunk,
@@ -46,15 +88,81 @@ static int threeByteInstruction(
   return offset + 4;
 }
 
-void disassembleChunk(Chunk* chunk, const char* name) {
+static int twoByteInstruction(
+    const char name[static 1],
+    Chunk* chunk,
+    int offset) {
+  uint8_t first = chunk->code[offset + 1];
+  uint8_t second = chunk->code[offset + 2];
+  printf("%-16s %4d %4d\n", name, first, second);
+  return offset + 3;
+}
+
+static int localConstantInstruction(
+    Vm* vm,
+    const char name[static 1],
+    Chunk* chunk,
+    int offset) {
+  uint8_t slot = chunk->code[offset + 1];
+  uint8_t constant = chunk->code[offset + 2];
+  printf("%-16s %4d %4d '", name, slot, constant);
+  printValue(vm, chunk->constants.values[constant]);
+  fputs("'\n", stdout);
+  return offset + 3;
+}
+
+static const struct {
+  TypeProfile type;
+  const char* name;
+} TYPE_PROFILE_NAMES[] = {
+    {TYPE_PROFILE_NUMBER, "number"},
+    {TYPE_PROFILE_TEXT, "string"},
+    {TYPE_PROFILE_OTHER, "other"},
+    {0, NULL},
+};
+
+static int profiledInstruction(
+    const char name[static 1],
+    Chunk* chunk,
+    int offset) {
+  uint8_t profile = chunk->typeProfiles ? chunk->typeProfiles[offset] : 0;
+  if (profile == 0) {
+    return simpleInstruction(name, offset);
+  }
+  printf("%-16s", name);
+  const char* separator = " [";
+  for (int i = 0; TYPE_PROFILE_NAMES[i].name; i++) {
+    if (profile & TYPE_PROFILE_NAMES[i].type) {
+      printf("%s%s", separator, TYPE_PROFILE_NAMES[i].name);
+      separator = " ";
+    }
+  }
+  fputs("]\n", stdout);
+  return offset + 1;
+}
+
+void disassembleChunk(Vm* vm, Chunk* chunk, const char* name) {
   printf("== %s ==\n", name);
 
   for (int offset = 0; offset < chunk->count;) {
-    offset = disassembleInstruction(chunk, offset);
+    offset = disassembleInstruction(vm, chunk, offset);
+  }
+}
+
+void disassembleTypeProfiles(Vm* vm, Chunk* chunk) {
+  if (!chunk->typeProfiles) {
+    return;
+  }
+  puts("== type profiles ==");
+  for (int offset = 0; offset < chunk->count;) {
+    if (chunk->typeProfiles[offset] != 0) {
+      disassembleInstruction(vm, chunk, offset);
+    }
+    offset += instructionLength(chunk->code[offset]);
   }
 }
 
-int disassembleInstruction(Chunk* chunk, int offset) {
+int disassembleInstruction(Vm* vm, Chunk* chunk, int offset) {
   printf("%04d ", offset);
   if (offset > 0
       && getLine(&chunk->lines, offset) == getLine(&chunk->lines, offset - 1)) {
@@ -65,21 +173,46 @@ int disassembleInstruction(Chunk* chunk, int offset) {
   uint8_t instruction = chunk->code[offset];
   switch (instruction) {
     case OP_CONSTANT:
-    case OP_DEFINE_GLOBAL:
-    case OP_GET_GLOBAL:
-    case OP_SET_GLOBAL:
-      return constantInstruction(g_OP_CODE_NAMES[instruction], chunk, offset);
+      return constantInstruction(
+          vm,
+          g_OP_CODE_NAMES[instruction],
+          chunk,
+          offset);
+    case OP_DEFINE_GLOBAL_SLOT:
+    case OP_GET_GLOBAL_SLOT:
+    case OP_SET_GLOBAL_SLOT:
+    case OP_SET_GLOBAL_SLOT_POP:
+      return globalInstruction(
+          vm,
+          g_OP_CODE_NAMES[instruction],
+          chunk,
+          offset);
+    case OP_DEFINE_GLOBAL_SLOT_LONG:
+    case OP_GET_GLOBAL_SLOT_LONG:
+    case OP_SET_GLOBAL_SLOT_LONG:
+      return globalLongInstruction(
+          vm,
+          g_OP_CODE_NAMES[instruction],
+          chunk,
+          offset);
     case OP_CONSTANT_LONG:
-    case OP_DEFINE_GLOBAL_LONG:
-    case OP_GET_GLOBAL_LONG:
-    case OP_SET_GLOBAL_LONG:
       return constantLongInstruction(
+          vm,
           g_OP_CODE_NAMES[instruction],
           chunk,
           offset);
     case OP_GET_LOCAL:
     case OP_SET_LOCAL:
+    case OP_SET_LOCAL_POP:
       return byteInstruction(g_OP_CODE_NAMES[instruction], chunk, offset);
+    case OP_GET_LOCAL2:
+      return twoByteInstruction(g_OP_CODE_NAMES[instruction], chunk, offset);
+    case OP_ADD_LOCAL_CONST:
+      return localConstantInstruction(
+          vm,
+          g_OP_CODE_NAMES[instruction],
+          chunk,
+          offset);
     case OP_GET_LOCAL_LONG:
     case OP_SET_LOCAL_LONG:
       return threeByteInstruction(g_OP_CODE_NAMES[instruction], chunk, offset);
@@ -87,13 +220,25 @@ int disassembleInstruction(Chunk* chunk, int offset) {
     case OP_TRUE:
     case OP_FALSE:
     case OP_POP:
-    case OP_EQUAL:
     case OP_GREATER:
     case OP_LESS:
+    case OP_GREATER_EQUAL:
+    case OP_LESS_EQUAL:
     case OP_ADD:
     case OP_SUBTRACT:
     case OP_MULTIPLY:
     case OP_DIVIDE:
+    case OP_GREATER_NUM:
+    case OP_LESS_NUM:
+    case OP_GREATER_EQUAL_NUM:
+    case OP_LESS_EQUAL_NUM:
+    case OP_ADD_NUM:
+    case OP_SUBTRACT_NUM:
+    case OP_MULTIPLY_NUM:
+    case OP_DIVIDE_NUM:
+      return profiledInstruction(g_OP_CODE_NAMES[instruction], chunk, offset);
+    case OP_EQUAL:
+    case OP_NOT_EQUAL:
     case OP_NOT:
     case OP_NEGATE:
     case OP_RETURN:
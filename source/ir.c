@@ -0,0 +1,808 @@
+#include <string.h>
+
+#include <clox/ir.h>
+#include <clox/memory.h>
+#include <clox/object.h>
+#include <clox/optimizer.h>
+
+typedef enum ir_type_e
+{
+  IR_UNKNOWN,
+  IR_NUMBER,
+  IR_STRING,
+  IR_BOOL,
+  IR_NIL,
+} IrType;
+
+// One SSA value or effect. The opcodes are the VM's own: literals are
+// OP_CONSTANT (with a pool index), OP_NIL, OP_TRUE and OP_FALSE, and global
+// accesses are the *_SLOT forms with the slot in `index`. A store is an
+// OP_DEFINE_GLOBAL_SLOT, or an OP_SET_GLOBAL_SLOT when it still has to check
+// that the global exists; either way its value is the operand's.
+typedef struct ir_instruction_s {
+  OpCode op;
+  int arity;
+  int operands[2];
+  uint32_t index;
+  int line;
+  IrType type;
+  // may raise a runtime error
+  bool canFail;
+  bool dead;
+  // the first instruction with the same value; a literal is repeated where
+  // it occurs, so it can be pushed right where it is used
+  int canonical;
+  // uses not yet emitted; lowering counts them down
+  int uses;
+  // stack slot holding the value during lowering, or -1
+  int slot;
+} IrInstruction;
+
+typedef struct int_stack_s {
+  int* values;
+  int count;
+  int capacity;
+} IntStack;
+
+typedef struct ir_s {
+  Vm* vm;
+  Chunk* chunk;
+  IrInstruction* code;
+  int count;
+  int capacity;
+  // value numbering: open-addressed instruction indices plus one, 0 if empty
+  int* numbers;
+  int numberCount;
+  int numberCapacity;
+  // the value each global slot is known to hold, or -1
+  int* globals;
+  int globalCapacity;
+} Ir;
+
+static void pushInt(IntStack* stack, int value) {
+  if (stack->capacity < stack->count + 1) {
+    int oldCapacity = stack->capacity;
+    stack->capacity = GROW_CAPACITY(oldCapacity);
+    stack->values
+        = GROW_ARRAY(int, stack->values, oldCapacity, stack->capacity);
+  }
+  stack->values[stack->count++] = value;
+}
+
+static void freeIntStack(IntStack* stack) {
+  FREE_ARRAY(int, stack->values, stack->capacity);
+}
+
+static bool isLiteral(OpCode op) {
+  return op == OP_CONSTANT || op == OP_NIL || op == OP_TRUE || op == OP_FALSE;
+}
+
+static bool producesValue(OpCode op) {
+  switch (op) {
+    case OP_DEFINE_GLOBAL_SLOT:
+    case OP_SET_GLOBAL_SLOT:
+    case OP_PRINT:
+    case OP_RETURN:
+      return false;
+    default:
+      return true;
+  }
+}
+
+#pragma region "lifting"
+
+static int append(Ir* ir, IrInstruction instruction) {
+  if (ir->capacity < ir->count + 1) {
+    int oldCapacity = ir->capacity;
+    ir->capacity = GROW_CAPACITY(oldCapacity);
+    ir->code = GROW_ARRAY(IrInstruction, ir->code, oldCapacity, ir->capacity);
+  }
+  for (int i = 0; i < instruction.arity; ++i) {
+    ir->code[instruction.operands[i]].uses++;
+  }
+  instruction.canonical = ir->count;
+  ir->code[ir->count] = instruction;
+  return ir->count++;
+}
+
+static int canonicalOperand(Ir* ir, const IrInstruction* instruction, int i) {
+  return i < instruction->arity
+      ? ir->code[instruction->operands[i]].canonical
+      : -1;
+}
+
+static uint32_t numberHash(Ir* ir, const IrInstruction* instruction) {
+  uint64_t key[] = {
+      instruction->op,
+      instruction->index,
+      (uint32_t)canonicalOperand(ir, instruction, 0),
+      (uint32_t)canonicalOperand(ir, instruction, 1),
+  };
+  return (uint32_t)hashBytes(sizeof(key), (const char*)key);
+}
+
+static bool sameNumber(
+    Ir* ir,
+    const IrInstruction* a,
+    const IrInstruction* b) {
+  return a->op == b->op && a->index == b->index
+      && canonicalOperand(ir, a, 0) == canonicalOperand(ir, b, 0)
+      && canonicalOperand(ir, a, 1) == canonicalOperand(ir, b, 1);
+}
+
+static void growNumbers(Ir* ir) {
+  int oldCapacity = ir->numberCapacity;
+  int* old = ir->numbers;
+  ir->numberCapacity = GROW_CAPACITY(oldCapacity);
+  ir->numbers = GROW_ARRAY(int, NULL, 0, ir->numberCapacity);
+  memset(ir->numbers, 0, sizeof(int) * ir->numberCapacity);
+  uint32_t mask = (uint32_t)ir->numberCapacity - 1;
+  for (int i = 0; i < oldCapacity; ++i) {
+    if (old[i] == 0) {
+      continue;
+    }
+    uint32_t bucket = numberHash(ir, &ir->code[old[i] - 1]) & mask;
+    while (ir->numbers[bucket] != 0) {
+      bucket = (bucket + 1) & mask;
+    }
+    ir->numbers[bucket] = old[i];
+  }
+  FREE_ARRAY(int, old, oldCapacity);
+}
+
+// Returns the instruction already computing what `candidate` computes, or
+// appends it. In straight-line code the first one always runs before the
+// second would have, so this holds even for operations that can fail.
+// Literals are appended again either way.
+static int number(Ir* ir, IrInstruction candidate) {
+  if (ir->numberCount + 1 > ir->numberCapacity / 2) {
+    growNumbers(ir);
+  }
+  uint32_t mask = (uint32_t)ir->numberCapacity - 1;
+  for (uint32_t bucket = numberHash(ir, &candidate) & mask;;
+       bucket = (bucket + 1) & mask) {
+    int entry = ir->numbers[bucket];
+    if (entry == 0) {
+      int id = append(ir, candidate);
+      ir->numbers[bucket] = id + 1;
+      ir->numberCount++;
+      return id;
+    }
+    if (sameNumber(ir, &ir->code[entry - 1], &candidate)) {
+      if (!isLiteral(candidate.op)) {
+        return entry - 1;
+      }
+      int id = append(ir, candidate);
+      ir->code[id].canonical = entry - 1;
+      return id;
+    }
+  }
+}
+
+// The pool is already deduplicated, so its index identifies the value.
+static int pooledLiteral(Ir* ir, uint32_t index, int line) {
+  Value value = ir->chunk->constants.values[index];
+  return number(
+      ir,
+      (IrInstruction){
+          .op = OP_CONSTANT,
+          .operands = {-1, -1},
+          .index = index,
+          .line = line,
+          .type = IS_NUMBER(value) ? IR_NUMBER : IR_STRING,
+          .slot = -1,
+      });
+}
+
+static int literal(Ir* ir, Value value, int line) {
+  if (!IS_NIL(value) && !IS_BOOL(value)) {
+    uint32_t constant = (uint32_t)addConstant(ir->vm, ir->chunk, value);
+    return pooledLiteral(ir, constant, line);
+  }
+  IrInstruction instruction = {
+      .op = OP_NIL,
+      .operands = {-1, -1},
+      .line = line,
+      .type = IR_NIL,
+      .slot = -1,
+  };
+  if (IS_BOOL(value)) {
+    instruction.op = AS_BOOL(value) ? OP_TRUE : OP_FALSE;
+    instruction.type = IR_BOOL;
+  }
+  return number(ir, instruction);
+}
+
+static bool literalValue(Ir* ir, int id, Value* value) {
+  IrInstruction* instruction = &ir->code[id];
+  switch (instruction->op) {
+    case OP_CONSTANT:
+      *value = ir->chunk->constants.values[instruction->index];
+      return true;
+    case OP_NIL:
+      *value = NIL_VAL;
+      return true;
+    case OP_TRUE:
+      *value = BOOL_VAL(true);
+      return true;
+    case OP_FALSE:
+      *value = BOOL_VAL(false);
+      return true;
+    default:
+      return false;
+  }
+}
+
+static int operation(Ir* ir, OpCode op, int arity, int a, int b, int line) {
+  Value x;
+  Value y;
+  Value result;
+  if (literalValue(ir, a, &x)
+      && (arity == 1 ? foldUnary(op, x, &result)
+                     : literalValue(ir, b, &y)
+                         && foldBinary(ir->vm, op, x, y, &result))) {
+    return literal(ir, result, line);
+  }
+
+  IrType left = ir->code[a].type;
+  IrType right = arity == 2 ? ir->code[b].type : IR_UNKNOWN;
+  bool numbers = left == IR_NUMBER && right == IR_NUMBER;
+  IrInstruction instruction = {
+      .op = op,
+      .arity = arity,
+      .operands = {a, arity == 2 ? b : -1},
+      .line = line,
+      .slot = -1,
+  };
+  switch (op) {
+    case OP_NOT:
+    case OP_EQUAL:
+    case OP_NOT_EQUAL:
+      instruction.type = IR_BOOL;
+      break;
+    case OP_NEGATE:
+      instruction.type = IR_NUMBER;
+      instruction.canFail = left != IR_NUMBER;
+      break;
+    case OP_ADD:
+      if (numbers) {
+        instruction.type = IR_NUMBER;
+      } else if (left == IR_STRING && right == IR_STRING) {
+        instruction.type = IR_STRING;
+      } else {
+        instruction.type = IR_UNKNOWN;
+        instruction.canFail = true;
+      }
+      break;
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+      instruction.type = IR_NUMBER;
+      instruction.canFail = !numbers;
+      break;
+    default:
+      instruction.type = IR_BOOL;
+      instruction.canFail = !numbers;
+      break;
+  }
+  return number(ir, instruction);
+}
+
+static int* knownGlobal(Ir* ir, uint32_t slot) {
+  if ((uint32_t)ir->globalCapacity <= slot) {
+    int oldCapacity = ir->globalCapacity;
+    int capacity = GROW_CAPACITY(oldCapacity);
+    while ((uint32_t)capacity <= slot) {
+      capacity *= 2;
+    }
+    ir->globals = GROW_ARRAY(int, ir->globals, oldCapacity, capacity);
+    for (int i = oldCapacity; i < capacity; ++i) {
+      ir->globals[i] = -1;
+    }
+    ir->globalCapacity = capacity;
+  }
+  return &ir->globals[slot];
+}
+
+// A global read after a store or an earlier read of the same slot is the
+// value already known.
+static int loadGlobal(Ir* ir, uint32_t slot, int line) {
+  int* known = knownGlobal(ir, slot);
+  if (*known == -1) {
+    *known = append(
+        ir,
+        (IrInstruction){
+            .op = OP_GET_GLOBAL_SLOT,
+            .operands = {-1, -1},
+            .index = slot,
+            .line = line,
+            .canFail = true,
+            .slot = -1,
+        });
+  }
+  return *known;
+}
+
+// Once a slot is known to be defined, assigning it can't fail and is the
+// same as defining it again.
+static void storeGlobal(Ir* ir, OpCode op, uint32_t slot, int value, int line) {
+  int* known = knownGlobal(ir, slot);
+  bool checked = op == OP_SET_GLOBAL_SLOT && *known == -1;
+  append(
+      ir,
+      (IrInstruction){
+          .op = checked ? OP_SET_GLOBAL_SLOT : OP_DEFINE_GLOBAL_SLOT,
+          .arity = 1,
+          .operands = {value, -1},
+          .index = slot,
+          .line = line,
+          .canFail = checked,
+          .slot = -1,
+      });
+  *knownGlobal(ir, slot) = value;
+}
+
+static void effect(Ir* ir, OpCode op, int arity, int operand, int line) {
+  append(
+      ir,
+      (IrInstruction){
+          .op = op,
+          .arity = arity,
+          .operands = {operand, -1},
+          .line = line,
+          .slot = -1,
+      });
+}
+
+static uint32_t threeByteOperand(const uint8_t* code) {
+  return code[1] | (code[2] << 8) | ((uint32_t)code[3] << 16);
+}
+
+// Runs the chunk symbolically: the stack holds the SSA values the VM's stack
+// would hold, so reading a local is just a copy of whatever was stored there.
+static void lift(Ir* ir) {
+  Chunk* chunk = ir->chunk;
+  IntStack stack = {.values = NULL, .count = 0, .capacity = 0};
+
+  LineCursor lines;
+  initLineCursor(&lines, &chunk->lines);
+  for (int offset = 0; offset < chunk->count;) {
+    int line = lineAt(&lines, offset);
+    const uint8_t* code = &chunk->code[offset];
+    int* top = stack.count > 0 ? &stack.values[stack.count - 1] : NULL;
+
+    switch (code[0]) {
+      case OP_CONSTANT:
+        pushInt(&stack, pooledLiteral(ir, code[1], line));
+        break;
+      case OP_CONSTANT_LONG:
+        pushInt(&stack, pooledLiteral(ir, threeByteOperand(code), line));
+        break;
+      case OP_NIL:
+        pushInt(&stack, literal(ir, NIL_VAL, line));
+        break;
+      case OP_TRUE:
+        pushInt(&stack, literal(ir, BOOL_VAL(true), line));
+        break;
+      case OP_FALSE:
+        pushInt(&stack, literal(ir, BOOL_VAL(false), line));
+        break;
+      case OP_POP:
+        stack.count--;
+        break;
+      case OP_DEFINE_GLOBAL_SLOT:
+        storeGlobal(ir, OP_DEFINE_GLOBAL_SLOT, code[1], *top, line);
+        stack.count--;
+        break;
+      case OP_DEFINE_GLOBAL_SLOT_LONG:
+        storeGlobal(
+            ir,
+            OP_DEFINE_GLOBAL_SLOT,
+            threeByteOperand(code),
+            *top,
+            line);
+        stack.count--;
+        break;
+      case OP_GET_GLOBAL_SLOT:
+        pushInt(&stack, loadGlobal(ir, code[1], line));
+        break;
+      case OP_GET_GLOBAL_SLOT_LONG:
+        pushInt(&stack, loadGlobal(ir, threeByteOperand(code), line));
+        break;
+      case OP_SET_GLOBAL_SLOT:
+        storeGlobal(ir, OP_SET_GLOBAL_SLOT, code[1], *top, line);
+        break;
+      case OP_SET_GLOBAL_SLOT_LONG:
+        storeGlobal(
+            ir,
+            OP_SET_GLOBAL_SLOT,
+            threeByteOperand(code),
+            *top,
+            line);
+        break;
+      case OP_SET_GLOBAL_SLOT_POP:
+        storeGlobal(ir, OP_SET_GLOBAL_SLOT, code[1], *top, line);
+        stack.count--;
+        break;
+      case OP_GET_LOCAL:
+        pushInt(&stack, stack.values[code[1]]);
+        break;
+      case OP_GET_LOCAL_LONG:
+        pushInt(&stack, stack.values[threeByteOperand(code)]);
+        break;
+      case OP_SET_LOCAL:
+        stack.values[code[1]] = *top;
+        break;
+      case OP_SET_LOCAL_LONG:
+        stack.values[threeByteOperand(code)] = *top;
+        break;
+      case OP_SET_LOCAL_POP:
+        stack.values[code[1]] = *top;
+        stack.count--;
+        break;
+      case OP_GET_LOCAL2:
+        pushInt(&stack, stack.values[code[1]]);
+        pushInt(&stack, stack.values[code[2]]);
+        break;
+      case OP_ADD_LOCAL_CONST:
+        {
+          int constant = pooledLiteral(ir, code[2], line);
+          pushInt(
+              &stack,
+              operation(
+                  ir,
+                  OP_ADD,
+                  2,
+                  stack.values[code[1]],
+                  constant,
+                  line));
+          break;
+        }
+      case OP_NOT:
+      case OP_NEGATE:
+        *top = operation(ir, code[0], 1, *top, -1, line);
+        break;
+      case OP_PRINT:
+        effect(ir, OP_PRINT, 1, *top, line);
+        stack.count--;
+        break;
+      case OP_RETURN:
+        effect(ir, OP_RETURN, 0, -1, line);
+        break;
+      default:
+        top[-1] = operation(ir, code[0], 2, top[-1], *top, line);
+        stack.count--;
+        break;
+    }
+
+    offset += instructionLength(code[0]);
+  }
+
+  freeIntStack(&stack);
+}
+
+#pragma endregion
+
+#pragma region "elimination"
+
+static void kill(Ir* ir, IrInstruction* instruction) {
+  instruction->dead = true;
+  for (int i = 0; i < instruction->arity; ++i) {
+    ir->code[instruction->operands[i]].uses--;
+  }
+}
+
+// One backward sweep. Operands always come before their users, so a value
+// whose last user dies here is seen, unused, later in the sweep.
+//
+// A store is dead when the slot is stored again before it is read. Without
+// `wholeProgram`, anything that can fail ends the program early and makes
+// every store before it visible to the next REPL line.
+static void eliminateDeadCode(Ir* ir, bool wholeProgram) {
+  // a slot is overwritten, or never read, before the next read when its
+  // stamp equals the generation; failures start a new generation
+  int generation = 1;
+  int* stamps = GROW_ARRAY(int, NULL, 0, ir->globalCapacity);
+  for (int i = 0; i < ir->globalCapacity; ++i) {
+    stamps[i] = wholeProgram ? generation : 0;
+  }
+
+  for (int i = ir->count - 1; i >= 0; --i) {
+    IrInstruction* instruction = &ir->code[i];
+    switch (instruction->op) {
+      case OP_DEFINE_GLOBAL_SLOT:
+        if (stamps[instruction->index] == generation) {
+          kill(ir, instruction);
+        }
+        stamps[instruction->index] = generation;
+        break;
+      case OP_SET_GLOBAL_SLOT:
+        stamps[instruction->index] = generation;
+        break;
+      case OP_GET_GLOBAL_SLOT:
+        stamps[instruction->index] = 0;
+        break;
+      case OP_PRINT:
+      case OP_RETURN:
+        break;
+      default:
+        if (instruction->uses == 0 && !instruction->canFail) {
+          kill(ir, instruction);
+        }
+        break;
+    }
+    if (instruction->canFail && !wholeProgram) {
+      generation++;
+    }
+  }
+
+  FREE_ARRAY(int, stamps, ir->globalCapacity);
+}
+
+#pragma endregion
+
+#pragma region "lowering"
+
+// The stack is laid out as slots at the bottom, holding values with uses
+// still to come, and pending values above them: results left where they
+// were computed, for a later instruction to consume in order.
+typedef struct lowering_s {
+  Ir* ir;
+  Chunk out;
+  // the value in each slot, or -1 for a free one
+  IntStack slots;
+  IntStack freeSlots;
+  IntStack pending;
+} Lowering;
+
+static void emitByte(Lowering* lowering, uint8_t byte, int line) {
+  writeChunk(&lowering->out, byte, line);
+}
+
+static void emitOperand(
+    Lowering* lowering,
+    OpCode shortOp,
+    OpCode longOp,
+    uint32_t operand,
+    int line) {
+  if (operand <= UINT8_MAX) {
+    uint8_t code[] = {shortOp, operand};
+    writeChunkCode(&lowering->out, code, sizeof(code), line);
+  } else {
+    uint8_t code[] = {
+        longOp,
+        operand & 0xFF,
+        (operand >> 8) & 0xFF,
+        (operand >> 16) & 0xFF,
+    };
+    writeChunkCode(&lowering->out, code, sizeof(code), line);
+  }
+}
+
+static void emitInstruction(Lowering* lowering, IrInstruction* instruction) {
+  int line = instruction->line;
+  switch (instruction->op) {
+    case OP_CONSTANT:
+      emitOperand(
+          lowering,
+          OP_CONSTANT,
+          OP_CONSTANT_LONG,
+          instruction->index,
+          line);
+      break;
+    case OP_GET_GLOBAL_SLOT:
+      emitOperand(
+          lowering,
+          OP_GET_GLOBAL_SLOT,
+          OP_GET_GLOBAL_SLOT_LONG,
+          instruction->index,
+          line);
+      break;
+    case OP_DEFINE_GLOBAL_SLOT:
+      emitOperand(
+          lowering,
+          OP_DEFINE_GLOBAL_SLOT,
+          OP_DEFINE_GLOBAL_SLOT_LONG,
+          instruction->index,
+          line);
+      break;
+    case OP_SET_GLOBAL_SLOT:
+      if (instruction->index <= UINT8_MAX) {
+        emitByte(lowering, OP_SET_GLOBAL_SLOT_POP, line);
+        emitByte(lowering, instruction->index, line);
+      } else {
+        emitOperand(
+            lowering,
+            OP_SET_GLOBAL_SLOT,
+            OP_SET_GLOBAL_SLOT_LONG,
+            instruction->index,
+            line);
+        emitByte(lowering, OP_POP, line);
+      }
+      break;
+    default:
+      emitByte(lowering, instruction->op, line);
+      break;
+  }
+}
+
+static void release(Lowering* lowering, int id) {
+  IrInstruction* value = &lowering->ir->code[id];
+  if (--value->uses == 0 && value->slot != -1) {
+    lowering->slots.values[value->slot] = -1;
+    pushInt(&lowering->freeSlots, value->slot);
+  }
+}
+
+static int takeFreeSlot(Lowering* lowering) {
+  IntStack* slots = &lowering->slots;
+  while (lowering->freeSlots.count > 0) {
+    int slot = lowering->freeSlots.values[--lowering->freeSlots.count];
+    // entries go stale when the slot is popped or taken again
+    if (slot < slots->count && slots->values[slot] == -1) {
+      return slot;
+    }
+  }
+  return -1;
+}
+
+static void shrink(Lowering* lowering, int line) {
+  IntStack* slots = &lowering->slots;
+  if (lowering->pending.count > 0) {
+    return;
+  }
+  while (slots->count > 0 && slots->values[slots->count - 1] == -1) {
+    emitByte(lowering, OP_POP, line);
+    slots->count--;
+  }
+}
+
+// Gives every pending value a slot: the top ones move down into free slots
+// while there are any, the rest become slots where they are.
+static void spill(Lowering* lowering, int line) {
+  IntStack* pending = &lowering->pending;
+  IntStack* slots = &lowering->slots;
+  while (pending->count > 0) {
+    int slot = takeFreeSlot(lowering);
+    if (slot == -1) {
+      break;
+    }
+    int id = pending->values[--pending->count];
+    if (slot <= UINT8_MAX) {
+      emitByte(lowering, OP_SET_LOCAL_POP, line);
+      emitByte(lowering, slot, line);
+    } else {
+      emitOperand(lowering, OP_SET_LOCAL, OP_SET_LOCAL_LONG, slot, line);
+      emitByte(lowering, OP_POP, line);
+    }
+    slots->values[slot] = id;
+    lowering->ir->code[id].slot = slot;
+  }
+  for (int i = 0; i < pending->count; ++i) {
+    lowering->ir->code[pending->values[i]].slot = slots->count;
+    pushInt(slots, pending->values[i]);
+  }
+  pending->count = 0;
+}
+
+static void materialize(Lowering* lowering, int id, int line) {
+  IrInstruction* value = &lowering->ir->code[id];
+  if (value->slot != -1) {
+    emitOperand(
+        lowering,
+        OP_GET_LOCAL,
+        OP_GET_LOCAL_LONG,
+        (uint32_t)value->slot,
+        line);
+  } else {
+    // only literals are pushed again instead of being kept
+    IrInstruction copy = *value;
+    copy.line = line;
+    emitInstruction(lowering, &copy);
+  }
+  release(lowering, id);
+}
+
+// Whether the top `count` pending values are the first `count` operands,
+// each used for the last time.
+static bool operandsOnTop(
+    Lowering* lowering,
+    IrInstruction* instruction,
+    int count) {
+  IntStack* pending = &lowering->pending;
+  for (int i = 0; i < count; ++i) {
+    int id = pending->values[pending->count - count + i];
+    if (id != instruction->operands[i] || lowering->ir->code[id].uses != 1) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool isPending(Lowering* lowering, int id, int below) {
+  for (int i = 0; i < below; ++i) {
+    if (lowering->pending.values[i] == id) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static void schedule(Lowering* lowering, int id) {
+  IrInstruction* instruction = &lowering->ir->code[id];
+  IntStack* pending = &lowering->pending;
+  int line = instruction->line;
+  if (instruction->op == OP_RETURN) {
+    shrink(lowering, line);
+  }
+
+  int taken = instruction->arity < pending->count ? instruction->arity
+                                                  : pending->count;
+  while (taken > 0 && !operandsOnTop(lowering, instruction, taken)) {
+    taken--;
+  }
+  for (int i = taken; i < instruction->arity; ++i) {
+    if (isPending(lowering, instruction->operands[i], pending->count - taken)) {
+      spill(lowering, line);
+      taken = 0;
+      break;
+    }
+  }
+
+  pending->count -= taken;
+  for (int i = 0; i < taken; ++i) {
+    release(lowering, instruction->operands[i]);
+  }
+  for (int i = taken; i < instruction->arity; ++i) {
+    materialize(lowering, instruction->operands[i], line);
+  }
+  emitInstruction(lowering, instruction);
+
+  if (producesValue(instruction->op)) {
+    if (instruction->uses == 0) {
+      emitByte(lowering, OP_POP, line);
+    } else {
+      pushInt(pending, id);
+    }
+  }
+  shrink(lowering, line);
+}
+
+static void lower(Ir* ir) {
+  Lowering lowering = {.ir = ir};
+  initChunk(&lowering.out);
+
+  for (int i = 0; i < ir->count; ++i) {
+    IrInstruction* instruction = &ir->code[i];
+    if (instruction->dead
+        || (isLiteral(instruction->op) && instruction->uses != 1)) {
+      // shared literals are pushed again at each use
+      continue;
+    }
+    schedule(&lowering, i);
+  }
+
+  Chunk* chunk = ir->chunk;
+  FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+  freeLineArray(&chunk->lines);
+  chunk->code = lowering.out.code;
+  chunk->count = lowering.out.count;
+  chunk->capacity = lowering.out.capacity;
+  chunk->lines = lowering.out.lines;
+  freeIntStack(&lowering.slots);
+  freeIntStack(&lowering.freeSlots);
+  freeIntStack(&lowering.pending);
+}
+
+#pragma endregion
+
+void optimizeIr(Vm* vm, Chunk* chunk, bool wholeProgram) {
+  Ir ir = {.vm = vm, .chunk = chunk};
+  lift(&ir);
+  eliminateDeadCode(&ir, wholeProgram);
+  lower(&ir);
+
+  FREE_ARRAY(IrInstruction, ir.code, ir.capacity);
+  FREE_ARRAY(int, ir.numbers, ir.numberCapacity);
+  FREE_ARRAY(int, ir.globals, ir.globalCapacity);
+}
@@ -0,0 +1,939 @@
+#include <clox/jit.h>
+
+JitOptions g_JIT_OPTIONS = {
+    .enabled = true,
+    .perfMap = false,
+};
+
+#ifdef JIT
+
+#  include <assert.h>
+#  include <stddef.h>
+#  include <stdio.h>
+#  include <string.h>
+#  include <sys/mman.h>
+#  include <unistd.h>
+
+#  include <clox/memory.h>
+
+#  pragma region "assembler"
+
+typedef enum register_e
+{
+  REG_RAX = 0,
+  REG_RCX = 1,
+  REG_RDX = 2,
+  REG_RBX = 3,
+  REG_RSP = 4,
+  REG_RBP = 5,
+  REG_RSI = 6,
+  REG_RDI = 7,
+  REG_R12 = 12,
+  REG_R13 = 13,
+  REG_R14 = 14,
+  REG_R15 = 15,
+} Register;
+
+// Registers compiled code keeps for the whole chunk. All are callee-saved,
+// so they survive calls into the VM.
+#  define STACK_TOP REG_RBX
+#  define STACK_BASE REG_R12
+#  define CONSTANTS REG_R13
+#  define GLOBALS REG_R14
+// the JitCode being run, for the slow path to find instructions in
+#  define JIT_CODE REG_RBP
+// NaN boxing keeps QNAN at hand for tag checks
+#  define NAN_MASK REG_R15
+
+typedef enum condition_e
+{
+  CONDITION_E = 0x4,
+  CONDITION_NE = 0x5,
+  CONDITION_BE = 0x6,
+  CONDITION_A = 0x7,
+} Condition;
+
+typedef struct assembler_s {
+  uint8_t* code;
+  size_t count;
+} Assembler;
+
+static void emitByte(Assembler* assembler, uint8_t byte) {
+  assembler->code[assembler->count++] = byte;
+}
+
+static void emitInt32(Assembler* assembler, int32_t value) {
+  memcpy(&assembler->code[assembler->count], &value, sizeof(value));
+  assembler->count += sizeof(value);
+}
+
+static void emitUint64(Assembler* assembler, uint64_t value) {
+  memcpy(&assembler->code[assembler->count], &value, sizeof(value));
+  assembler->count += sizeof(value);
+}
+
+static void emitRex(Assembler* assembler, bool wide, int reg, int base) {
+  uint8_t rex
+      = (uint8_t)(0x40 | (wide << 3) | ((reg >> 3) << 2) | (base >> 3));
+  if (rex != 0x40) {
+    emitByte(assembler, rex);
+  }
+}
+
+// ModRM (and SIB) bytes for `[base + displacement]`, with `reg` in the reg
+// field.
+static void emitMemory(
+    Assembler* assembler,
+    int reg,
+    Register base,
+    int32_t displacement) {
+  bool short8 = displacement >= INT8_MIN && displacement <= INT8_MAX;
+  emitByte(
+      assembler,
+      (uint8_t)(((short8 ? 1 : 2) << 6) | ((reg & 7) << 3) | (base & 7)));
+  if ((base & 7) == REG_RSP) {
+    emitByte(assembler, 0x24);
+  }
+  if (short8) {
+    emitByte(assembler, (uint8_t)displacement);
+  } else {
+    emitInt32(assembler, displacement);
+  }
+}
+
+static void emitRegisters(Assembler* assembler, int reg, int rm) {
+  emitByte(assembler, (uint8_t)(0xc0 | ((reg & 7) << 3) | (rm & 7)));
+}
+
+// mov reg, [base + displacement]
+static void emitLoad(
+    Assembler* assembler,
+    Register reg,
+    Register base,
+    int32_t displacement) {
+  emitRex(assembler, true, reg, base);
+  emitByte(assembler, 0x8b);
+  emitMemory(assembler, reg, base, displacement);
+}
+
+// mov [base + displacement], reg
+static void emitStore(
+    Assembler* assembler,
+    Register base,
+    int32_t displacement,
+    Register reg) {
+  emitRex(assembler, true, reg, base);
+  emitByte(assembler, 0x89);
+  emitMemory(assembler, reg, base, displacement);
+}
+
+#  ifdef NAN_BOXING
+// lea reg, [base + displacement]
+static void emitLea(
+    Assembler* assembler,
+    Register reg,
+    Register base,
+    int32_t displacement) {
+  emitRex(assembler, true, reg, base);
+  emitByte(assembler, 0x8d);
+  emitMemory(assembler, reg, base, displacement);
+}
+#  endif
+
+// mov destination, source
+static void emitMove(
+    Assembler* assembler,
+    Register destination,
+    Register source) {
+  emitRex(assembler, true, source, destination);
+  emitByte(assembler, 0x89);
+  emitRegisters(assembler, source, destination);
+}
+
+// mov reg, immediate
+static void emitMoveImmediate(
+    Assembler* assembler,
+    Register reg,
+    uint64_t immediate) {
+  // the 32-bit form zero-extends
+  bool wide = immediate > UINT32_MAX;
+  emitRex(assembler, wide, 0, reg);
+  emitByte(assembler, (uint8_t)(0xb8 + (reg & 7)));
+  if (wide) {
+    emitUint64(assembler, immediate);
+  } else {
+    emitInt32(assembler, (int32_t)(uint32_t)immediate);
+  }
+}
+
+// add/sub reg, immediate; `extension` selects the operation
+static void emitArithmeticImmediate(
+    Assembler* assembler,
+    int extension,
+    Register reg,
+    int32_t immediate) {
+  bool short8 = immediate >= INT8_MIN && immediate <= INT8_MAX;
+  emitRex(assembler, true, 0, reg);
+  emitByte(assembler, short8 ? 0x83 : 0x81);
+  emitRegisters(assembler, extension, reg);
+  if (short8) {
+    emitByte(assembler, (uint8_t)immediate);
+  } else {
+    emitInt32(assembler, immediate);
+  }
+}
+
+static void emitAddImmediate(
+    Assembler* assembler,
+    Register reg,
+    int32_t immediate) {
+  emitArithmeticImmediate(assembler, 0, reg, immediate);
+}
+
+static void emitSubtractImmediate(
+    Assembler* assembler,
+    Register reg,
+    int32_t immediate) {
+  emitArithmeticImmediate(assembler, 5, reg, immediate);
+}
+
+// A two-register instruction of the form `op rm, reg`, e.g. and, cmp.
+static void emitRegisterOperation(
+    Assembler* assembler,
+    uint8_t opcode,
+    Register rm,
+    Register reg) {
+  emitRex(assembler, true, reg, rm);
+  emitByte(assembler, opcode);
+  emitRegisters(assembler, reg, rm);
+}
+
+#  define AND_OPCODE 0x21
+#  define CMP_OPCODE 0x39
+#  define TEST_OPCODE 0x85
+
+// movsd xmm, [base + displacement] and back
+static void emitDoubleMemory(
+    Assembler* assembler,
+    uint8_t opcode,
+    int xmm,
+    Register base,
+    int32_t displacement) {
+  emitByte(assembler, 0xf2);
+  emitRex(assembler, false, xmm, base);
+  emitByte(assembler, 0x0f);
+  emitByte(assembler, opcode);
+  emitMemory(assembler, xmm, base, displacement);
+}
+
+#  define MOVSD_LOAD 0x10
+#  define MOVSD_STORE 0x11
+#  define ADDSD 0x58
+#  define MULSD 0x59
+#  define SUBSD 0x5c
+#  define DIVSD 0x5e
+
+// addsd/subsd/mulsd/divsd xmm0, xmm1
+static void emitDoubleArithmetic(Assembler* assembler, uint8_t opcode) {
+  emitByte(assembler, 0xf2);
+  emitByte(assembler, 0x0f);
+  emitByte(assembler, opcode);
+  emitRegisters(assembler, 0, 1);
+}
+
+// ucomisd xmm`left`, xmm`right`
+static void emitCompareDoubles(Assembler* assembler, int left, int right) {
+  emitByte(assembler, 0x66);
+  emitByte(assembler, 0x0f);
+  emitByte(assembler, 0x2e);
+  emitRegisters(assembler, left, right);
+}
+
+// setcc al; movzx eax, al
+static void emitSetCondition(Assembler* assembler, Condition condition) {
+  emitByte(assembler, 0x0f);
+  emitByte(assembler, (uint8_t)(0x90 | condition));
+  emitByte(assembler, 0xc0);
+  emitByte(assembler, 0x0f);
+  emitByte(assembler, 0xb6);
+  emitByte(assembler, 0xc0);
+}
+
+#  ifndef NAN_BOXING
+// cmp dword [base + displacement], immediate
+static void emitCompareDword(
+    Assembler* assembler,
+    Register base,
+    int32_t displacement,
+    int8_t immediate) {
+  emitRex(assembler, false, 0, base);
+  emitByte(assembler, 0x83);
+  emitMemory(assembler, 7, base, displacement);
+  emitByte(assembler, (uint8_t)immediate);
+}
+
+// mov dword [base + displacement], immediate
+static void emitStoreDword(
+    Assembler* assembler,
+    Register base,
+    int32_t displacement,
+    int32_t immediate) {
+  emitRex(assembler, false, 0, base);
+  emitByte(assembler, 0xc7);
+  emitMemory(assembler, 0, base, displacement);
+  emitInt32(assembler, immediate);
+}
+#  endif
+
+// Short jumps stay within one instruction's native sequence. These return
+// where the offset goes, to be filled in by patchShortJump() once the
+// target is emitted.
+static size_t emitShortJump(Assembler* assembler) {
+  emitByte(assembler, 0xeb);
+  emitByte(assembler, 0);
+  return assembler->count - 1;
+}
+
+static size_t emitShortConditionalJump(
+    Assembler* assembler,
+    Condition condition) {
+  emitByte(assembler, (uint8_t)(0x70 | condition));
+  emitByte(assembler, 0);
+  return assembler->count - 1;
+}
+
+// Points a short jump at the next instruction emitted.
+static void patchShortJump(Assembler* assembler, size_t at) {
+  size_t distance = assembler->count - (at + 1);
+  assert(distance <= INT8_MAX);
+  assembler->code[at] = (uint8_t)distance;
+}
+
+static size_t emitJump(Assembler* assembler) {
+  emitByte(assembler, 0xe9);
+  emitInt32(assembler, 0);
+  return assembler->count - 4;
+}
+
+static void patchJump(Assembler* assembler, size_t at) {
+  int32_t offset = (int32_t)(assembler->count - (at + 4));
+  memcpy(&assembler->code[at], &offset, sizeof(offset));
+}
+
+static int32_t distanceBack(Assembler* assembler, size_t target) {
+  return (int32_t)(target - (assembler->count + 4));
+}
+
+// jmp/call to code already emitted
+static void emitJumpBack(Assembler* assembler, size_t target) {
+  emitByte(assembler, 0xe9);
+  emitInt32(assembler, distanceBack(assembler, target));
+}
+
+static void emitCallBack(Assembler* assembler, size_t target) {
+  emitByte(assembler, 0xe8);
+  emitInt32(assembler, distanceBack(assembler, target));
+}
+
+static void emitPush(Assembler* assembler, Register reg) {
+  emitRex(assembler, false, 0, reg);
+  emitByte(assembler, (uint8_t)(0x50 + (reg & 7)));
+}
+
+static void emitPop(Assembler* assembler, Register reg) {
+  emitRex(assembler, false, 0, reg);
+  emitByte(assembler, (uint8_t)(0x58 + (reg & 7)));
+}
+
+#  pragma endregion
+
+#  pragma region "values"
+
+#  define VALUE_SIZE ((int32_t)sizeof(Value))
+#  ifdef NAN_BOXING
+#    define NUMBER_OFFSET 0
+#  else
+#    define NUMBER_OFFSET ((int32_t)offsetof(Value, as))
+#    define TYPE_OFFSET ((int32_t)offsetof(Value, type))
+#  endif
+
+static void emitCopyValue(
+    Assembler* assembler,
+    Register destination,
+    int32_t destinationOffset,
+    Register source,
+    int32_t sourceOffset) {
+  for (int32_t word = 0; word < VALUE_SIZE; word += 8) {
+    emitLoad(assembler, REG_RAX, source, sourceOffset + word);
+    emitStore(assembler, destination, destinationOffset + word, REG_RAX);
+  }
+}
+
+static void emitStoreValue(
+    Assembler* assembler,
+    Register base,
+    int32_t offset,
+    Value value) {
+  uint64_t words[sizeof(Value) / 8];
+  memcpy(words, &value, sizeof(Value));
+  for (size_t i = 0; i < sizeof(Value) / 8; i++) {
+    emitMoveImmediate(assembler, REG_RAX, words[i]);
+    emitStore(assembler, base, offset + (int32_t)i * 8, REG_RAX);
+  }
+}
+
+// Jumps, to a target patched later, if the value is not a number.
+static size_t emitJumpIfNotNumber(
+    Assembler* assembler,
+    Register base,
+    int32_t offset) {
+#  ifdef NAN_BOXING
+  emitLoad(assembler, REG_RAX, base, offset);
+  emitRegisterOperation(assembler, AND_OPCODE, REG_RAX, NAN_MASK);
+  emitRegisterOperation(assembler, CMP_OPCODE, REG_RAX, NAN_MASK);
+  return emitShortConditionalJump(assembler, CONDITION_E);
+#  else
+  emitCompareDword(assembler, base, offset + TYPE_OFFSET, VAL_NUMBER);
+  return emitShortConditionalJump(assembler, CONDITION_NE);
+#  endif
+}
+
+static size_t emitJumpIfUndefined(
+    Assembler* assembler,
+    Register base,
+    int32_t offset) {
+#  ifdef NAN_BOXING
+  emitLoad(assembler, REG_RAX, base, offset);
+  emitLea(assembler, REG_RCX, NAN_MASK, TAG_UNDEFINED);
+  emitRegisterOperation(assembler, CMP_OPCODE, REG_RAX, REG_RCX);
+  return emitShortConditionalJump(assembler, CONDITION_E);
+#  else
+  emitCompareDword(assembler, base, offset + TYPE_OFFSET, VAL_UNDEFINED);
+  return emitShortConditionalJump(assembler, CONDITION_E);
+#  endif
+}
+
+// Stores the boolean in eax, 0 or 1, as a Value.
+static void emitStoreBool(Assembler* assembler, Register base, int32_t offset) {
+#  ifdef NAN_BOXING
+  // lea rax, [NAN_MASK + rax + TAG_FALSE]; TAG_TRUE is TAG_FALSE + 1
+  emitRex(assembler, true, REG_RAX, NAN_MASK);
+  emitByte(assembler, 0x8d);
+  emitByte(assembler, 0x44);
+  emitByte(assembler, (uint8_t)((REG_RAX << 3) | (NAN_MASK & 7)));
+  emitByte(assembler, TAG_FALSE);
+  emitStore(assembler, base, offset, REG_RAX);
+#  else
+  emitStoreDword(assembler, base, offset + TYPE_OFFSET, VAL_BOOL);
+  // mov byte [base + offset], al
+  emitRex(assembler, false, 0, base);
+  emitByte(assembler, 0x88);
+  emitMemory(assembler, REG_RAX, base, offset + NUMBER_OFFSET);
+#  endif
+}
+
+// Makes the value at `offset` a number, so its double can be stored.
+static void emitNumberType(
+    Assembler* assembler,
+    Register base,
+    int32_t offset) {
+#  ifdef NAN_BOXING
+  (void)assembler;
+  (void)base;
+  (void)offset;
+#  else
+  emitStoreDword(assembler, base, offset + TYPE_OFFSET, VAL_NUMBER);
+#  endif
+}
+
+#  pragma endregion
+
+#  pragma region "slow path"
+
+// Called from the shared stub with the stack top, the return address of the
+// site's call and the JitCode. The return address identifies the site.
+static Value* slowPath(
+    Value* stackTop,
+    const uint8_t* returnAddress,
+    const JitCode* jit) {
+  uint32_t native = (uint32_t)(returnAddress - jit->code);
+  int low = 0;
+  int high = jit->siteCount - 1;
+  while (low < high) {
+    int middle = low + (high - low) / 2;
+    if (jit->sites[middle].native < native) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  assert(jit->sites[low].native == native);
+  return runSlowPath(
+      jit->vm,
+      stackTop,
+      &jit->bytecode[jit->sites[low].bytecode]);
+}
+
+#  pragma endregion
+
+#  pragma region "instructions"
+
+// Longest native sequence any instruction compiles to, with room to spare;
+// code is mapped for the worst case and trimmed afterwards.
+#  define MAX_INSTRUCTION_CODE 96
+// the prologue, the shared exits and the slow path stub
+#  define MAX_FRAME_CODE 128
+
+typedef struct compilation_s {
+  Assembler assembler;
+  JitCode* jit;
+  const Chunk* chunk;
+  // offset of the instruction being compiled
+  int offset;
+  // where the shared code is
+  size_t errorExit;
+  size_t returnExit;
+  size_t slowPathStub;
+} Compilation;
+
+// Hands the instruction over to runSlowPath(), and leaves compiled code if
+// that raised a runtime error.
+static void emitSlowPath(Compilation* compilation) {
+  Assembler* assembler = &compilation->assembler;
+  emitCallBack(assembler, compilation->slowPathStub);
+
+  JitCode* jit = compilation->jit;
+  if (jit->siteCapacity < jit->siteCount + 1) {
+    int oldCapacity = jit->siteCapacity;
+    jit->siteCapacity = GROW_CAPACITY(oldCapacity);
+    jit->sites
+        = GROW_ARRAY(JitSite, jit->sites, oldCapacity, jit->siteCapacity);
+  }
+  jit->sites[jit->siteCount++] = (JitSite){
+      .native = (uint32_t)assembler->count,
+      .bytecode = (uint32_t)compilation->offset,
+  };
+}
+
+// A fast path ends here. The slow path is emitted after it, with `misses`
+// jumping to it.
+static void emitFastPathEnd(
+    Compilation* compilation,
+    const size_t* misses,
+    int missCount) {
+  Assembler* assembler = &compilation->assembler;
+  size_t done = emitShortJump(assembler);
+  for (int i = 0; i < missCount; i++) {
+    patchShortJump(assembler, misses[i]);
+  }
+  emitSlowPath(compilation);
+  patchShortJump(assembler, done);
+}
+
+// Loads both operands of a binary instruction into xmm0 and xmm1 if they
+// are numbers; `misses` receives the jumps taken when they aren't.
+static void emitNumberOperands(Compilation* compilation, size_t misses[2]) {
+  Assembler* assembler = &compilation->assembler;
+  misses[0] = emitJumpIfNotNumber(assembler, STACK_TOP, -2 * VALUE_SIZE);
+  misses[1] = emitJumpIfNotNumber(assembler, STACK_TOP, -VALUE_SIZE);
+  emitDoubleMemory(
+      assembler,
+      MOVSD_LOAD,
+      0,
+      STACK_TOP,
+      -2 * VALUE_SIZE + NUMBER_OFFSET);
+  emitDoubleMemory(
+      assembler,
+      MOVSD_LOAD,
+      1,
+      STACK_TOP,
+      -VALUE_SIZE + NUMBER_OFFSET);
+}
+
+static void compileArithmetic(Compilation* compilation, uint8_t opcode) {
+  Assembler* assembler = &compilation->assembler;
+  size_t misses[2];
+  emitNumberOperands(compilation, misses);
+  emitDoubleArithmetic(assembler, opcode);
+  emitDoubleMemory(
+      assembler,
+      MOVSD_STORE,
+      0,
+      STACK_TOP,
+      -2 * VALUE_SIZE + NUMBER_OFFSET);
+  emitSubtractImmediate(assembler, STACK_TOP, VALUE_SIZE);
+  emitFastPathEnd(compilation, misses, 2);
+}
+
+// `swap` compares b with a instead of a with b. The conditions are chosen
+// so a NaN operand gives the same answers as run().
+static void compileComparison(
+    Compilation* compilation,
+    bool swap,
+    Condition condition) {
+  Assembler* assembler = &compilation->assembler;
+  size_t misses[2];
+  emitNumberOperands(compilation, misses);
+  emitCompareDoubles(assembler, swap ? 1 : 0, swap ? 0 : 1);
+  emitSetCondition(assembler, condition);
+  emitStoreBool(assembler, STACK_TOP, -2 * VALUE_SIZE);
+  emitSubtractImmediate(assembler, STACK_TOP, VALUE_SIZE);
+  emitFastPathEnd(compilation, misses, 2);
+}
+
+static void compileNegate(Compilation* compilation) {
+  Assembler* assembler = &compilation->assembler;
+  size_t miss = emitJumpIfNotNumber(assembler, STACK_TOP, -VALUE_SIZE);
+  // btc qword [top - VALUE_SIZE + NUMBER_OFFSET], 63
+  emitRex(assembler, true, 0, STACK_TOP);
+  emitByte(assembler, 0x0f);
+  emitByte(assembler, 0xba);
+  emitMemory(assembler, 7, STACK_TOP, -VALUE_SIZE + NUMBER_OFFSET);
+  emitByte(assembler, 63);
+  emitFastPathEnd(compilation, &miss, 1);
+}
+
+static void compileAddLocalConstant(
+    Compilation* compilation,
+    const uint8_t* ip) {
+  Assembler* assembler = &compilation->assembler;
+  int32_t local = ip[1] * VALUE_SIZE;
+  int32_t constant = ip[2] * VALUE_SIZE;
+  // strings are concatenated by the VM
+  if (!IS_NUMBER(compilation->chunk->constants.values[ip[2]])) {
+    emitSlowPath(compilation);
+    return;
+  }
+  size_t miss = emitJumpIfNotNumber(assembler, STACK_BASE, local);
+  emitDoubleMemory(
+      assembler,
+      MOVSD_LOAD,
+      0,
+      STACK_BASE,
+      local + NUMBER_OFFSET);
+  emitDoubleMemory(
+      assembler,
+      MOVSD_LOAD,
+      1,
+      CONSTANTS,
+      constant + NUMBER_OFFSET);
+  emitDoubleArithmetic(assembler, ADDSD);
+  emitNumberType(assembler, STACK_TOP, 0);
+  emitDoubleMemory(assembler, MOVSD_STORE, 0, STACK_TOP, NUMBER_OFFSET);
+  emitAddImmediate(assembler, STACK_TOP, VALUE_SIZE);
+  emitFastPathEnd(compilation, &miss, 1);
+}
+
+static void compileGetGlobal(Compilation* compilation, int32_t global) {
+  Assembler* assembler = &compilation->assembler;
+  size_t miss = emitJumpIfUndefined(assembler, GLOBALS, global);
+  emitCopyValue(assembler, STACK_TOP, 0, GLOBALS, global);
+  emitAddImmediate(assembler, STACK_TOP, VALUE_SIZE);
+  emitFastPathEnd(compilation, &miss, 1);
+}
+
+static void compileSetGlobal(
+    Compilation* compilation,
+    int32_t global,
+    bool popValue) {
+  Assembler* assembler = &compilation->assembler;
+  size_t miss = emitJumpIfUndefined(assembler, GLOBALS, global);
+  emitCopyValue(assembler, GLOBALS, global, STACK_TOP, -VALUE_SIZE);
+  if (popValue) {
+    emitSubtractImmediate(assembler, STACK_TOP, VALUE_SIZE);
+  }
+  emitFastPathEnd(compilation, &miss, 1);
+}
+
+// The instruction's first operand, a slot or constant index; 0 if it has
+// none.
+static uint32_t readOperand(const uint8_t* ip) {
+  switch (instructionLength(ip[0])) {
+    case 1:
+      return 0;
+    case 4:
+      return ip[1] | (ip[2] << 8) | ((uint32_t)ip[3] << 16);
+    default:
+      return ip[1];
+  }
+}
+
+static void compileInstruction(Compilation* compilation, const uint8_t* ip) {
+  Assembler* assembler = &compilation->assembler;
+  int32_t operand = (int32_t)readOperand(ip) * VALUE_SIZE;
+  switch (genericOpcode(ip[0])) {
+    case OP_CONSTANT:
+    case OP_CONSTANT_LONG:
+      emitCopyValue(assembler, STACK_TOP, 0, CONSTANTS, operand);
+      emitAddImmediate(assembler, STACK_TOP, VALUE_SIZE);
+      break;
+    case OP_NIL:
+      emitStoreValue(assembler, STACK_TOP, 0, NIL_VAL);
+      emitAddImmediate(assembler, STACK_TOP, VALUE_SIZE);
+      break;
+    case OP_TRUE:
+      emitStoreValue(assembler, STACK_TOP, 0, BOOL_VAL(true));
+      emitAddImmediate(assembler, STACK_TOP, VALUE_SIZE);
+      break;
+    case OP_FALSE:
+      emitStoreValue(assembler, STACK_TOP, 0, BOOL_VAL(false));
+      emitAddImmediate(assembler, STACK_TOP, VALUE_SIZE);
+      break;
+    case OP_POP:
+      emitSubtractImmediate(assembler, STACK_TOP, VALUE_SIZE);
+      break;
+    case OP_DEFINE_GLOBAL_SLOT:
+    case OP_DEFINE_GLOBAL_SLOT_LONG:
+      emitCopyValue(assembler, GLOBALS, operand, STACK_TOP, -VALUE_SIZE);
+      emitSubtractImmediate(assembler, STACK_TOP, VALUE_SIZE);
+      break;
+    case OP_GET_GLOBAL_SLOT:
+    case OP_GET_GLOBAL_SLOT_LONG:
+      compileGetGlobal(compilation, operand);
+      break;
+    case OP_SET_GLOBAL_SLOT:
+    case OP_SET_GLOBAL_SLOT_LONG:
+      compileSetGlobal(compilation, operand, false);
+      break;
+    case OP_SET_GLOBAL_SLOT_POP:
+      compileSetGlobal(compilation, operand, true);
+      break;
+    case OP_GET_LOCAL:
+    case OP_GET_LOCAL_LONG:
+      emitCopyValue(assembler, STACK_TOP, 0, STACK_BASE, operand);
+      emitAddImmediate(assembler, STACK_TOP, VALUE_SIZE);
+      break;
+    case OP_SET_LOCAL:
+    case OP_SET_LOCAL_LONG:
+      emitCopyValue(assembler, STACK_BASE, operand, STACK_TOP, -VALUE_SIZE);
+      break;
+    case OP_SET_LOCAL_POP:
+      emitCopyValue(assembler, STACK_BASE, operand, STACK_TOP, -VALUE_SIZE);
+      emitSubtractImmediate(assembler, STACK_TOP, VALUE_SIZE);
+      break;
+    case OP_GET_LOCAL2:
+      // the second slot may be the one the first copy fills
+      emitCopyValue(assembler, STACK_TOP, 0, STACK_BASE, operand);
+      emitCopyValue(
+          assembler,
+          STACK_TOP,
+          VALUE_SIZE,
+          STACK_BASE,
+          ip[2] * VALUE_SIZE);
+      emitAddImmediate(assembler, STACK_TOP, 2 * VALUE_SIZE);
+      break;
+    case OP_ADD:
+      compileArithmetic(compilation, ADDSD);
+      break;
+    case OP_SUBTRACT:
+      compileArithmetic(compilation, SUBSD);
+      break;
+    case OP_MULTIPLY:
+      compileArithmetic(compilation, MULSD);
+      break;
+    case OP_DIVIDE:
+      compileArithmetic(compilation, DIVSD);
+      break;
+    case OP_GREATER:
+      compileComparison(compilation, false, CONDITION_A);
+      break;
+    case OP_LESS:
+      compileComparison(compilation, true, CONDITION_A);
+      break;
+    case OP_GREATER_EQUAL:
+      // !(a < b)
+      compileComparison(compilation, true, CONDITION_BE);
+      break;
+    case OP_LESS_EQUAL:
+      // !(a > b)
+      compileComparison(compilation, false, CONDITION_BE);
+      break;
+    case OP_NEGATE:
+      compileNegate(compilation);
+      break;
+    case OP_ADD_LOCAL_CONST:
+      compileAddLocalConstant(compilation, ip);
+      break;
+    case OP_EQUAL:
+    case OP_NOT_EQUAL:
+    case OP_NOT:
+    case OP_PRINT:
+      emitSlowPath(compilation);
+      break;
+    case OP_RETURN:
+      emitMoveImmediate(assembler, REG_RAX, INTERPRET_OK);
+      emitJumpBack(assembler, compilation->returnExit);
+      break;
+    default:
+      assert(false);
+  }
+}
+
+// Saves the registers compiled code keeps and loads them from the arguments
+// (stack, constants, globals, JitCode). The shared code follows, ahead of
+// the instructions that jump and call back to it.
+static void compileFrame(Compilation* compilation) {
+  Assembler* assembler = &compilation->assembler;
+  emitPush(assembler, REG_RBP);
+  emitPush(assembler, REG_RBX);
+  emitPush(assembler, REG_R12);
+  emitPush(assembler, REG_R13);
+  emitPush(assembler, REG_R14);
+  emitPush(assembler, REG_R15);
+  // realign the stack to 16 bytes for calls
+  emitSubtractImmediate(assembler, REG_RSP, 8);
+  emitMove(assembler, STACK_TOP, REG_RDI);
+  emitMove(assembler, STACK_BASE, REG_RDI);
+  emitMove(assembler, CONSTANTS, REG_RSI);
+  emitMove(assembler, GLOBALS, REG_RDX);
+  emitMove(assembler, JIT_CODE, REG_RCX);
+#  ifdef NAN_BOXING
+  emitMoveImmediate(assembler, NAN_MASK, QNAN);
+#  endif
+  size_t body = emitJump(assembler);
+
+  compilation->errorExit = assembler->count;
+  emitMoveImmediate(assembler, REG_RAX, INTERPRET_RUNTIME_ERROR);
+  compilation->returnExit = assembler->count;
+  emitAddImmediate(assembler, REG_RSP, 8);
+  emitPop(assembler, REG_R15);
+  emitPop(assembler, REG_R14);
+  emitPop(assembler, REG_R13);
+  emitPop(assembler, REG_R12);
+  emitPop(assembler, REG_RBX);
+  emitPop(assembler, REG_RBP);
+  // ret
+  emitByte(assembler, 0xc3);
+
+  // Every slow path is a 5-byte call here. The stub passes its return
+  // address on to slowPath(), which looks up the instruction from it.
+  compilation->slowPathStub = assembler->count;
+  emitMove(assembler, REG_RDI, STACK_TOP);
+  emitLoad(assembler, REG_RSI, REG_RSP, 0);
+  emitMove(assembler, REG_RDX, JIT_CODE);
+  // the call here left the stack 8 bytes off alignment
+  emitSubtractImmediate(assembler, REG_RSP, 8);
+  emitMoveImmediate(assembler, REG_RAX, (uint64_t)(uintptr_t)&slowPath);
+  // call rax
+  emitByte(assembler, 0xff);
+  emitByte(assembler, 0xd0);
+  emitAddImmediate(assembler, REG_RSP, 8);
+  emitRegisterOperation(assembler, TEST_OPCODE, REG_RAX, REG_RAX);
+  size_t failed = emitShortConditionalJump(assembler, CONDITION_E);
+  emitMove(assembler, STACK_TOP, REG_RAX);
+  // ret
+  emitByte(assembler, 0xc3);
+  patchShortJump(assembler, failed);
+  // drop the return address into compiled code, then leave it
+  emitAddImmediate(assembler, REG_RSP, 8);
+  emitJumpBack(assembler, compilation->errorExit);
+
+  patchJump(assembler, body);
+}
+
+#  pragma endregion
+
+#  pragma region "perf map"
+
+// perf looks up symbols for JIT code in /tmp/perf-<pid>.map, one
+// "start size name" line per symbol.
+static void writePerfMap(const JitCode* jit, size_t codeSize) {
+  char path[64];
+  snprintf(path, sizeof(path), "/tmp/perf-%ld.map", (long)getpid());
+  FILE* map = fopen(path, "a");
+  if (!map) {
+    return;
+  }
+  static int chunkCount = 0;
+  fprintf(
+      map,
+      "%lx %zx lox_chunk_%d\n",
+      (unsigned long)(uintptr_t)jit->code,
+      codeSize,
+      chunkCount++);
+  fclose(map);
+}
+
+#  pragma endregion
+
+bool compileJit(Vm* vm, const Chunk* chunk, JitCode* jit) {
+  size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+  size_t capacity
+      = MAX_FRAME_CODE + (size_t)chunk->count * MAX_INSTRUCTION_CODE;
+  capacity = (capacity + pageSize - 1) / pageSize * pageSize;
+  // only the pages written to are ever backed by memory
+  void* code = mmap(
+      NULL,
+      capacity,
+      PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+      -1,
+      0);
+  if (code == MAP_FAILED) {
+    return false;
+  }
+
+  *jit = (JitCode){
+      .vm = vm,
+      .code = code,
+      .size = capacity,
+      .bytecode = chunk->code,
+      .sites = NULL,
+      .siteCount = 0,
+      .siteCapacity = 0,
+  };
+  Compilation compilation = {
+      .assembler = {.code = code, .count = 0},
+      .jit = jit,
+      .chunk = chunk,
+  };
+  compileFrame(&compilation);
+  for (int offset = 0; offset < chunk->count;) {
+    compilation.offset = offset;
+    compileInstruction(&compilation, &chunk->code[offset]);
+    assert(
+        compilation.assembler.count
+        <= MAX_FRAME_CODE + (size_t)(offset + 1) * MAX_INSTRUCTION_CODE);
+    offset += instructionLength(chunk->code[offset]);
+  }
+
+  // give back the pages the worst case didn't need, then make the rest
+  // executable and no longer writable
+  size_t used = compilation.assembler.count;
+  size_t size = (used + pageSize - 1) / pageSize * pageSize;
+  if (size < capacity) {
+    munmap((uint8_t*)code + size, capacity - size);
+    jit->size = size;
+  }
+  if (mprotect(code, size, PROT_READ | PROT_EXEC) != 0) {
+    freeJit(jit);
+    return false;
+  }
+  if (g_JIT_OPTIONS.perfMap) {
+    writePerfMap(jit, used);
+  }
+  return true;
+}
+
+typedef InterpretResult (*JitEntry)(Value*, Value*, Value*, const JitCode*);
+
+InterpretResult runJit(
+    const JitCode* jit,
+    Value* stack,
+    Value* constants,
+    Value* globals) {
+  JitEntry entry = (JitEntry)(uintptr_t)jit->code;
+  return entry(stack, constants, globals, jit);
+}
+
+void freeJit(JitCode* jit) {
+  munmap(jit->code, jit->size);
+  FREE_ARRAY(JitSite, jit->sites, jit->siteCapacity);
+  jit->code = NULL;
+  jit->size = 0;
+  jit->sites = NULL;
+  jit->siteCount = 0;
+  jit->siteCapacity = 0;
+}
+
+#endif
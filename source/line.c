@@ -4,39 +4,218 @@
 #include <clox/memory.h>
 
 void initLineArray(LineArray* array) {
-  array->lines = NULL;
-  array->capacity = 0;
-  array->count = 0;
+  array->runs = NULL;
+  array->runBytes = 0;
+  array->runCapacity = 0;
+  array->runCount = 0;
+  array->checkpoints = NULL;
+  array->checkpointCount = 0;
+  array->checkpointCapacity = 0;
+  array->lastLine = 0;
+  array->line = 0;
+  array->start = 0;
+  array->length = 0;
 }
 
 void freeLineArray(LineArray* array) {
-  FREE_ARRAY(Line, array->lines, array->capacity);
+  FREE_ARRAY(uint8_t, array->runs, array->runCapacity);
+  FREE_ARRAY(LineCheckpoint, array->checkpoints, array->checkpointCapacity);
   initLineArray(array);
 }
 
-void addLineArray(LineArray* array, int line) {
-  if (array->count > 0 && array->lines[array->count - 1].line == line) {
-    array->lines[array->count - 1].length++;
-  } else {
-    if (array->capacity < array->count + 1) {
-      int oldCapacity = array->capacity;
-      array->capacity = GROW_CAPACITY(oldCapacity);
-      array->lines
-          = GROW_ARRAY(Line, array->lines, oldCapacity, array->capacity);
+#pragma region "encoding"
+
+static uint32_t zigzag(int delta) {
+  return ((uint32_t)delta << 1) ^ (uint32_t)(delta >> 31);
+}
+
+static int unzigzag(uint32_t value) {
+  return (int)((value >> 1) ^ -(value & 1));
+}
+
+static void writeVarint(LineArray* array, uint32_t value) {
+  while (value >= 0x80) {
+    array->runs[array->runBytes++] = (uint8_t)(value | 0x80);
+    value >>= 7;
+  }
+  array->runs[array->runBytes++] = (uint8_t)value;
+}
+
+static uint32_t readVarint(const uint8_t** cursor) {
+  uint32_t value = 0;
+  for (int shift = 0;; shift += 7) {
+    uint8_t byte = *(*cursor)++;
+    value |= (uint32_t)(byte & 0x7F) << shift;
+    if (byte < 0x80) {
+      return value;
     }
-    array->lines[array->count].line = line;
-    array->lines[array->count].length = 1;
-    array->count++;
   }
 }
 
-int getLine(LineArray* array, int offset) {
-  int offseti = 0;
-  for (int i = 0; i < array->count; i++) {
-    offseti += array->lines[i].length;
-    if (offseti > offset) {
-      return array->lines[i].line;
+// two varints of at most five bytes each
+#define MAX_RUN_BYTES 10
+
+static void finishRun(LineArray* array) {
+  if (array->runCount % LINE_CHECKPOINT_INTERVAL == 0) {
+    if (array->checkpointCapacity < array->checkpointCount + 1) {
+      int oldCapacity = array->checkpointCapacity;
+      array->checkpointCapacity = GROW_CAPACITY(oldCapacity);
+      array->checkpoints = GROW_ARRAY(
+          LineCheckpoint,
+          array->checkpoints,
+          oldCapacity,
+          array->checkpointCapacity);
+    }
+    array->checkpoints[array->checkpointCount++] = (LineCheckpoint){
+        .offset = array->start,
+        .line = array->lastLine,
+        .position = array->runBytes,
+    };
+  }
+
+  if (array->runCapacity < array->runBytes + MAX_RUN_BYTES) {
+    int oldCapacity = array->runCapacity;
+    array->runCapacity = GROW_CAPACITY(oldCapacity);
+    array->runs
+        = GROW_ARRAY(uint8_t, array->runs, oldCapacity, array->runCapacity);
+  }
+  writeVarint(array, (uint32_t)array->length);
+  writeVarint(array, zigzag(array->line - array->lastLine));
+  array->lastLine = array->line;
+  array->runCount++;
+}
+
+#pragma endregion
+
+void addLineArray(LineArray* array, int line, int length) {
+  if (array->length > 0) {
+    if (array->line == line) {
+      array->length += length;
+      return;
+    }
+    finishRun(array);
+    array->start += array->length;
+  }
+  array->line = line;
+  array->length = length;
+}
+
+// Index of the last checkpoint at or before `offset`, which must be covered
+// by a finished run.
+static int findCheckpoint(const LineArray* array, int offset) {
+  int low = 0;
+  int high = array->checkpointCount - 1;
+  while (low < high) {
+    int mid = low + (high - low + 1) / 2;
+    if (array->checkpoints[mid].offset <= offset) {
+      low = mid;
+    } else {
+      high = mid - 1;
+    }
+  }
+  return low;
+}
+
+void truncateLineArray(LineArray* array, int removed) {
+  if (removed < array->length) {
+    array->length -= removed;
+    return;
+  }
+  int count = array->start + array->length - removed;
+  if (count <= 0) {
+    array->runBytes = 0;
+    array->runCount = 0;
+    array->checkpointCount = 0;
+    array->lastLine = 0;
+    array->line = 0;
+    array->start = 0;
+    array->length = 0;
+    return;
+  }
+
+  // reopen the finished run that now holds the last byte
+  int checkpoint = findCheckpoint(array, count - 1);
+  int run = checkpoint * LINE_CHECKPOINT_INTERVAL;
+  int start = array->checkpoints[checkpoint].offset;
+  int line = array->checkpoints[checkpoint].line;
+  const uint8_t* cursor = array->runs + array->checkpoints[checkpoint].position;
+  for (;;) {
+    const uint8_t* encoded = cursor;
+    int length = (int)readVarint(&cursor);
+    int runLine = line + unzigzag(readVarint(&cursor));
+    if (count <= start + length) {
+      array->runBytes = (int)(encoded - array->runs);
+      array->runCount = run;
+      array->checkpointCount
+          = (run + LINE_CHECKPOINT_INTERVAL - 1) / LINE_CHECKPOINT_INTERVAL;
+      array->lastLine = line;
+      array->line = runLine;
+      array->start = start;
+      array->length = count - start;
+      return;
+    }
+    start += length;
+    line = runLine;
+    run++;
+  }
+}
+
+int getLine(const LineArray* array, int offset) {
+  if (offset < 0) {
+    return 0;
+  }
+  if (offset >= array->start) {
+    return offset < array->start + array->length ? array->line : 0;
+  }
+
+  const LineCheckpoint* checkpoint
+      = &array->checkpoints[findCheckpoint(array, offset)];
+  int start = checkpoint->offset;
+  int line = checkpoint->line;
+  const uint8_t* cursor = array->runs + checkpoint->position;
+  for (;;) {
+    int length = (int)readVarint(&cursor);
+    line += unzigzag(readVarint(&cursor));
+    if (offset < start + length) {
+      return line;
+    }
+    start += length;
+  }
+}
+
+void initLineCursor(LineCursor* cursor, const LineArray* array) {
+  cursor->array = array;
+  cursor->run = 0;
+  cursor->position = 0;
+  cursor->line = 0;
+  cursor->start = 0;
+  cursor->length = 0;
+}
+
+bool nextLineRun(LineCursor* cursor) {
+  const LineArray* array = cursor->array;
+  cursor->start += cursor->length;
+  if (cursor->run < array->runCount) {
+    const uint8_t* encoded = array->runs + cursor->position;
+    cursor->length = (int)readVarint(&encoded);
+    cursor->line += unzigzag(readVarint(&encoded));
+    cursor->position = (int)(encoded - array->runs);
+  } else if (cursor->run == array->runCount && array->length > 0) {
+    cursor->line = array->line;
+    cursor->length = array->length;
+  } else {
+    cursor->length = 0;
+    return false;
+  }
+  cursor->run++;
+  return true;
+}
+
+int lineAt(LineCursor* cursor, int offset) {
+  while (offset >= cursor->start + cursor->length) {
+    if (!nextLineRun(cursor)) {
+      return 0;
     }
   }
-  return 0;
+  return cursor->line;
 }
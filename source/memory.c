@@ -1,41 +1,207 @@
 #include <stdlib.h>
 
+#include <clox/compiler.h>
 #include <clox/memory.h>
 #include <clox/object.h>
+#include <clox/pool.h>
+#include <clox/table.h>
 #include <clox/value.h>
 #include <clox/vm.h>
 
-extern Vm g_VM;
+#ifdef DEBUG_LOG_GC
+#  include <stdio.h>
+
+#  include <clox/debug.h>
+#endif
+
+extern _Thread_local Vm* g_CURRENT_VM;
 
 static void freeObject(Obj* object);
 void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
-  if (newSize == 0) {
-    free(pointer);
-    return NULL;
+  Vm* vm = g_CURRENT_VM;
+  vm->bytesAllocated += newSize - oldSize;
+  if (newSize > oldSize) {
+#ifdef DEBUG_STRESS_GC
+    collectGarbage(vm);
+#endif
+    if (vm->bytesAllocated > vm->nextGC) {
+      collectGarbage(vm);
+    }
+  }
+
+  return poolReallocate(pointer, oldSize, newSize);
+}
+
+#pragma region "mark"
+
+#ifdef DEBUG_LOG_GC
+// Printing a rope would flatten it, allocating in the middle of a collection,
+// so ropes are logged by length alone.
+static void logObject(Vm* vm, const char* action, Obj* object) {
+  printf("%p %s ", (void*)object, action);
+  if (object->type == OBJ_ROPE) {
+    printf("<rope len %d>", ((ObjRope*)object)->length);
+  } else {
+    printValue(vm, OBJ_VAL(object));
+  }
+  fputs("\n", stdout);
+}
+#endif
+
+void markObject(Vm* vm, Obj* object) {
+  if (object == NULL || object->isMarked) {
+    return;
+  }
+
+#ifdef DEBUG_LOG_GC
+  logObject(vm, "mark", object);
+#endif
+
+  object->isMarked = true;
+
+  if (vm->grayCapacity < vm->grayCount + 1) {
+    vm->grayCapacity = GROW_CAPACITY(vm->grayCapacity);
+    // not reallocate(): growing the gray stack must not start a collection
+    Obj** grayStack
+        = realloc(vm->grayStack, sizeof(Obj*) * vm->grayCapacity);
+    if (grayStack == NULL) {
+      exit(1);
+    }
+    vm->grayStack = grayStack;
+  }
+  vm->grayStack[vm->grayCount++] = object;
+}
+
+void markValue(Vm* vm, Value value) {
+  if (IS_OBJ(value)) {
+    markObject(vm, AS_OBJ(value));
+  }
+}
+
+static void markArray(Vm* vm, ValueArray* array) {
+  for (int i = 0; i < array->count; ++i) {
+    markValue(vm, array->values[i]);
+  }
+}
+
+static void markRoots(Vm* vm) {
+  for (Value* slot = vm->stack.values; slot < vm->stackTop; ++slot) {
+    markValue(vm, *slot);
+  }
+
+  markTable(vm, &vm->globalSlots);
+  markArray(vm, &vm->globalValues);
+  if (vm->chunk) {
+    markArray(vm, &vm->chunk->constants);
   }
+  markCompilerRoots(vm);
+}
+
+static void blackenObject(Vm* vm, Obj* object) {
+#ifdef DEBUG_LOG_GC
+  logObject(vm, "blacken", object);
+#endif
 
-  void* result = realloc(pointer, newSize);
-  if (result == NULL) {
-    exit(1);
+  switch (object->type) {
+    case OBJ_STRING:
+      // strings hold no references
+      break;
+    case OBJ_ROPE:
+      {
+        ObjRope* rope = (ObjRope*)object;
+        markObject(vm, rope->left);
+        markObject(vm, rope->right);
+        markObject(vm, (Obj*)rope->flattened);
+        break;
+      }
   }
-  return result;
 }
-void freeObjects(void) {
-  Obj* object = g_VM.objects;
+
+static void traceReferences(Vm* vm) {
+  while (vm->grayCount > 0) {
+    Obj* object = vm->grayStack[--vm->grayCount];
+    blackenObject(vm, object);
+  }
+}
+
+#pragma endregion
+
+#pragma region "sweep"
+
+static void sweep(Vm* vm) {
+  Obj* previous = NULL;
+  Obj* object = vm->objects;
   while (object) {
-    Obj* next = object->next;
-    freeObject(object);
-    object = next;
+    if (object->isMarked) {
+      object->isMarked = false;
+      previous = object;
+      object = object->next;
+      continue;
+    }
+
+    Obj* unreached = object;
+    object = object->next;
+    if (previous) {
+      previous->next = object;
+    } else {
+      vm->objects = object;
+    }
+    freeObject(unreached);
   }
 }
+
+#pragma endregion
+
+void collectGarbage(Vm* vm) {
+#ifdef DEBUG_LOG_GC
+  puts("-- gc begin");
+  size_t before = vm->bytesAllocated;
+#endif
+
+  markRoots(vm);
+  traceReferences(vm);
+  // the intern table is weak: drop strings nothing else refers to
+  tableRemoveWhite(&vm->strings);
+  sweep(vm);
+
+  vm->nextGC = vm->bytesAllocated * GC_HEAP_GROW_FACTOR;
+
+#ifdef DEBUG_LOG_GC
+  puts("-- gc end");
+  printf(
+      "   collected %zu bytes (from %zu to %zu) next at %zu\n",
+      before - vm->bytesAllocated,
+      before,
+      vm->bytesAllocated,
+      vm->nextGC);
+#endif
+}
+
+void freeObjects(Vm* vm) {
+  // Every object lives in pool memory, which freeVm() hands back slab by
+  // slab, so there is no need to visit them one at a time.
+  vm->objects = NULL;
+
+  free(vm->grayStack);
+  vm->grayStack = NULL;
+  vm->grayCount = 0;
+  vm->grayCapacity = 0;
+}
+
 static void freeObject(Obj* object) {
+#ifdef DEBUG_LOG_GC
+  printf("%p free type %d\n", (void*)object, object->type);
+#endif
+
   switch (object->type) {
     case OBJ_STRING:
       {
         ObjString* string = (ObjString*)object;
-        FREE_ARRAY(char, string->chars, string->length + 1);
-        FREE(ObjString, object);
+        reallocate(object, STRING_SIZE(string->length), 0);
         break;
       }
+    case OBJ_ROPE:
+      FREE(ObjRope, object);
+      break;
   }
 }
@@ -3,6 +3,7 @@
 //
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include <clox/memory.h>
@@ -11,67 +12,225 @@
 #include <clox/value.h>
 #include <clox/vm.h>
 
-#define ALLOCATE_OBJ(type, objectType) \
-  (type*)allocateObject(sizeof(type), objectType)
+#define ALLOCATE_OBJ(vm, type, objectType) \
+  (type*)allocateObject(vm, sizeof(type), objectType)
 
-extern Vm g_VM;
-
-static Obj* allocateObject(size_t size, ObjType type) {
+static Obj* allocateObject(Vm* vm, size_t size, ObjType type) {
   Obj* object = (Obj*)reallocate(NULL, 0, size);
   object->type = type;
-  object->next = g_VM.objects;
-  g_VM.objects = object;
+  object->isMarked = false;
+  object->next = vm->objects;
+  vm->objects = object;
+
+#ifdef DEBUG_LOG_GC
+  printf("%p allocate %zu for %d\n", (void*)object, size, type);
+#endif
+
   return object;
 }
 
-static ObjString* allocateString(
-    int length,
-    char chars[length],
-    uint32_t hash) {
-  ObjString* string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
+ObjString* makeString(Vm* vm, int length) {
+  ObjString* string = (ObjString*)allocateObject(
+      vm,
+      STRING_SIZE(length),
+      OBJ_STRING);
   string->length = length;
-  string->chars = chars;
+  string->hash = 0;
+  string->chars[length] = '\0';
+  return string;
+}
+
+static ObjString* internString(Vm* vm, ObjString* string, uint32_t hash) {
   string->hash = hash;
-  tableSet(&g_VM.strings, string, NIL_VAL);
+  // growing the intern table may collect; keep the new string reachable
+  push(vm, OBJ_VAL(string));
+  tableSet(&vm->strings, string, NIL_VAL);
+  pop(vm);
   return string;
 }
 
-static uint32_t hashString(int length, const char key[length]) {
-  uint32_t hash = 2166136261U;
-  for (int i = 0; i < length; ++i) {
-    hash ^= (uint8_t)key[i];
-    hash *= 16777619;
-  }
+static uint64_t mixHash(uint64_t hash) {
+  // murmur3's finalizer: every input bit affects every output bit, which
+  // matters because tables take their slot and tag from the low bits
+  hash ^= hash >> 33;
+  hash *= UINT64_C(0xff51afd7ed558ccd);
+  hash ^= hash >> 33;
+  hash *= UINT64_C(0xc4ceb9fe1a85ec53);
+  hash ^= hash >> 33;
   return hash;
 }
 
-ObjString* copyString(int length, const char chars[length]) {
-  uint32_t hash = hashString(length, chars);
-  ObjString* interned = tableFindString(&g_VM.strings, length, chars, hash);
+uint64_t hashBytes(size_t length, const char key[length]) {
+  // Consume eight bytes per step instead of one; memcpy keeps the unaligned
+  // loads well defined and compiles to a single mov.
+  uint64_t hash = UINT64_C(0x9e3779b97f4a7c15) ^ (uint64_t)length;
+  size_t i = 0;
+  for (; i + 8 <= length; i += 8) {
+    uint64_t word;
+    memcpy(&word, key + i, sizeof(word));
+    hash = (hash ^ word) * UINT64_C(0x100000001b3);
+    hash ^= hash >> 29;
+  }
+
+  uint64_t tail = 0;
+  memcpy(&tail, key + i, length - i);
+  return mixHash(hash ^ tail);
+}
+
+uint32_t hashString(int length, const char key[length]) {
+  uint64_t hash = hashBytes((size_t)length, key);
+  return (uint32_t)(hash ^ (hash >> 32));
+}
+
+ObjString* copyString(Vm* vm, int length, const char chars[length]) {
+  return copyHashedString(vm, length, chars, hashString(length, chars));
+}
+
+ObjString* copyHashedString(
+    Vm* vm,
+    int length,
+    const char chars[length],
+    uint32_t hash) {
+  ObjString* interned = tableFindString(&vm->strings, length, chars, hash);
   if (interned) {
     // no copy necessary :)
     return interned;
   }
-  char* heapChars = ALLOCATE(char, length + 1);
-  memcpy(heapChars, chars, length);
-  heapChars[length] = '\0';
-  return allocateString(length, heapChars, hash);
+  ObjString* string = makeString(vm, length);
+  memcpy(string->chars, chars, length);
+  return internString(vm, string, hash);
 }
 
-void printObject(Value value) {
+void printObject(Vm* vm, Value value) {
   switch (OBJ_TYPE(value)) {
     case OBJ_STRING:
-      printf("%s", AS_CSTRING(value));
-      break;
+      {
+        ObjString* string = AS_STRING(value);
+        fwrite(string->chars, sizeof(char), string->length, stdout);
+        break;
+      }
+    case OBJ_ROPE:
+      {
+        ObjString* string = flattenRope(vm, AS_ROPE(value));
+        fwrite(string->chars, sizeof(char), string->length, stdout);
+        break;
+      }
   }
 }
 
-ObjString* takeString(int length, char chars[length]) {
-  uint32_t hash = hashString(length, chars);
-  ObjString* interned = tableFindString(&g_VM.strings, length, chars, hash);
-  if (interned) {
-    FREE_ARRAY(char, chars, length + 1);
-    return interned;
+ObjString* takeString(Vm* vm, ObjString* string) {
+  uint32_t hash = hashString(string->length, string->chars);
+  ObjString* interned = tableFindString(
+      &vm->strings,
+      string->length,
+      string->chars,
+      hash);
+  if (!interned) {
+    return internString(vm, string, hash);
+  }
+
+  // Nothing can have allocated since makeString(), so the duplicate is still
+  // the newest object and can be returned to the allocator right away.
+  if (vm->objects == &string->obj) {
+    vm->objects = string->obj.next;
+    reallocate(string, STRING_SIZE(string->length), 0);
   }
-  return allocateString(length, chars, hash);
+  return interned;
+}
+
+ObjRope* makeRope(Vm* vm, Obj* left, Obj* right, int length) {
+  ObjRope* rope = ALLOCATE_OBJ(vm, ObjRope, OBJ_ROPE);
+  rope->length = length;
+  rope->left = left;
+  rope->right = right;
+  rope->flattened = NULL;
+  return rope;
+}
+
+int textLength(Obj* text) {
+  return text->type == OBJ_STRING ? ((ObjString*)text)->length
+                                  : ((ObjRope*)text)->length;
+}
+
+// Returns the characters of `text` if they already exist somewhere.
+static ObjString* flatText(Obj* text) {
+  return text->type == OBJ_STRING ? (ObjString*)text
+                                  : ((ObjRope*)text)->flattened;
+}
+
+typedef struct rope_span_s {
+  Obj* text;
+  int start;
+} RopeSpan;
+
+ObjString* flattenRope(Vm* vm, ObjRope* rope) {
+  if (rope->flattened) {
+    return rope->flattened;
+  }
+
+  ObjString* result = makeString(vm, rope->length);
+
+  // Walk the tree iteratively; ropes built by repeated `s = s + x` are as
+  // deep as the loop was long. Flat children are copied straight to their
+  // offset, so only nodes with two unflattened children need to be
+  // remembered. The pending stack deliberately bypasses reallocate(): a
+  // collection here would see `result` unreachable.
+  RopeSpan* pending = NULL;
+  int pendingCount = 0;
+  int pendingCapacity = 0;
+
+  Obj* text = &rope->obj;
+  int start = 0;
+  for (;;) {
+    ObjString* flat = flatText(text);
+    if (!flat) {
+      ObjRope* node = (ObjRope*)text;
+      int rightStart = start + textLength(node->left);
+      ObjString* left = flatText(node->left);
+      ObjString* right = flatText(node->right);
+      if (left) {
+        memcpy(result->chars + start, left->chars, left->length);
+      }
+      if (right) {
+        memcpy(result->chars + rightStart, right->chars, right->length);
+      }
+
+      if (!left && !right) {
+        if (pendingCapacity < pendingCount + 1) {
+          pendingCapacity = GROW_CAPACITY(pendingCapacity);
+          pending = realloc(pending, sizeof(RopeSpan) * pendingCapacity);
+          if (pending == NULL) {
+            exit(1);
+          }
+        }
+        pending[pendingCount++]
+            = (RopeSpan){.text = node->right, .start = rightStart};
+      }
+      if (!left) {
+        text = node->left;
+        continue;
+      }
+      if (!right) {
+        text = node->right;
+        start = rightStart;
+        continue;
+      }
+    } else {
+      memcpy(result->chars + start, flat->chars, flat->length);
+    }
+
+    if (pendingCount == 0) {
+      break;
+    }
+    --pendingCount;
+    text = pending[pendingCount].text;
+    start = pending[pendingCount].start;
+  }
+  free(pending);
+
+  rope->flattened = takeString(vm, result);
+  // the children are no longer needed; let the collector have them
+  rope->left = NULL;
+  rope->right = NULL;
+  return rope->flattened;
 }
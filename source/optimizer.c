@@ -0,0 +1,486 @@
+#include <string.h>
+
+#include <clox/memory.h>
+#include <clox/object.h>
+#include <clox/optimizer.h>
+
+#pragma region "folding"
+
+static bool readLiteral(
+    const uint8_t* code,
+    ValueArray* constants,
+    Value* value) {
+  switch (code[0]) {
+    case OP_CONSTANT:
+      *value = constants->values[code[1]];
+      return true;
+    case OP_CONSTANT_LONG:
+      *value = constants->values
+                   [code[1] | (code[2] << 8) | ((uint32_t)code[3] << 16)];
+      return true;
+    case OP_NIL:
+      *value = NIL_VAL;
+      return true;
+    case OP_TRUE:
+      *value = BOOL_VAL(true);
+      return true;
+    case OP_FALSE:
+      *value = BOOL_VAL(false);
+      return true;
+    default:
+      return false;
+  }
+}
+
+bool instructionConstant(Chunk* chunk, int offset, Value* value) {
+  return readLiteral(&chunk->code[offset], &chunk->constants, value);
+}
+
+static bool isFalsey(Value value) {
+  return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+// Same answers as the VM's OP_EQUAL, for the kinds of value a literal can be.
+static bool literalsEqual(Value a, Value b) {
+  if (IS_NUMBER(a) && IS_NUMBER(b)) {
+    return AS_NUMBER(a) == AS_NUMBER(b);
+  }
+#ifdef NAN_BOXING
+  return a == b;
+#else
+  if (a.type != b.type) {
+    return false;
+  }
+  switch (a.type) {
+    case VAL_BOOL:
+      return AS_BOOL(a) == AS_BOOL(b);
+    case VAL_NIL:
+      return true;
+    case VAL_OBJ:
+      // literal strings are interned
+      return AS_OBJ(a) == AS_OBJ(b);
+    default:
+      return false;
+  }
+#endif
+}
+
+bool foldUnary(OpCode op, Value operand, Value* result) {
+  switch (op) {
+    case OP_NOT:
+      *result = BOOL_VAL(isFalsey(operand));
+      return true;
+    case OP_NEGATE:
+      if (!IS_NUMBER(operand)) {
+        return false;
+      }
+      *result = NUMBER_VAL(-AS_NUMBER(operand));
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Every step of a long chain like `s = s + "..."` would be interned, which
+// makes folding it quadratic; past this length the VM's ropes do better.
+#define MAX_FOLDED_STRING 1024
+
+static Value concatenateLiterals(Vm* vm, ObjString* a, ObjString* b) {
+  ObjString* result = makeString(vm, a->length + b->length);
+  memcpy(result->chars, a->chars, a->length);
+  memcpy(result->chars + a->length, b->chars, b->length);
+  return OBJ_VAL(takeString(vm, result));
+}
+
+bool foldBinary(Vm* vm, OpCode op, Value a, Value b, Value* result) {
+  switch (op) {
+    case OP_EQUAL:
+      *result = BOOL_VAL(literalsEqual(a, b));
+      return true;
+    case OP_NOT_EQUAL:
+      *result = BOOL_VAL(!literalsEqual(a, b));
+      return true;
+    case OP_ADD:
+      if (IS_STRING(a) && IS_STRING(b)) {
+        if (AS_STRING(a)->length + AS_STRING(b)->length > MAX_FOLDED_STRING) {
+          return false;
+        }
+        *result = concatenateLiterals(vm, AS_STRING(a), AS_STRING(b));
+        return true;
+      }
+      break;
+    default:
+      break;
+  }
+
+  if (!IS_NUMBER(a) || !IS_NUMBER(b)) {
+    return false;
+  }
+  double x = AS_NUMBER(a);
+  double y = AS_NUMBER(b);
+  switch (op) {
+    case OP_GREATER:
+      *result = BOOL_VAL(x > y);
+      return true;
+    case OP_LESS:
+      *result = BOOL_VAL(x < y);
+      return true;
+    // spelled the way the VM computes them, which matters for NaN
+    case OP_GREATER_EQUAL:
+      *result = BOOL_VAL(!(x < y));
+      return true;
+    case OP_LESS_EQUAL:
+      *result = BOOL_VAL(!(x > y));
+      return true;
+    case OP_ADD:
+      *result = NUMBER_VAL(x + y);
+      return true;
+    case OP_SUBTRACT:
+      *result = NUMBER_VAL(x - y);
+      return true;
+    case OP_MULTIPLY:
+      *result = NUMBER_VAL(x * y);
+      return true;
+    case OP_DIVIDE:
+      *result = NUMBER_VAL(x / y);
+      return true;
+    default:
+      return false;
+  }
+}
+
+#pragma endregion
+
+#pragma region "peephole"
+
+typedef struct kept_s {
+  int offset;
+  int line;
+} Kept;
+
+// The pass streams instructions into `out` and, after each one, rewrites
+// the tail for as long as a pattern matches, so one simplification can
+// expose the next.
+typedef struct peephole_s {
+  Vm* vm;
+  // owns the constant pool; only its code and lines get replaced
+  Chunk* chunk;
+  Chunk out;
+  Kept* kept;
+  int count;
+  int capacity;
+} Peephole;
+
+static uint8_t* tail(Peephole* pass, int distance) {
+  if (distance >= pass->count) {
+    return NULL;
+  }
+  return &pass->out.code[pass->kept[pass->count - 1 - distance].offset];
+}
+
+static int tailLine(Peephole* pass, int distance) {
+  return pass->kept[pass->count - 1 - distance].line;
+}
+
+static void append(Peephole* pass, const uint8_t* code, int length, int line) {
+  if (pass->capacity < pass->count + 1) {
+    int oldCapacity = pass->capacity;
+    pass->capacity = GROW_CAPACITY(oldCapacity);
+    pass->kept = GROW_ARRAY(Kept, pass->kept, oldCapacity, pass->capacity);
+  }
+  pass->kept[pass->count++] = (Kept){.offset = pass->out.count, .line = line};
+  writeChunkCode(&pass->out, code, length, line);
+}
+
+static void appendValue(Peephole* pass, Value value, int line) {
+  if (IS_NIL(value)) {
+    append(pass, (uint8_t[]){OP_NIL}, 1, line);
+  } else if (IS_BOOL(value)) {
+    append(pass, (uint8_t[]){AS_BOOL(value) ? OP_TRUE : OP_FALSE}, 1, line);
+  } else {
+    int constant = addConstant(pass->vm, pass->chunk, value);
+    if (constant <= UINT8_MAX) {
+      append(pass, (uint8_t[]){OP_CONSTANT, constant}, 2, line);
+    } else {
+      uint8_t code[] = {
+          OP_CONSTANT_LONG,
+          constant & 0xFF,
+          (constant >> 8) & 0xFF,
+          (constant >> 16) & 0xFF,
+      };
+      append(pass, code, sizeof(code), line);
+    }
+  }
+}
+
+static void dropTail(Peephole* pass, int count) {
+  pass->count -= count;
+  truncateChunk(&pass->out, pass->kept[pass->count].offset);
+}
+
+static bool tailLiteral(Peephole* pass, int distance, Value* value) {
+  uint8_t* code = tail(pass, distance);
+  return code && readLiteral(code, &pass->chunk->constants, value);
+}
+
+static bool isComparison(uint8_t op) {
+  switch (op) {
+    case OP_EQUAL:
+    case OP_NOT_EQUAL:
+    case OP_GREATER:
+    case OP_GREATER_EQUAL:
+    case OP_LESS:
+    case OP_LESS_EQUAL:
+      return true;
+    default:
+      return false;
+  }
+}
+
+static OpCode negateComparison(uint8_t op) {
+  switch (op) {
+    case OP_EQUAL:
+      return OP_NOT_EQUAL;
+    case OP_NOT_EQUAL:
+      return OP_EQUAL;
+    case OP_GREATER:
+      return OP_LESS_EQUAL;
+    case OP_LESS_EQUAL:
+      return OP_GREATER;
+    case OP_LESS:
+      return OP_GREATER_EQUAL;
+    default:
+      return OP_LESS;
+  }
+}
+
+static bool simplifyPop(Peephole* pass, uint8_t* previous) {
+  switch (*previous) {
+    // pushes with no side effects: drop the push and the pop
+    case OP_CONSTANT:
+    case OP_CONSTANT_LONG:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_GET_LOCAL:
+    case OP_GET_LOCAL_LONG:
+      dropTail(pass, 2);
+      return true;
+    case OP_GET_LOCAL2:
+      {
+        uint8_t slot = previous[1];
+        int line = tailLine(pass, 1);
+        dropTail(pass, 2);
+        append(pass, (uint8_t[]){OP_GET_LOCAL, slot}, 2, line);
+        return true;
+      }
+    case OP_SET_GLOBAL_SLOT:
+      *previous = OP_SET_GLOBAL_SLOT_POP;
+      dropTail(pass, 1);
+      return true;
+    case OP_SET_LOCAL:
+      *previous = OP_SET_LOCAL_POP;
+      dropTail(pass, 1);
+      return true;
+    default:
+      return false;
+  }
+}
+
+static bool simplifyNot(Peephole* pass, uint8_t* previous) {
+  if (isComparison(*previous)) {
+    *previous = negateComparison(*previous);
+    dropTail(pass, 1);
+    return true;
+  }
+
+  // NOT NOT only converts to a bool, which a comparison or NOT already is
+  uint8_t* before = tail(pass, 2);
+  if (*previous == OP_NOT && before && *before == OP_NOT) {
+    dropTail(pass, 2);
+    return true;
+  }
+  return false;
+}
+
+static bool foldTail(Peephole* pass, uint8_t op) {
+  Value a;
+  Value b;
+  Value result;
+  int line = tailLine(pass, 0);
+  if (op == OP_NOT || op == OP_NEGATE) {
+    if (!tailLiteral(pass, 1, &a) || !foldUnary(op, a, &result)) {
+      return false;
+    }
+    dropTail(pass, 2);
+  } else {
+    if (!tailLiteral(pass, 2, &a) || !tailLiteral(pass, 1, &b)
+        || !foldBinary(pass->vm, op, a, b, &result)) {
+      return false;
+    }
+    dropTail(pass, 3);
+  }
+  appendValue(pass, result, line);
+  return true;
+}
+
+static bool simplify(Peephole* pass) {
+  uint8_t* last = tail(pass, 0);
+  uint8_t* previous = tail(pass, 1);
+  if (!previous) {
+    return false;
+  }
+
+  switch (*last) {
+    case OP_POP:
+      return simplifyPop(pass, previous);
+    case OP_NOT:
+      return foldTail(pass, *last) || simplifyNot(pass, previous);
+    case OP_NEGATE:
+    case OP_EQUAL:
+    case OP_NOT_EQUAL:
+    case OP_GREATER:
+    case OP_GREATER_EQUAL:
+    case OP_LESS:
+    case OP_LESS_EQUAL:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+      return foldTail(pass, *last);
+    case OP_ADD:
+      {
+        if (foldTail(pass, *last)) {
+          return true;
+        }
+        // GET_LOCAL slot, CONSTANT index, ADD -> ADD_LOCAL_CONST slot index
+        uint8_t* local = tail(pass, 2);
+        if (*previous != OP_CONSTANT || !local || *local != OP_GET_LOCAL) {
+          return false;
+        }
+        uint8_t code[] = {OP_ADD_LOCAL_CONST, local[1], previous[1]};
+        int line = tailLine(pass, 2);
+        dropTail(pass, 3);
+        append(pass, code, sizeof(code), line);
+        return true;
+      }
+    case OP_GET_LOCAL:
+      if (*previous == OP_GET_LOCAL) {
+        uint8_t slots[] = {OP_GET_LOCAL2, previous[1], last[1]};
+        int line = tailLine(pass, 1);
+        dropTail(pass, 2);
+        append(pass, slots, sizeof(slots), line);
+        return true;
+      }
+      return false;
+    default:
+      return false;
+  }
+}
+
+static int constantOperand(const uint8_t* code) {
+  switch (code[0]) {
+    case OP_CONSTANT:
+      return code[1];
+    case OP_CONSTANT_LONG:
+      return code[1] | (code[2] << 8) | (code[3] << 16);
+    case OP_ADD_LOCAL_CONST:
+      return code[2];
+    default:
+      return -1;
+  }
+}
+
+static void setConstantOperand(uint8_t* code, int constant) {
+  switch (code[0]) {
+    case OP_CONSTANT:
+      code[1] = constant;
+      break;
+    case OP_CONSTANT_LONG:
+      code[1] = constant & 0xFF;
+      code[2] = (constant >> 8) & 0xFF;
+      code[3] = (constant >> 16) & 0xFF;
+      break;
+    case OP_ADD_LOCAL_CONST:
+      code[2] = constant;
+      break;
+  }
+}
+
+// Folding leaves its operands behind in the pool. Renumbering the survivors
+// in order only ever lowers an index, so every operand still fits its
+// encoding and the code can be patched in place.
+static void dropUnusedConstants(Vm* vm, Chunk* chunk) {
+  int count = chunk->constants.count;
+  int* remap = GROW_ARRAY(int, NULL, 0, count);
+  for (int i = 0; i < count; ++i) {
+    remap[i] = -1;
+  }
+  int used = 0;
+  for (int offset = 0; offset < chunk->count;
+       offset += instructionLength(chunk->code[offset])) {
+    int constant = constantOperand(&chunk->code[offset]);
+    if (constant != -1 && remap[constant] == -1) {
+      remap[constant] = 0;
+      used++;
+    }
+  }
+
+  if (used < count) {
+    // Build the new pool on the side: everything in it is also in the old
+    // one, which the collector can still see through the chunk.
+    Chunk pool;
+    initChunk(&pool);
+    for (int i = 0; i < count; ++i) {
+      if (remap[i] != -1) {
+        remap[i] = addConstant(vm, &pool, chunk->constants.values[i]);
+      }
+    }
+    for (int offset = 0; offset < chunk->count;
+         offset += instructionLength(chunk->code[offset])) {
+      int constant = constantOperand(&chunk->code[offset]);
+      if (constant != -1) {
+        setConstantOperand(&chunk->code[offset], remap[constant]);
+      }
+    }
+
+    freeValueArray(&chunk->constants);
+    FREE_ARRAY(int, chunk->constantSlots, chunk->constantSlotCapacity);
+    chunk->constants = pool.constants;
+    chunk->constantSlots = pool.constantSlots;
+    chunk->constantSlotCapacity = pool.constantSlotCapacity;
+  }
+  FREE_ARRAY(int, remap, count);
+}
+
+void optimizeChunk(Vm* vm, Chunk* chunk) {
+  Peephole pass = {
+      .vm = vm,
+      .chunk = chunk,
+      .kept = NULL,
+      .count = 0,
+      .capacity = 0,
+  };
+  initChunk(&pass.out);
+
+  LineCursor lines;
+  initLineCursor(&lines, &chunk->lines);
+  for (int offset = 0; offset < chunk->count;) {
+    int length = instructionLength(chunk->code[offset]);
+    append(&pass, &chunk->code[offset], length, lineAt(&lines, offset));
+    while (simplify(&pass)) {
+    }
+    offset += length;
+  }
+
+  FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+  freeLineArray(&chunk->lines);
+  chunk->code = pass.out.code;
+  chunk->count = pass.out.count;
+  chunk->capacity = pass.out.capacity;
+  chunk->lines = pass.out.lines;
+  FREE_ARRAY(Kept, pass.kept, pass.capacity);
+
+  dropUnusedConstants(vm, chunk);
+}
+
+#pragma endregion
@@ -0,0 +1,191 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <clox/pool.h>
+
+#define SIZE_CLASS_COUNT (POOL_MAX_SIZE / POOL_GRANULARITY)
+#define SIZE_CLASS(size) (((size) + POOL_GRANULARITY - 1) / POOL_GRANULARITY - 1)
+#define CLASS_SIZE(sizeClass) (((sizeClass) + 1) * POOL_GRANULARITY)
+
+typedef struct free_block_s {
+  struct free_block_s* next;
+} FreeBlock;
+
+// Slabs and large blocks carry a header padded to max_align_t so the memory
+// after it is suitably aligned for anything.
+typedef union slab_u {
+  union slab_u* next;
+  max_align_t align;
+} Slab;
+
+typedef union large_block_u {
+  struct large_block_links_s {
+    union large_block_u* previous;
+    union large_block_u* next;
+  } links;
+  max_align_t align;
+} LargeBlock;
+
+typedef struct pool_s {
+  FreeBlock* freeLists[SIZE_CLASS_COUNT];
+  Slab* slabs;
+  char* bump;
+  char* bumpEnd;
+  LargeBlock* largeBlocks;
+  bool initialized;
+} Pool;
+
+// one pool per thread, so allocation never needs a lock
+static _Thread_local Pool g_POOL;
+
+static void* checkedAllocation(void* pointer) {
+  if (pointer == NULL) {
+    exit(1);
+  }
+  return pointer;
+}
+
+#pragma region "small blocks"
+
+static void* allocateSmall(size_t size) {
+  size_t sizeClass = SIZE_CLASS(size);
+  FreeBlock* block = g_POOL.freeLists[sizeClass];
+  if (block) {
+    g_POOL.freeLists[sizeClass] = block->next;
+    return block;
+  }
+
+  size_t blockSize = CLASS_SIZE(sizeClass);
+  if ((size_t)(g_POOL.bumpEnd - g_POOL.bump) < blockSize) {
+    // the tail of the old slab is abandoned; it's smaller than one block
+    Slab* slab = checkedAllocation(malloc(POOL_SLAB_SIZE));
+    slab->next = g_POOL.slabs;
+    g_POOL.slabs = slab;
+    g_POOL.bump = (char*)(slab + 1);
+    g_POOL.bumpEnd = (char*)slab + POOL_SLAB_SIZE;
+  }
+
+  void* result = g_POOL.bump;
+  g_POOL.bump += blockSize;
+  return result;
+}
+
+static void freeSmall(void* pointer, size_t size) {
+  size_t sizeClass = SIZE_CLASS(size);
+  FreeBlock* block = pointer;
+  block->next = g_POOL.freeLists[sizeClass];
+  g_POOL.freeLists[sizeClass] = block;
+}
+
+#pragma endregion
+
+#pragma region "large blocks"
+
+static void linkLarge(LargeBlock* block) {
+  block->links.previous = NULL;
+  block->links.next = g_POOL.largeBlocks;
+  if (g_POOL.largeBlocks) {
+    g_POOL.largeBlocks->links.previous = block;
+  }
+  g_POOL.largeBlocks = block;
+}
+
+static void unlinkLarge(LargeBlock* block) {
+  if (block->links.previous) {
+    block->links.previous->links.next = block->links.next;
+  } else {
+    g_POOL.largeBlocks = block->links.next;
+  }
+  if (block->links.next) {
+    block->links.next->links.previous = block->links.previous;
+  }
+}
+
+static void* allocateLarge(size_t size) {
+  LargeBlock* block
+      = checkedAllocation(malloc(sizeof(LargeBlock) + size));
+  linkLarge(block);
+  return block + 1;
+}
+
+static void* reallocateLarge(void* pointer, size_t newSize) {
+  LargeBlock* block = (LargeBlock*)pointer - 1;
+  unlinkLarge(block);
+  block = checkedAllocation(realloc(block, sizeof(LargeBlock) + newSize));
+  linkLarge(block);
+  return block + 1;
+}
+
+static void freeLarge(void* pointer) {
+  LargeBlock* block = (LargeBlock*)pointer - 1;
+  unlinkLarge(block);
+  free(block);
+}
+
+#pragma endregion
+
+static void* allocate(size_t size) {
+  return size <= POOL_MAX_SIZE ? allocateSmall(size) : allocateLarge(size);
+}
+
+static void release(void* pointer, size_t size) {
+  if (size <= POOL_MAX_SIZE) {
+    freeSmall(pointer, size);
+  } else {
+    freeLarge(pointer);
+  }
+}
+
+void initPool(void) {
+  // starting over would leak the slabs of the pool in use and leave its
+  // objects dangling, so this is checked in every build, not just by assert
+  if (g_POOL.initialized) {
+    fputs("initPool: this thread already has a pool\n", stderr);
+    abort();
+  }
+  memset(&g_POOL, 0, sizeof(g_POOL));
+  g_POOL.initialized = true;
+}
+
+void freePool(void) {
+  Slab* slab = g_POOL.slabs;
+  while (slab) {
+    Slab* next = slab->next;
+    free(slab);
+    slab = next;
+  }
+
+  LargeBlock* block = g_POOL.largeBlocks;
+  while (block) {
+    LargeBlock* next = block->links.next;
+    free(block);
+    block = next;
+  }
+
+  memset(&g_POOL, 0, sizeof(g_POOL));
+}
+
+void* poolReallocate(void* pointer, size_t oldSize, size_t newSize) {
+  if (pointer == NULL) {
+    return newSize == 0 ? NULL : allocate(newSize);
+  }
+
+  if (newSize == 0) {
+    release(pointer, oldSize);
+    return NULL;
+  }
+
+  if (oldSize > POOL_MAX_SIZE && newSize > POOL_MAX_SIZE) {
+    return reallocateLarge(pointer, newSize);
+  }
+  if (oldSize <= POOL_MAX_SIZE && newSize <= POOL_MAX_SIZE
+      && SIZE_CLASS(oldSize) == SIZE_CLASS(newSize)) {
+    return pointer;
+  }
+
+  void* result = allocate(newSize);
+  memcpy(result, pointer, oldSize < newSize ? oldSize : newSize);
+  release(pointer, oldSize);
+  return result;
+}
@@ -0,0 +1,338 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include <clox/line.h>
+#include <clox/profiler.h>
+
+// the profile SIGPROF samples, if any
+static Profile* volatile g_SAMPLED_PROFILE = NULL;
+
+#define PROFILE_TOP_PAIRS 20
+#define PROFILE_TOP_LINES 20
+
+#pragma region "collecting"
+
+static void* allocateZeroed(size_t count, size_t size) {
+  void* pointer = calloc(count, size);
+  if (pointer == NULL) {
+    exit(1);
+  }
+  return pointer;
+}
+
+static void freeInstructionData(Profile* profile) {
+  free(profile->executions);
+  free(profile->samples);
+  free(profile->code);
+  free(profile->lines);
+  profile->executions = NULL;
+  profile->samples = NULL;
+  profile->code = NULL;
+  profile->lines = NULL;
+  profile->codeSize = 0;
+}
+
+void initProfile(Profile* profile) {
+  memset(profile, 0, sizeof(*profile));
+  profile->current = -1;
+}
+
+void freeProfile(Profile* profile) {
+  freeInstructionData(profile);
+  initProfile(profile);
+}
+
+static void takeSample(int signal) {
+  (void)signal;
+  Profile* profile = g_SAMPLED_PROFILE;
+  if (profile && profile->current >= 0) {
+    profile->samples[profile->current]++;
+    profile->sampleCount++;
+  }
+}
+
+static void setSampleInterval(long microseconds) {
+  struct itimerval timer = {
+      .it_interval = {.tv_sec = 0, .tv_usec = microseconds},
+      .it_value = {.tv_sec = 0, .tv_usec = microseconds},
+  };
+  setitimer(ITIMER_PROF, &timer, NULL);
+}
+
+void startProfile(Profile* profile, const Chunk* chunk) {
+  assert(g_SAMPLED_PROFILE == NULL);
+  freeInstructionData(profile);
+  size_t size = chunk->count > 0 ? (size_t)chunk->count : 1;
+  profile->codeSize = chunk->count;
+  profile->executions = allocateZeroed(size, sizeof(uint64_t));
+  profile->samples = allocateZeroed(size, sizeof(uint64_t));
+  profile->current = -1;
+
+  g_SAMPLED_PROFILE = profile;
+  struct sigaction action = {
+      .sa_handler = takeSample,
+      .sa_flags = SA_RESTART,
+  };
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGPROF, &action, &profile->previousAction);
+  setSampleInterval(PROFILE_SAMPLE_INTERVAL);
+}
+
+void stopProfile(Profile* profile, const Chunk* chunk) {
+  setSampleInterval(0);
+  sigaction(SIGPROF, &profile->previousAction, NULL);
+  g_SAMPLED_PROFILE = NULL;
+  profile->current = -1;
+
+  size_t size = chunk->count > 0 ? (size_t)chunk->count : 1;
+  profile->code = allocateZeroed(size, sizeof(uint8_t));
+  profile->lines = allocateZeroed(size, sizeof(int));
+  memcpy(profile->code, chunk->code, (size_t)chunk->count);
+  LineCursor cursor;
+  initLineCursor(&cursor, &chunk->lines);
+  for (int offset = 0; offset < chunk->count; ++offset) {
+    profile->lines[offset] = lineAt(&cursor, offset);
+  }
+}
+
+void countInstruction(Profile* profile, uint8_t instruction, int offset) {
+  profile->opcodes[instruction]++;
+  if (profile->current >= 0) {
+    profile->pairs[profile->previous][instruction]++;
+  }
+  profile->executions[offset]++;
+  profile->instructionCount++;
+  profile->previous = instruction;
+  profile->current = offset;
+}
+
+#pragma endregion
+
+#pragma region "reporting"
+
+static double percentOf(uint64_t part, uint64_t whole) {
+  return whole == 0 ? 0.0 : 100.0 * (double)part / (double)whole;
+}
+
+typedef struct opcode_pair_s {
+  uint8_t first;
+  uint8_t second;
+  uint64_t count;
+} OpcodePair;
+
+static int compareOpcodePairs(const void* a, const void* b) {
+  const OpcodePair* left = a;
+  const OpcodePair* right = b;
+  return (left->count < right->count) - (left->count > right->count);
+}
+
+typedef struct line_profile_s {
+  int line;
+  uint64_t executions;
+  uint64_t samples;
+} LineProfile;
+
+// hottest first: by samples, then by instructions executed
+static int compareLineProfiles(const void* a, const void* b) {
+  const LineProfile* left = a;
+  const LineProfile* right = b;
+  if (left->samples != right->samples) {
+    return (left->samples < right->samples) - (left->samples > right->samples);
+  }
+  if (left->executions != right->executions) {
+    return (left->executions < right->executions)
+        - (left->executions > right->executions);
+  }
+  return left->line - right->line;
+}
+
+static void printOpcodes(const Profile* profile, FILE* out) {
+  fprintf(out, "\n  %-24s %10s %6s\n", "opcode", "count", "%");
+  uint8_t order[OP_CODE_COUNT];
+  int count = 0;
+  for (int op = 0; op < OP_CODE_COUNT; ++op) {
+    if (profile->opcodes[op] != 0) {
+      order[count++] = (uint8_t)op;
+    }
+  }
+  // few enough to insertion sort, most executed first
+  for (int i = 1; i < count; ++i) {
+    uint8_t op = order[i];
+    int j = i;
+    for (; j > 0 && profile->opcodes[order[j - 1]] < profile->opcodes[op];
+         --j) {
+      order[j] = order[j - 1];
+    }
+    order[j] = op;
+  }
+  for (int i = 0; i < count; ++i) {
+    fprintf(
+        out,
+        "  %-24s %10llu %6.2f\n",
+        g_OP_CODE_NAMES[order[i]],
+        (unsigned long long)profile->opcodes[order[i]],
+        percentOf(profile->opcodes[order[i]], profile->instructionCount));
+  }
+}
+
+static void printOpcodePairs(const Profile* profile, FILE* out) {
+  OpcodePair* pairs
+      = allocateZeroed(OP_CODE_COUNT * OP_CODE_COUNT, sizeof(OpcodePair));
+  int count = 0;
+  uint64_t total = 0;
+  for (int first = 0; first < OP_CODE_COUNT; ++first) {
+    for (int second = 0; second < OP_CODE_COUNT; ++second) {
+      uint64_t pairCount = profile->pairs[first][second];
+      if (pairCount != 0) {
+        pairs[count++] = (OpcodePair){
+            .first = (uint8_t)first,
+            .second = (uint8_t)second,
+            .count = pairCount,
+        };
+        total += pairCount;
+      }
+    }
+  }
+  qsort(pairs, (size_t)count, sizeof(OpcodePair), compareOpcodePairs);
+
+  fprintf(out, "\n  %-49s %10s %6s\n", "opcode pair", "count", "%");
+  for (int i = 0; i < count && i < PROFILE_TOP_PAIRS; ++i) {
+    fprintf(
+        out,
+        "  %-24s %-24s %10llu %6.2f\n",
+        g_OP_CODE_NAMES[pairs[i].first],
+        g_OP_CODE_NAMES[pairs[i].second],
+        (unsigned long long)pairs[i].count,
+        percentOf(pairs[i].count, total));
+  }
+  free(pairs);
+}
+
+static void printLines(const Profile* profile, FILE* out) {
+  int maxLine = 0;
+  for (int offset = 0; offset < profile->codeSize; ++offset) {
+    if (profile->lines[offset] > maxLine) {
+      maxLine = profile->lines[offset];
+    }
+  }
+  // line 0 collects instructions the line table doesn't cover
+  LineProfile* lines
+      = allocateZeroed((size_t)maxLine + 1, sizeof(LineProfile));
+  for (int offset = 0; offset < profile->codeSize; ++offset) {
+    LineProfile* line = &lines[profile->lines[offset]];
+    line->executions += profile->executions[offset];
+    line->samples += profile->samples[offset];
+  }
+  int count = 0;
+  for (int line = 0; line <= maxLine; ++line) {
+    if (lines[line].executions != 0 || lines[line].samples != 0) {
+      lines[count] = lines[line];
+      lines[count++].line = line;
+    }
+  }
+  qsort(lines, (size_t)count, sizeof(LineProfile), compareLineProfiles);
+
+  fprintf(
+      out,
+      "\n%6s %14s %7s %10s %7s %12s\n",
+      "line",
+      "instructions",
+      "%",
+      "samples",
+      "%",
+      "time (ms)");
+  for (int i = 0; i < count && i < PROFILE_TOP_LINES; ++i) {
+    if (lines[i].line == 0) {
+      fputs("     ?", out);
+    } else {
+      fprintf(out, "%6d", lines[i].line);
+    }
+    fprintf(
+        out,
+        " %14llu %7.2f %10llu %7.2f %12.1f\n",
+        (unsigned long long)lines[i].executions,
+        percentOf(lines[i].executions, profile->instructionCount),
+        (unsigned long long)lines[i].samples,
+        percentOf(lines[i].samples, profile->sampleCount),
+        (double)lines[i].samples * PROFILE_SAMPLE_INTERVAL / 1000.0);
+  }
+  free(lines);
+}
+
+void printProfile(const Profile* profile, FILE* out) {
+  fprintf(
+      out,
+      "== profile: %llu instructions, %llu samples %d us apart\n",
+      (unsigned long long)profile->instructionCount,
+      (unsigned long long)profile->sampleCount,
+      PROFILE_SAMPLE_INTERVAL);
+  printOpcodes(profile, out);
+  printOpcodePairs(profile, out);
+  if (profile->lines) {
+    printLines(profile, out);
+  }
+}
+
+typedef struct folded_stack_s {
+  int line;
+  uint8_t opcode;
+  uint64_t samples;
+} FoldedStack;
+
+static int compareFoldedStacks(const void* a, const void* b) {
+  const FoldedStack* left = a;
+  const FoldedStack* right = b;
+  if (left->line != right->line) {
+    return left->line - right->line;
+  }
+  return left->opcode - right->opcode;
+}
+
+bool writeFoldedStacks(
+    const Profile* profile,
+    const char* script,
+    const char* path) {
+  FILE* file = fopen(path, "w");
+  if (!file) {
+    return false;
+  }
+
+  // one stack per line and opcode, however many instructions share them
+  int count = 0;
+  FoldedStack* stacks = allocateZeroed(
+      profile->codeSize > 0 ? (size_t)profile->codeSize : 1,
+      sizeof(FoldedStack));
+  for (int offset = 0; profile->lines && offset < profile->codeSize;
+       ++offset) {
+    if (profile->samples[offset] != 0) {
+      stacks[count++] = (FoldedStack){
+          .line = profile->lines[offset],
+          .opcode = profile->code[offset],
+          .samples = profile->samples[offset],
+      };
+    }
+  }
+  qsort(stacks, (size_t)count, sizeof(FoldedStack), compareFoldedStacks);
+  for (int i = 0; i < count; ++i) {
+    uint64_t samples = stacks[i].samples;
+    while (i + 1 < count
+           && compareFoldedStacks(&stacks[i], &stacks[i + 1]) == 0) {
+      samples += stacks[++i].samples;
+    }
+    fprintf(
+        file,
+        "%s;line %d;%s %llu\n",
+        script,
+        stacks[i].line,
+        g_OP_CODE_NAMES[stacks[i].opcode],
+        (unsigned long long)samples);
+  }
+  free(stacks);
+
+  bool ok = !ferror(file);
+  return fclose(file) == 0 && ok;
+}
+
+#pragma endregion
@@ -2,12 +2,42 @@
 // Created by kyle on 8/15/21.
 //
 
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 
 #include <clox/common.h>
 #include <clox/scanner.h>
 
+#if defined(__AVX2__)
+#  include <immintrin.h>
+#  define BLOCK_WIDTH 32
+#  define BLOCK_MASK UINT32_C(0xFFFFFFFF)
+typedef __m256i Block;
+
+static inline Block loadBlock(const char* p) {
+  return _mm256_loadu_si256((const __m256i*)p);
+}
+
+static inline uint32_t matchByte(Block block, char c) {
+  return (uint32_t)_mm256_movemask_epi8(
+      _mm256_cmpeq_epi8(block, _mm256_set1_epi8(c)));
+}
+#elif defined(__SSE2__)
+#  include <emmintrin.h>
+#  define BLOCK_WIDTH 16
+#  define BLOCK_MASK UINT32_C(0xFFFF)
+typedef __m128i Block;
+
+static inline Block loadBlock(const char* p) {
+  return _mm_loadu_si128((const __m128i*)p);
+}
+
+static inline uint32_t matchByte(Block block, char c) {
+  return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(block, _mm_set1_epi8(c)));
+}
+#endif
+
 const char* g_TOKEN_NAMES[] = {
 #define STRINGIZE(x) #x
 #define X(x) STRINGIZE(TOKEN_##x),
@@ -16,84 +46,93 @@ const char* g_TOKEN_NAMES[] = {
 #undef STRINGIZE
 };
 
-typedef struct scanner_s {
-  const char* start;
-  const char* current;
-  int line;
-} Scanner;
-
-Scanner g_SCANNER;
-
-static bool isAtEnd() {
-  return *g_SCANNER.current == '\0';
+static bool isAtEnd(Scanner* scanner) {
+  return scanner->current == scanner->end;
 }
 
-static Token makeToken(TokenType type) {
+static Token makeToken(Scanner* scanner, TokenType type) {
   return (Token){
       .type = type,
-      .start = g_SCANNER.start,
-      .length = (int)(g_SCANNER.current - g_SCANNER.start),
-      .line = g_SCANNER.line,
+      .start = scanner->start,
+      .length = (int)(scanner->current - scanner->start),
+      .line = scanner->line,
   };
 }
 
-static Token errorToken(const char message[static 1]) {
+static Token errorToken(Scanner* scanner, const char message[static 1]) {
   return (Token){
       .type = TOKEN_ERROR,
       .start = message,
       .length = (int)strlen(message),
-      .line = g_SCANNER.line,
+      .line = scanner->line,
   };
 }
 
-static char advance() {
-  g_SCANNER.current++;
-  return g_SCANNER.current[-1];
+static char advance(Scanner* scanner) {
+  scanner->current++;
+  return scanner->current[-1];
 }
 
-static bool match(char expected) {
-  if (isAtEnd()) {
+static bool match(Scanner* scanner, char expected) {
+  if (isAtEnd(scanner)) {
     return false;
   }
-  if (*g_SCANNER.current != expected) {
+  if (*scanner->current != expected) {
     return false;
   }
-  g_SCANNER.current++;
+  scanner->current++;
   return true;
 }
 
-static char peek() {
-  return *g_SCANNER.current;
+static char peek(Scanner* scanner) {
+  if (isAtEnd(scanner)) {
+    return '\0';
+  }
+  return *scanner->current;
+}
+
+static char peekNext(Scanner* scanner) {
+  if (scanner->end - scanner->current < 2) {
+    return '\0';
+  }
+  return scanner->current[1];
 }
 
-static char peekNext() {
-  if (isAtEnd()) {
-    return 0;
+#ifdef BLOCK_WIDTH
+// Moves past the first `n` bytes of a block, counting the newlines among them.
+static void consumeBlock(Scanner* scanner, int n, uint32_t newlines) {
+  if (n < 32) {
+    newlines &= (UINT32_C(1) << n) - 1;
   }
-  return g_SCANNER.current[1];
+  scanner->line += __builtin_popcount(newlines);
+  scanner->current += n;
 }
+#endif
 
-static void skipWhitespace() {
+static void skipBlanks(Scanner* scanner) {
+#ifdef BLOCK_WIDTH
+  while (scanner->end - scanner->current >= BLOCK_WIDTH) {
+    Block block = loadBlock(scanner->current);
+    uint32_t newlines = matchByte(block, '\n');
+    uint32_t blanks = newlines | matchByte(block, ' ') | matchByte(block, '\t')
+        | matchByte(block, '\r');
+    uint32_t other = ~blanks & BLOCK_MASK;
+    if (other != 0) {
+      consumeBlock(scanner, __builtin_ctz(other), newlines);
+      return;
+    }
+    consumeBlock(scanner, BLOCK_WIDTH, newlines);
+  }
+#endif
   for (;;) {
-    char c = peek();
-    switch (c) {
+    switch (peek(scanner)) {
+      case '\n':
+        scanner->line++;
+        // fallthrough
       case ' ':
       case '\r':
       case '\t':
-        advance();
-        break;
-      case '\n':
-        g_SCANNER.line++;
-        advance();
-        break;
-      case '/':
-        if (peekNext() == '/') {
-          while (peek() != '\n' && !isAtEnd()) {
-            advance();
-          }
-        } else {
-          return;
-        }
+        advance(scanner);
         break;
       default:
         return;
@@ -101,20 +140,48 @@ static void skipWhitespace() {
   }
 }
 
-static Token string() {
-  while (peek() != '"' && !isAtEnd()) {
-    if (peek() == '\n') {
-      g_SCANNER.line++;
+// Stops on `terminator` (or the end of the source), counting the newlines
+// skipped along the way. Serves both comment bodies and string bodies.
+static void skipUntil(Scanner* scanner, char terminator) {
+#ifdef BLOCK_WIDTH
+  while (scanner->end - scanner->current >= BLOCK_WIDTH) {
+    Block block = loadBlock(scanner->current);
+    uint32_t newlines = matchByte(block, '\n');
+    uint32_t hits = matchByte(block, terminator);
+    if (hits != 0) {
+      consumeBlock(scanner, __builtin_ctz(hits), newlines);
+      return;
+    }
+    consumeBlock(scanner, BLOCK_WIDTH, newlines);
+  }
+#endif
+  while (peek(scanner) != terminator && !isAtEnd(scanner)) {
+    if (peek(scanner) == '\n') {
+      scanner->line++;
+    }
+    advance(scanner);
+  }
+}
+
+static void skipWhitespace(Scanner* scanner) {
+  for (;;) {
+    skipBlanks(scanner);
+    if (peek(scanner) != '/' || peekNext(scanner) != '/') {
+      return;
     }
-    advance();
+    skipUntil(scanner, '\n');
   }
+}
+
+static Token string(Scanner* scanner) {
+  skipUntil(scanner, '"');
 
-  if (isAtEnd()) {
-    return errorToken("Unterminated string.");
+  if (isAtEnd(scanner)) {
+    return errorToken(scanner, "Unterminated string.");
   }
 
-  advance();
-  return makeToken(TOKEN_STRING);
+  advance(scanner);
+  return makeToken(scanner, TOKEN_STRING);
 }
 
 static bool isDigit(char c) {
@@ -125,148 +192,146 @@ static bool isAlpha(char c) {
   return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
 }
 
-static Token number() {
-  while (isDigit(peek())) {
-    advance();
+static Token number(Scanner* scanner) {
+  while (isDigit(peek(scanner))) {
+    advance(scanner);
   }
 
   // fractional part
-  if (peek() == '.' && isDigit(peekNext())) {
+  if (peek(scanner) == '.' && isDigit(peekNext(scanner))) {
     // the '.'
-    advance();
-    while (isDigit(peek())) {
-      advance();
+    advance(scanner);
+    while (isDigit(peek(scanner))) {
+      advance(scanner);
     }
   }
 
-  return makeToken(TOKEN_NUMBER);
+  return makeToken(scanner, TOKEN_NUMBER);
 }
 
-static TokenType checkKeyword(
-    int start,
-    int length,
-    const char rest[length],
-    TokenType type) {
-  if (g_SCANNER.current - g_SCANNER.start == start + length
-      && memcmp(g_SCANNER.start + start, rest, length) == 0) {
-    return type;
-  }
-  return TOKEN_IDENTIFIER;
-}
+typedef struct keyword_s {
+  const char* name;
+  int length;
+  TokenType type;
+} Keyword;
 
-static TokenType identifierType() {
-  switch (g_SCANNER.start[0]) {
-    case 'a':
-      return checkKeyword(1, 2, "nd", TOKEN_AND);
-    case 'c':
-      return checkKeyword(1, 4, "lass", TOKEN_CLASS);
-    case 'e':
-      return checkKeyword(1, 3, "lse", TOKEN_ELSE);
-    case 'f':
-      if (g_SCANNER.current - g_SCANNER.start > 1) {
-        switch (g_SCANNER.start[1]) {
-          case 'a':
-            return checkKeyword(2, 3, "lse", TOKEN_FALSE);
-          case 'o':
-            return checkKeyword(2, 1, "r", TOKEN_FOR);
-          case 'u':
-            return checkKeyword(2, 1, "n", TOKEN_FUN);
-        }
-      }
-    case 'i':
-      return checkKeyword(1, 1, "f", TOKEN_IF);
-    case 'n':
-      return checkKeyword(1, 2, "il", TOKEN_NIL);
-    case 'o':
-      return checkKeyword(1, 1, "r", TOKEN_OR);
-    case 'p':
-      return checkKeyword(1, 4, "rint", TOKEN_PRINT);
-    case 'r':
-      return checkKeyword(1, 5, "eturn", TOKEN_RETURN);
-    case 's':
-      return checkKeyword(1, 4, "uper", TOKEN_SUPER);
-    case 't':
-      if (g_SCANNER.current - g_SCANNER.start > 1) {
-        switch (g_SCANNER.start[1]) {
-          case 'h':
-            return checkKeyword(2, 2, "is", TOKEN_THIS);
-          case 'r':
-            return checkKeyword(2, 2, "ue", TOKEN_TRUE);
-        }
-      }
-    case 'v':
-      return checkKeyword(1, 2, "ar", TOKEN_VAR);
-    case 'w':
-      return checkKeyword(1, 4, "hile", TOKEN_WHILE);
+// Perfect hash over the keywords: (first + 5 * last + length) is distinct
+// modulo 32 for every one of them, so a lookup is one probe and one memcmp.
+#define KEYWORD_HASH(first, last, length) \
+  (((unsigned)(uint8_t)(first) + 5U * (uint8_t)(last) + (unsigned)(length)) \
+   & 31U)
+
+// Indexed by KEYWORD_HASH.
+static const Keyword g_KEYWORDS[32] = {
+    [2] = {"else", 4, TOKEN_ELSE},
+    [3] = {"for", 3, TOKEN_FOR},
+    [4] = {"false", 5, TOKEN_FALSE},
+    [7] = {"class", 5, TOKEN_CLASS},
+    [9] = {"if", 2, TOKEN_IF},
+    [11] = {"or", 2, TOKEN_OR},
+    [13] = {"nil", 3, TOKEN_NIL},
+    [15] = {"fun", 3, TOKEN_FUN},
+    [17] = {"true", 4, TOKEN_TRUE},
+    [18] = {"super", 5, TOKEN_SUPER},
+    [19] = {"var", 3, TOKEN_VAR},
+    [21] = {"while", 5, TOKEN_WHILE},
+    [23] = {"this", 4, TOKEN_THIS},
+    [24] = {"and", 3, TOKEN_AND},
+    [25] = {"print", 5, TOKEN_PRINT},
+    [30] = {"return", 6, TOKEN_RETURN},
+};
+
+static TokenType identifierType(Scanner* scanner) {
+  int length = (int)(scanner->current - scanner->start);
+  if (length < 2 || length > 6) {
+    return TOKEN_IDENTIFIER;
+  }
+  const Keyword* keyword = &g_KEYWORDS[KEYWORD_HASH(
+      scanner->start[0], scanner->start[length - 1], length)];
+  if (keyword->length == length
+      && memcmp(scanner->start, keyword->name, length) == 0) {
+    return keyword->type;
   }
   return TOKEN_IDENTIFIER;
 }
 
-static Token identifier() {
-  while (isAlpha(peek()) || isDigit(peek())) {
-    advance();
+static Token identifier(Scanner* scanner) {
+  while (isAlpha(peek(scanner)) || isDigit(peek(scanner))) {
+    advance(scanner);
   }
-  return makeToken(identifierType());
+  return makeToken(scanner, identifierType(scanner));
 }
 
-void initScanner(const char source[static 1]) {
-  g_SCANNER.start = source;
-  g_SCANNER.current = source;
-  g_SCANNER.line = 1;
+void initScanner(
+    Scanner* scanner,
+    size_t length,
+    const char source[length]) {
+  scanner->start = source;
+  scanner->current = source;
+  scanner->end = source + length;
+  scanner->line = 1;
 }
 
-Token scanToken(void) {
-  skipWhitespace();
-  g_SCANNER.start = g_SCANNER.current;
+Token scanToken(Scanner* scanner) {
+  skipWhitespace(scanner);
+  scanner->start = scanner->current;
 
-  if (isAtEnd()) {
-    return makeToken(TOKEN_EOF);
+  if (isAtEnd(scanner)) {
+    return makeToken(scanner, TOKEN_EOF);
   }
 
-  char c = advance();
+  char c = advance(scanner);
   if (isAlpha(c)) {
-    return identifier();
+    return identifier(scanner);
   }
   if (isDigit(c)) {
-    return number();
+    return number(scanner);
   }
 
   switch (c) {
     case '(':
-      return makeToken(TOKEN_LEFT_PAREN);
+      return makeToken(scanner, TOKEN_LEFT_PAREN);
     case ')':
-      return makeToken(TOKEN_RIGHT_PAREN);
+      return makeToken(scanner, TOKEN_RIGHT_PAREN);
     case '{':
-      return makeToken(TOKEN_LEFT_BRACE);
+      return makeToken(scanner, TOKEN_LEFT_BRACE);
     case '}':
-      return makeToken(TOKEN_RIGHT_BRACE);
+      return makeToken(scanner, TOKEN_RIGHT_BRACE);
     case ';':
-      return makeToken(TOKEN_SEMICOLON);
+      return makeToken(scanner, TOKEN_SEMICOLON);
     case ',':
-      return makeToken(TOKEN_COMMA);
+      return makeToken(scanner, TOKEN_COMMA);
     case '.':
-      return makeToken(TOKEN_DOT);
+      return makeToken(scanner, TOKEN_DOT);
     case '-':
-      return makeToken(TOKEN_MINUS);
+      return makeToken(scanner, TOKEN_MINUS);
     case '+':
-      return makeToken(TOKEN_PLUS);
+      return makeToken(scanner, TOKEN_PLUS);
     case '/':
-      return makeToken(TOKEN_SLASH);
+      return makeToken(scanner, TOKEN_SLASH);
     case '*':
-      return makeToken(TOKEN_STAR);
+      return makeToken(scanner, TOKEN_STAR);
     case '!':
-      return makeToken(match('=') ? TOKEN_BANG_EQUAL : TOKEN_BANG);
+      return makeToken(
+          scanner,
+          match(scanner, '=') ? TOKEN_BANG_EQUAL : TOKEN_BANG);
     case '=':
-      return makeToken(match('=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL);
+      return makeToken(
+          scanner,
+          match(scanner, '=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL);
     case '<':
-      return makeToken(match('=') ? TOKEN_LESS_EQUAL : TOKEN_LESS);
+      return makeToken(
+          scanner,
+          match(scanner, '=') ? TOKEN_LESS_EQUAL : TOKEN_LESS);
     case '>':
-      return makeToken(match('=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER);
+      return makeToken(
+          scanner,
+          match(scanner, '=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER);
     case '"':
-      return string();
+      return string(scanner);
     default:
       break;
   }
 
-  return errorToken("Unexpected character.");
+  return errorToken(scanner, "Unexpected character.");
 }
@@ -4,11 +4,274 @@
 
 #include <string.h>
 
+#if defined(__SSE2__)
+#  include <emmintrin.h>
+#endif
+
 #include <clox/memory.h>
 #include <clox/object.h>
 #include <clox/table.h>
 
-#define TABLE_MAX_LOAD 0.75
+// Only called once the hash and length already match, so nearly every call
+// returns true; what matters is getting there without a libc call for short
+// identifiers and sixteen bytes at a time for long strings.
+static bool charsEqual(const char* a, const char* b, int length) {
+#if defined(__SSE2__)
+  for (; length >= 16; a += 16, b += 16, length -= 16) {
+    __m128i x = _mm_loadu_si128((const __m128i*)a);
+    __m128i y = _mm_loadu_si128((const __m128i*)b);
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) != 0xFFFF) {
+      return false;
+    }
+  }
+#endif
+  for (; length >= 8; a += 8, b += 8, length -= 8) {
+    uint64_t x;
+    uint64_t y;
+    memcpy(&x, a, sizeof(x));
+    memcpy(&y, b, sizeof(y));
+    if (x != y) {
+      return false;
+    }
+  }
+  return memcmp(a, b, length) == 0;
+}
+
+#ifdef SWISS_TABLE
+
+// SwissTable-style open addressing. Alongside the entries is an array of
+// one-byte control words: CTRL_EMPTY, CTRL_DELETED, or the low seven bits
+// of the key's hash (H2). Capacities are powers of two and probing moves
+// across whole groups of control bytes, so one SIMD compare tests a group
+// for a matching H2 and one more for an empty slot that ends the search.
+
+#  if defined(__AVX2__)
+#    include <immintrin.h>
+#    define GROUP_WIDTH 32
+#  elif defined(__SSE2__)
+#    define GROUP_WIDTH 16
+#  else
+#    define GROUP_WIDTH 16
+#  endif
+
+#  define CTRL_EMPTY ((uint8_t)0x80)
+#  define CTRL_DELETED ((uint8_t)0xFE)
+#  define H1(hash) ((hash) >> 7)
+#  define H2(hash) ((uint8_t)((hash)&0x7F))
+
+// 7/8, kept integral; tombstones count towards the load like before
+#  define TABLE_MAX_LOAD(capacity) ((capacity) - (capacity) / 8)
+
+typedef uint32_t GroupMask;
+
+// bit i of the result is set when group[i] == byte
+static GroupMask matchByte(const uint8_t* group, uint8_t byte) {
+#  if defined(__AVX2__)
+  __m256i control = _mm256_loadu_si256((const __m256i*)group);
+  return (GroupMask)_mm256_movemask_epi8(
+      _mm256_cmpeq_epi8(control, _mm256_set1_epi8((char)byte)));
+#  elif defined(__SSE2__)
+  __m128i control = _mm_loadu_si128((const __m128i*)group);
+  return (GroupMask)_mm_movemask_epi8(
+      _mm_cmpeq_epi8(control, _mm_set1_epi8((char)byte)));
+#  else
+  GroupMask mask = 0;
+  for (int i = 0; i < GROUP_WIDTH; ++i) {
+    mask |= (GroupMask)(group[i] == byte) << i;
+  }
+  return mask;
+#  endif
+}
+
+// empty and deleted are the only control bytes with the high bit set
+static GroupMask matchEmptyOrDeleted(const uint8_t* group) {
+#  if defined(__AVX2__)
+  return (GroupMask)_mm256_movemask_epi8(
+      _mm256_loadu_si256((const __m256i*)group));
+#  elif defined(__SSE2__)
+  return (GroupMask)_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)group));
+#  else
+  GroupMask mask = 0;
+  for (int i = 0; i < GROUP_WIDTH; ++i) {
+    mask |= (GroupMask)(group[i] >> 7) << i;
+  }
+  return mask;
+#  endif
+}
+
+#  define FIRST_MATCH(mask) __builtin_ctz(mask)
+
+// Triangular probing over groups visits every group exactly once when the
+// number of groups is a power of two.
+typedef struct probe_s {
+  uint32_t mask;
+  uint32_t offset;
+  uint32_t stride;
+} Probe;
+
+static Probe startProbe(uint32_t hash, int capacity) {
+  uint32_t mask = (uint32_t)capacity - 1;
+  return (Probe){
+      .mask = mask,
+      .offset = (H1(hash) * GROUP_WIDTH) & mask,
+      .stride = 0,
+  };
+}
+
+static void nextProbe(Probe* probe) {
+  probe->stride += GROUP_WIDTH;
+  probe->offset = (probe->offset + probe->stride) & probe->mask;
+}
+
+void initTable(Table* table) {
+  table->count = 0;
+  table->capacity = 0;
+  table->entries = NULL;
+  table->control = NULL;
+}
+void freeTable(Table* table) {
+  FREE_ARRAY(Entry, table->entries, table->capacity);
+  FREE_ARRAY(uint8_t, table->control, table->capacity);
+  initTable(table);
+}
+static int findEntry(Table* table, ObjString* key) {
+  uint8_t h2 = H2(key->hash);
+  for (Probe probe = startProbe(key->hash, table->capacity);;
+       nextProbe(&probe)) {
+    const uint8_t* group = &table->control[probe.offset];
+    for (GroupMask match = matchByte(group, h2); match; match &= match - 1) {
+      int index = (int)probe.offset + FIRST_MATCH(match);
+      if (table->entries[index].key == key) {
+        return index;
+      }
+    }
+    if (matchByte(group, CTRL_EMPTY)) {
+      // no such entry
+      return -1;
+    }
+  }
+}
+// first empty or deleted slot along the probe sequence of `hash`
+static int findFreeSlot(const uint8_t* control, int capacity, uint32_t hash) {
+  for (Probe probe = startProbe(hash, capacity);; nextProbe(&probe)) {
+    GroupMask free = matchEmptyOrDeleted(&control[probe.offset]);
+    if (free) {
+      return (int)probe.offset + FIRST_MATCH(free);
+    }
+  }
+}
+static void adjustCapacity(Table* table, int capacity) {
+  Entry* entries = ALLOCATE(Entry, capacity);
+  uint8_t* control = ALLOCATE(uint8_t, capacity);
+  memset(control, CTRL_EMPTY, capacity);
+  for (int i = 0; i < capacity; ++i) {
+    entries[i].key = NULL;
+    entries[i].value = NIL_VAL;
+  }
+
+  table->count = 0;
+  for (int i = 0; i < table->capacity; ++i) {
+    Entry* entry = &table->entries[i];
+    if (entry->key == NULL) {
+      continue;
+    }
+
+    int dest = findFreeSlot(control, capacity, entry->key->hash);
+    control[dest] = H2(entry->key->hash);
+    entries[dest] = *entry;
+    table->count++;
+  }
+
+  FREE_ARRAY(Entry, table->entries, table->capacity);
+  FREE_ARRAY(uint8_t, table->control, table->capacity);
+  table->entries = entries;
+  table->control = control;
+  table->capacity = capacity;
+}
+bool tableSet(Table* table, ObjString* key, Value value) {
+  if (table->count + 1 > TABLE_MAX_LOAD(table->capacity)) {
+    int capacity
+        = table->capacity < GROUP_WIDTH ? GROUP_WIDTH : table->capacity * 2;
+    adjustCapacity(table, capacity);
+  }
+
+  int index = findEntry(table, key);
+  if (index != -1) {
+    table->entries[index].value = value;
+    return false;
+  }
+
+  index = findFreeSlot(table->control, table->capacity, key->hash);
+  // tombstones don't count as they were previously allocated
+  if (table->control[index] == CTRL_EMPTY) {
+    table->count++;
+  }
+  table->control[index] = H2(key->hash);
+  table->entries[index].key = key;
+  table->entries[index].value = value;
+  return true;
+}
+bool tableGet(Table* table, ObjString* key, Value* value) {
+  if (table->count == 0) {
+    return false;
+  }
+
+  int index = findEntry(table, key);
+  if (index == -1) {
+    return false;
+  }
+
+  // allow passing NULL to check membership
+  if (value) {
+    *value = table->entries[index].value;
+  }
+  return true;
+}
+bool tableDelete(Table* table, ObjString* key) {
+  if (table->count == 0) {
+    return false;
+  }
+
+  int index = findEntry(table, key);
+  if (index == -1) {
+    return false;
+  }
+
+  // tombstone
+  table->control[index] = CTRL_DELETED;
+  table->entries[index].key = NULL;
+  table->entries[index].value = BOOL_VAL(true);
+  return true;
+}
+ObjString* tableFindString(
+    Table* table,
+    int length,
+    const char chars[length],
+    uint32_t hash) {
+  if (table->count == 0) {
+    return NULL;
+  }
+
+  uint8_t h2 = H2(hash);
+  for (Probe probe = startProbe(hash, table->capacity);; nextProbe(&probe)) {
+    const uint8_t* group = &table->control[probe.offset];
+    for (GroupMask match = matchByte(group, h2); match; match &= match - 1) {
+      ObjString* key
+          = table->entries[probe.offset + FIRST_MATCH(match)].key;
+      if (key->hash == hash && key->length == length
+          && charsEqual(key->chars, chars, length)) {
+        return key;
+      }
+    }
+    if (matchByte(group, CTRL_EMPTY)) {
+      return NULL;
+    }
+  }
+}
+
+#else
+
+#  define TABLE_MAX_LOAD 0.75
 
 void initTable(Table* table) {
   table->count = 0;
@@ -80,14 +343,6 @@ bool tableSet(Table* table, ObjString* key, Value value) {
   entry->value = value;
   return isNewKey;
 }
-void tableAddAll(Table* from, Table* to) {
-  for (int i = 0; i < from->capacity; ++i) {
-    Entry* entry = &from->entries[i];
-    if (entry->key) {
-      tableSet(to, entry->key, entry->value);
-    }
-  }
-}
 bool tableGet(Table* table, ObjString* key, Value* value) {
   if (table->count == 0) {
     return false;
@@ -122,7 +377,7 @@ bool tableDelete(Table* table, ObjString* key) {
 ObjString* tableFindString(
     Table* table,
     int length,
-    const char* chars,
+    const char chars[length],
     uint32_t hash) {
   if (table->count == 0) {
     return NULL;
@@ -136,11 +391,37 @@ ObjString* tableFindString(
         return NULL;
       }
     } else if (
-        entry->key->length == length && entry->key->hash == hash
-        && memcmp(entry->key->chars, chars, length) == 0) {
+        entry->key->hash == hash && entry->key->length == length
+        && charsEqual(entry->key->chars, chars, length)) {
       return entry->key;
     }
 
     index = (index + 1) % table->capacity;
   }
 }
+
+#endif
+
+void tableAddAll(Table* from, Table* to) {
+  for (int i = 0; i < from->capacity; ++i) {
+    Entry* entry = &from->entries[i];
+    if (entry->key) {
+      tableSet(to, entry->key, entry->value);
+    }
+  }
+}
+void tableRemoveWhite(Table* table) {
+  for (int i = 0; i < table->capacity; ++i) {
+    Entry* entry = &table->entries[i];
+    if (entry->key != NULL && !entry->key->obj.isMarked) {
+      tableDelete(table, entry->key);
+    }
+  }
+}
+void markTable(Vm* vm, Table* table) {
+  for (int i = 0; i < table->capacity; ++i) {
+    Entry* entry = &table->entries[i];
+    markObject(vm, (Obj*)entry->key);
+    markValue(vm, entry->value);
+  }
+}
@@ -26,7 +26,20 @@ void freeValueArray(ValueArray* array) {
   initValueArray(array);
 }
 
-void printValue(Value value) {
+void printValue(Vm* vm, Value value) {
+#ifdef NAN_BOXING
+  if (IS_BOOL(value)) {
+    fputs(AS_BOOL(value) ? "true" : "false", stdout);
+  } else if (IS_NIL(value)) {
+    fputs("nil", stdout);
+  } else if (IS_NUMBER(value)) {
+    printf("%g", AS_NUMBER(value));
+  } else if (IS_OBJ(value)) {
+    printObject(vm, value);
+  } else if (IS_UNDEFINED(value)) {
+    fputs("undefined", stdout);
+  }
+#else
   switch (value.type) {
     case VAL_BOOL:
       fputs(AS_BOOL(value) ? "true" : "false", stdout);
@@ -38,7 +51,11 @@ void printValue(Value value) {
       printf("%g", AS_NUMBER(value));
       break;
     case VAL_OBJ:
-      printObject(value);
+      printObject(vm, value);
+      break;
+    case VAL_UNDEFINED:
+      fputs("undefined", stdout);
       break;
   }
+#endif
 }
@@ -0,0 +1,150 @@
+#include <clox/verifier.h>
+
+enum {
+#define X(x) +1
+  OPCODE_COUNT = 0 OPCODES_
+#undef X
+};
+
+static Verification invalid(const char error[static 1], int offset) {
+  return (Verification){.error = error, .offset = offset};
+}
+
+Verification verifyChunk(Chunk* chunk, uint32_t globalCount) {
+  uint32_t constantCount = (uint32_t)chunk->constants.count;
+  int depth = 0;
+  int maxStack = 0;
+  uint8_t last = OP_RETURN;
+
+  for (int offset = 0; offset < chunk->count;) {
+    const uint8_t* code = &chunk->code[offset];
+    if (code[0] >= OPCODE_COUNT) {
+      return invalid("Unknown opcode.", offset);
+    }
+    int length = instructionLength(code[0]);
+    if (length > chunk->count - offset) {
+      return invalid("Operands run past the end of the code.", offset);
+    }
+    uint32_t operand = 0;
+    if (length == 4) {
+      operand = code[1] | (code[2] << 8) | ((uint32_t)code[3] << 16);
+    } else if (length > 1) {
+      operand = code[1];
+    }
+
+    int pops = 0;
+    int pushes = 0;
+    // values pushed before the instruction settles on its result
+    int transient = 0;
+    switch (code[0]) {
+      case OP_ADD_LOCAL_CONST:
+        if (code[2] >= constantCount) {
+          return invalid("Constant index out of range.", offset);
+        }
+        if (operand >= (uint32_t)depth) {
+          return invalid("Local slot out of range.", offset);
+        }
+        // both operands are pushed to concatenate strings
+        pushes = 1;
+        transient = 2;
+        break;
+      case OP_CONSTANT:
+      case OP_CONSTANT_LONG:
+        if (operand >= constantCount) {
+          return invalid("Constant index out of range.", offset);
+        }
+        pushes = 1;
+        break;
+      case OP_NIL:
+      case OP_TRUE:
+      case OP_FALSE:
+        pushes = 1;
+        break;
+      case OP_POP:
+      case OP_PRINT:
+        pops = 1;
+        break;
+      case OP_DEFINE_GLOBAL_SLOT:
+      case OP_DEFINE_GLOBAL_SLOT_LONG:
+      case OP_SET_GLOBAL_SLOT_POP:
+      case OP_GET_GLOBAL_SLOT:
+      case OP_GET_GLOBAL_SLOT_LONG:
+      case OP_SET_GLOBAL_SLOT:
+      case OP_SET_GLOBAL_SLOT_LONG:
+        if (operand >= globalCount) {
+          return invalid("Global slot out of range.", offset);
+        }
+        if (code[0] == OP_GET_GLOBAL_SLOT
+            || code[0] == OP_GET_GLOBAL_SLOT_LONG) {
+          pushes = 1;
+        } else {
+          pops = 1;
+          pushes = code[0] == OP_SET_GLOBAL_SLOT
+                || code[0] == OP_SET_GLOBAL_SLOT_LONG;
+        }
+        break;
+      case OP_GET_LOCAL2:
+        // the second read may see the value the first one pushed
+        if (code[2] > depth) {
+          return invalid("Local slot out of range.", offset);
+        }
+        // fall through
+      case OP_GET_LOCAL:
+      case OP_GET_LOCAL_LONG:
+        if (operand >= (uint32_t)depth) {
+          return invalid("Local slot out of range.", offset);
+        }
+        pushes = code[0] == OP_GET_LOCAL2 ? 2 : 1;
+        break;
+      case OP_SET_LOCAL:
+      case OP_SET_LOCAL_LONG:
+        if (operand >= (uint32_t)depth) {
+          return invalid("Local slot out of range.", offset);
+        }
+        pops = 1;
+        pushes = 1;
+        break;
+      case OP_SET_LOCAL_POP:
+        // the slot must still exist once the value is popped
+        if ((int64_t)operand >= (int64_t)depth - 1) {
+          return invalid("Local slot out of range.", offset);
+        }
+        pops = 1;
+        break;
+      case OP_NOT:
+      case OP_NEGATE:
+        pops = 1;
+        pushes = 1;
+        break;
+      case OP_RETURN:
+        // the next chunk's locals start at the bottom of the stack
+        if (depth != 0) {
+          return invalid("Stack is not empty at return.", offset);
+        }
+        break;
+      default:
+        pops = 2;
+        pushes = 1;
+        break;
+    }
+
+    if (depth < pops) {
+      return invalid("Stack underflow.", offset);
+    }
+    if (depth + transient > maxStack) {
+      maxStack = depth + transient;
+    }
+    depth += pushes - pops;
+    if (depth > maxStack) {
+      maxStack = depth;
+    }
+    last = code[0];
+    offset += length;
+  }
+
+  if (chunk->count == 0 || last != OP_RETURN) {
+    return invalid("Code does not end with OP_RETURN.", chunk->count);
+  }
+  chunk->maxStack = maxStack;
+  return (Verification){.error = NULL, .offset = 0};
+}
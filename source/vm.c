@@ -1,75 +1,214 @@
 #pragma region "includes"
 
+#include <assert.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include <clox/compiler.h>
+#include <clox/jit.h>
 #include <clox/memory.h>
+#include <clox/pool.h>
+#include <clox/profiler.h>
+#include <clox/verifier.h>
 #include <clox/vm.h>
 
-#ifdef DEBUG_TRACE_EXECUTION
+#if defined(DEBUG_TRACE_EXECUTION) || defined(DEBUG_PRINT_CODE)
 #  include <clox/debug.h>
 #endif
 
+// labels-as-values are a GNU extension; everything else gets the switch
+#if defined(COMPUTED_GOTO) && !defined(__GNUC__)
+#  undef COMPUTED_GOTO
+#endif
+
 #pragma endregion
 
-// not static due to usage in other files
-Vm g_VM;
+// The VM initVm() bound to each thread. reallocate() charges allocations to
+// it and collects it, since the arrays and tables it grows don't know which
+// VM they belong to. Not static due to usage in other files.
+_Thread_local Vm* g_CURRENT_VM = NULL;
 
 #pragma region "error handling"
 
-static void resetStack() {
-  g_VM.stackTop = g_VM.stack.values;
+static void resetStack(Vm* vm) {
+  vm->stackTop = vm->stack.values;
+}
+
+static void runtimeError(Vm* vm, const char format[static 1], ...)
+    __attribute__((format(printf, 2, 3)));
+
+// Whether `chunk` holds the code being run, ignoring quickening.
+static bool isRunningCode(Vm* vm, const Chunk* chunk) {
+  if (chunk->count != vm->chunk->count) {
+    return false;
+  }
+  for (int offset = 0; offset < chunk->count;) {
+    uint8_t op = chunk->code[offset];
+    int length = instructionLength(op);
+    if (op != genericOpcode(vm->chunk->code[offset])
+        || memcmp(
+               &chunk->code[offset + 1],
+               &vm->chunk->code[offset + 1],
+               length - 1)
+            != 0) {
+      return false;
+    }
+    offset += length;
+  }
+  return true;
 }
 
-static void runtimeError(const char format[static 1], ...)
-    __attribute__((format(printf, 1, 2)));
+// A chunk compiled with stripped lines is compiled again, this time keeping
+// them. The line is only trusted if the code comes out identical, which it
+// won't if e.g. a cache was built with other options. Returns 0 if unknown.
+static int recoverLine(Vm* vm, int offset) {
+  if (!vm->source) {
+    return 0;
+  }
+  CompilerOptions options = g_COMPILER_OPTIONS;
+  options.stripLines = false;
+  Chunk chunk;
+  initChunk(&chunk);
+  int line = 0;
+  if (compile(vm, &options, vm->sourceLength, vm->source, &chunk)
+      && isRunningCode(vm, &chunk)) {
+    line = getLine(&chunk.lines, offset);
+  }
+  freeChunk(&chunk);
+  return line;
+}
 
-static void runtimeError(const char format[static 1], ...) {
+static void runtimeError(Vm* vm, const char format[static 1], ...) {
+  // both lines together, whatever other threads report
+  flockfile(stderr);
   va_list args;
   va_start(args, format);
   vfprintf(stderr, format, args);
   va_end(args);
   fputs("\n", stderr);
 
-  size_t instruction = g_VM.ip - g_VM.chunk->code - 1;
-  int line = getLine(&g_VM.chunk->lines, (int)instruction);
-  fprintf(stderr, "[line %d] in script\n", line);
-  resetStack();
+  int instruction = (int)(vm->ip - vm->chunk->code - 1);
+  int line = getLine(&vm->chunk->lines, instruction);
+  if (line == 0) {
+    line = recoverLine(vm, instruction);
+  }
+  if (line == 0) {
+    fputs("[line ?] in script\n", stderr);
+  } else {
+    fprintf(stderr, "[line %d] in script\n", line);
+  }
+  funlockfile(stderr);
+  resetStack(vm);
+}
+
+static void undefinedVariableError(Vm* vm, uint32_t slot) {
+  runtimeError(
+      vm,
+      "Undefined variable '%s'",
+      AS_CSTRING(vm->globalNames.values[slot]));
 }
 
 #pragma endregion
 
 #pragma region "init/deinit"
 
-void initVm() {
-  initValueArray(&g_VM.stack);
-  g_VM.objects = NULL;
-  resetStack();
-  initTable(&g_VM.strings);
-  initTable(&g_VM.globals);
+void initVm(Vm* vm) {
+  // a second VM would take over the thread's pool and leave the first one's
+  // objects dangling, so this is checked in every build, not just by assert
+  if (g_CURRENT_VM) {
+    fputs("initVm: this thread already has a VM\n", stderr);
+    abort();
+  }
+  g_CURRENT_VM = vm;
+  initPool();
+  vm->chunk = NULL;
+  vm->source = NULL;
+  vm->sourceLength = 0;
+  vm->objects = NULL;
+  vm->bytesAllocated = 0;
+  vm->nextGC = GC_INITIAL_HEAP_SIZE;
+  vm->grayCount = 0;
+  vm->grayCapacity = 0;
+  vm->grayStack = NULL;
+  vm->compiler = NULL;
+  vm->profile = NULL;
+
+  initValueArray(&vm->stack);
+  resetStack(vm);
+  initTable(&vm->strings);
+  initTable(&vm->globalSlots);
+  initValueArray(&vm->globalValues);
+  initValueArray(&vm->globalNames);
+
+  // push() relies on there always being a free slot
+  vm->stack.capacity = GROW_CAPACITY(0);
+  vm->stack.values = GROW_ARRAY(Value, NULL, 0, vm->stack.capacity);
+  resetStack(vm);
 }
 
-void freeVm() {
-  freeObjects();
-  freeTable(&g_VM.strings);
-  freeTable(&g_VM.globals);
+void freeVm(Vm* vm) {
+  freeTable(&vm->strings);
+  freeTable(&vm->globalSlots);
+  freeValueArray(&vm->globalValues);
+  freeValueArray(&vm->globalNames);
+  freeValueArray(&vm->stack);
+  freeObjects(vm);
+  freePool();
+  g_CURRENT_VM = NULL;
 }
 
 #pragma endregion
 
 #pragma region "utility functions"
 
-static Value peek(int distance) {
-  return g_VM.stackTop[-1 - distance];
+// Unchecked versions of push() and pop() for run(): interpretChunk() makes
+// room for the chunk's verified maximum depth before it starts.
+static inline void pushUnchecked(Vm* vm, Value value) {
+  *vm->stackTop++ = value;
+}
+
+static inline Value popUnchecked(Vm* vm) {
+  return *--vm->stackTop;
+}
+
+static inline void drop(Vm* vm, int count) {
+  vm->stackTop -= count;
+}
+
+static inline uint8_t typeProfile(Value value) {
+  if (IS_NUMBER(value)) {
+    return TYPE_PROFILE_NUMBER;
+  }
+  return IS_TEXT(value) ? TYPE_PROFILE_TEXT : TYPE_PROFILE_OTHER;
+}
+
+static Value peek(Vm* vm, int distance) {
+  return vm->stackTop[-1 - distance];
 }
 
 static bool isFalsey(Value value) {
   return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
-static bool valuesEqual(Value a, Value b) {
+// Flattens rope operands, so both must still be reachable (on the stack).
+static bool valuesEqual(Vm* vm, Value a, Value b) {
+  // ropes compare by contents, which interning turns into identity
+  if (IS_ROPE(a)) {
+    a = OBJ_VAL(flattenRope(vm, AS_ROPE(a)));
+  }
+  if (IS_ROPE(b)) {
+    b = OBJ_VAL(flattenRope(vm, AS_ROPE(b)));
+  }
+
+#ifdef NAN_BOXING
+  if (IS_NUMBER(a) && IS_NUMBER(b)) {
+    // NaN != NaN, so numbers still compare as doubles
+    return AS_NUMBER(a) == AS_NUMBER(b);
+  }
+  return a == b;
+#else
   switch (a.type) {
     case VAL_BOOL:
       return IS_BOOL(b) && AS_BOOL(a) == AS_BOOL(b);
@@ -79,209 +218,386 @@ static bool valuesEqual(Value a, Value b) {
       return IS_NUMBER(b) && AS_NUMBER(a) == AS_NUMBER(b);
     case VAL_OBJ:
       return AS_OBJ(a) == AS_OBJ(b);
+    case VAL_UNDEFINED:
+      return IS_UNDEFINED(b);
+  }
+  return false;
+#endif
+}
+
+static void concatenate(Vm* vm) {
+  // the operands stay on the stack until the result exists, so the
+  // allocations below can't collect them
+  Obj* b = AS_OBJ(peek(vm, 0));
+  Obj* a = AS_OBJ(peek(vm, 1));
+
+  int length = textLength(a) + textLength(b);
+  Obj* result;
+  if (length >= ROPE_MIN_LENGTH) {
+    // defer the copy (and the hashing) until the characters are needed
+    result = &makeRope(vm, a, b, length)->obj;
+  } else {
+    // a rope is never this short, so both operands are flat strings
+    ObjString* left = (ObjString*)a;
+    ObjString* right = (ObjString*)b;
+    ObjString* string = makeString(vm, length);
+    memcpy(string->chars, left->chars, left->length);
+    memcpy(string->chars + left->length, right->chars, right->length);
+    result = &takeString(vm, string)->obj;
   }
+  drop(vm, 2);
+  pushUnchecked(vm, OBJ_VAL(result));
 }
 
-static void concatenate() {
-  ObjString* b = AS_STRING(pop());
-  ObjString* a = AS_STRING(pop());
-
-  int length = a->length + b->length;
-  char* chars = ALLOCATE(char, length + 1);
-  memcpy(chars, a->chars, a->length);
-  memcpy(chars + a->length, b->chars, b->length);
-  chars[length] = 0;
-  ObjString* result = takeString(length, chars);
-  push(OBJ_VAL(result));
+// Prints and pops the top of the stack. The line goes out whole even when
+// VMs on other threads print too.
+static void printLine(Vm* vm) {
+  flockfile(stdout);
+  // printing may flatten a rope, so keep the value reachable
+  printValue(vm, peek(vm, 0));
+  drop(vm, 1);
+  fputs("\n", stdout);
+  funlockfile(stdout);
 }
 
 #pragma endregion
 
 #pragma region "the hot function, run()"
 
-static InterpretResult run() {
-#define READ_BYTE() (*g_VM.ip++)
+#ifdef DEBUG_TRACE_EXECUTION
+static void traceExecution(Vm* vm) {
+  for (size_t i = 0; i < 10; i++) {
+    fputc(' ', stdout);
+  }
+  for (Value* slot = vm->stack.values; slot < vm->stackTop; slot++) {
+    fputs("[ ", stdout);
+    printValue(vm, *slot);
+    fputs(" ]", stdout);
+  }
+  fputs("\n", stdout);
+  disassembleInstruction(
+      vm,
+      vm->chunk,
+      (int)(vm->ip - vm->chunk->code));
+}
+#endif
+
+static InterpretResult run(Vm* vm) {
+#define READ_BYTE() (*vm->ip++)
 #define READ_THREE_BYTES() \
-  (READ_BYTE() + READ_BYTE() * UINT8_COUNT \
-   + READ_BYTE() * UINT8_COUNT * UINT8_COUNT)
-#define READ_CONSTANT() (g_VM.chunk->constants.values[READ_BYTE()])
-#define READ_LONG_CONSTANT() (g_VM.chunk->constants.values[READ_THREE_BYTES()])
-#define READ_STRING() AS_STRING(READ_CONSTANT())
-#define READ_STRING_LONG() AS_STRING(READ_LONG_CONSTANT())
-#define BINARY_OP(valueType, op) \
+  (vm->ip += 3, \
+   vm->ip[-3] + vm->ip[-2] * UINT8_COUNT \
+       + vm->ip[-1] * UINT8_COUNT * UINT8_COUNT)
+#define READ_CONSTANT() (vm->chunk->constants.values[READ_BYTE()])
+#define READ_LONG_CONSTANT() (vm->chunk->constants.values[READ_THREE_BYTES()])
+// Records the operand types a generic arithmetic or comparison instruction
+// sees, and rewrites a site that has only ever seen numbers into its _NUM
+// form.
+#define QUICKEN(quickened) \
   do { \
-    if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
-      runtimeError("Operands must be numbers."); \
+    uint8_t* profile \
+        = &vm->chunk->typeProfiles[vm->ip - 1 - vm->chunk->code]; \
+    *profile |= typeProfile(peek(vm, 0)) | typeProfile(peek(vm, 1)); \
+    if (*profile == TYPE_PROFILE_NUMBER) { \
+      vm->ip[-1] = (quickened); \
+    } \
+  } while (false)
+#define BINARY_OP(quickened, valueType, op) \
+  do { \
+    QUICKEN(quickened); \
+    if (!IS_NUMBER(peek(vm, 0)) || !IS_NUMBER(peek(vm, 1))) { \
+      runtimeError(vm, "Operands must be numbers."); \
       return INTERPRET_RUNTIME_ERROR; \
     } \
-    double b = AS_NUMBER(pop()); \
-    double a = AS_NUMBER(pop()); \
-    push(valueType(a op b)); \
+    double b = AS_NUMBER(popUnchecked(vm)); \
+    double a = AS_NUMBER(popUnchecked(vm)); \
+    pushUnchecked(vm, valueType(a op b)); \
   } while (false)
-  for (;;) {
+// A quickened instruction checks each operand's tag once. On a miss it
+// turns back into the generic instruction, which then runs, records the new
+// types and keeps the site from being quickened again.
+#define NUMBER_OP(generic, valueType, op) \
+  if (IS_NUMBER(peek(vm, 0)) && IS_NUMBER(peek(vm, 1))) { \
+    double b = AS_NUMBER(popUnchecked(vm)); \
+    double a = AS_NUMBER(popUnchecked(vm)); \
+    pushUnchecked(vm, valueType(a op b)); \
+  } else { \
+    *--vm->ip = (generic); \
+  } \
+  DISPATCH()
+#define NOT_BOOL_VAL(value) BOOL_VAL(!(value))
 #ifdef DEBUG_TRACE_EXECUTION
-    for (size_t i = 0; i < 10; i++) {
-      fputc(' ', stdout);
-    }
-    for (Value* slot = g_VM.stack.values; slot < g_VM.stackTop; slot++) {
-      fputs("[ ", stdout);
-      printValue(*slot);
-      fputs(" ]", stdout);
+#  define TRACE_EXECUTION() traceExecution(vm)
+#else
+#  define TRACE_EXECUTION() \
+    do { \
+    } while (false)
+#endif
+#ifdef COMPUTED_GOTO
+// Every handler ends in its own indirect jump, so the branch predictor gets
+// one history slot per opcode instead of one shared by all of them.
+#  define CASE(op) \
+    case op: \
+      target_##op
+#  define DISPATCH() \
+    do { \
+      TRACE_EXECUTION(); \
+      instruction = READ_BYTE(); \
+      goto* handlers[instruction]; \
+    } while (false)
+#else
+#  define CASE(op) case op
+#  define DISPATCH() continue
+#endif
+
+#ifdef COMPUTED_GOTO
+  static void* const dispatchTable[] = {
+#  define X(x) [OP_##x] = &&target_OP_##x,
+      OPCODES_
+#  undef X
+  };
+  // Profiling sends every instruction through countInstruction() on its way
+  // to the handler, so the handlers themselves don't check for it.
+  static void* const profilingTable[] = {
+      [0 ... OP_CODE_COUNT - 1] = &&profileInstruction,
+  };
+  void* const* handlers = vm->profile ? profilingTable : dispatchTable;
+#endif
+
+  uint8_t instruction;
+#ifdef COMPUTED_GOTO
+  DISPATCH();
+profileInstruction:
+  countInstruction(
+      vm->profile,
+      instruction,
+      (int)(vm->ip - 1 - vm->chunk->code));
+  goto* dispatchTable[instruction];
+#endif
+  for (;;) {
+    TRACE_EXECUTION();
+    instruction = READ_BYTE();
+#ifndef COMPUTED_GOTO
+    if (vm->profile) {
+      countInstruction(
+          vm->profile,
+          instruction,
+          (int)(vm->ip - 1 - vm->chunk->code));
     }
-    fputs("\n", stdout);
-    disassembleInstruction(g_VM.chunk, (int)(g_VM.ip - g_VM.chunk->code));
 #endif
-    uint8_t instruction = READ_BYTE();
     switch (instruction) {
-      case OP_CONSTANT:
+      CASE(OP_CONSTANT):
         {
           Value constant = READ_CONSTANT();
-          push(constant);
-          break;
+          pushUnchecked(vm, constant);
+          DISPATCH();
         }
-      case OP_CONSTANT_LONG:
+      CASE(OP_CONSTANT_LONG):
         {
           Value constant = READ_LONG_CONSTANT();
-          push(constant);
-          break;
+          pushUnchecked(vm, constant);
+          DISPATCH();
         }
-      case OP_NIL:
-        push(NIL_VAL);
-        break;
-      case OP_TRUE:
-        push(BOOL_VAL(true));
-        break;
-      case OP_FALSE:
-        push(BOOL_VAL(false));
-        break;
-      case OP_POP:
-        pop();
-        break;
-      case OP_DEFINE_GLOBAL:
+      CASE(OP_NIL):
+        pushUnchecked(vm, NIL_VAL);
+        DISPATCH();
+      CASE(OP_TRUE):
+        pushUnchecked(vm, BOOL_VAL(true));
+        DISPATCH();
+      CASE(OP_FALSE):
+        pushUnchecked(vm, BOOL_VAL(false));
+        DISPATCH();
+      CASE(OP_POP):
+        drop(vm, 1);
+        DISPATCH();
+      CASE(OP_DEFINE_GLOBAL_SLOT):
+      CASE(OP_DEFINE_GLOBAL_SLOT_LONG):
         {
-          ObjString* name = READ_STRING();
-          tableSet(&g_VM.globals, name, peek(0));
-          pop();
-          break;
+          uint32_t slot = (instruction == OP_DEFINE_GLOBAL_SLOT)
+              ? READ_BYTE()
+              : READ_THREE_BYTES();
+          vm->globalValues.values[slot] = peek(vm, 0);
+          drop(vm, 1);
+          DISPATCH();
         }
-      case OP_DEFINE_GLOBAL_LONG:
+      CASE(OP_GET_GLOBAL_SLOT):
+      CASE(OP_GET_GLOBAL_SLOT_LONG):
         {
-          ObjString* name = READ_STRING_LONG();
-          tableSet(&g_VM.globals, name, peek(0));
-          pop();
-          break;
-        }
-      case OP_GET_GLOBAL:
-        {
-          ObjString* name = READ_STRING();
-          Value value;
-          if (!tableGet(&g_VM.globals, name, &value)) {
-            runtimeError("Undefined variable '%s'", name->chars);
+          uint32_t slot = (instruction == OP_GET_GLOBAL_SLOT)
+              ? READ_BYTE()
+              : READ_THREE_BYTES();
+          Value value = vm->globalValues.values[slot];
+          if (IS_UNDEFINED(value)) {
+            undefinedVariableError(vm, slot);
             return INTERPRET_RUNTIME_ERROR;
           }
-          push(value);
-          break;
+          pushUnchecked(vm, value);
+          DISPATCH();
         }
-      case OP_GET_GLOBAL_LONG:
+      CASE(OP_SET_GLOBAL_SLOT):
+      CASE(OP_SET_GLOBAL_SLOT_LONG):
         {
-          ObjString* name = READ_STRING_LONG();
-          Value value;
-          if (!tableGet(&g_VM.globals, name, &value)) {
-            runtimeError("Undefined variable '%s'", name->chars);
+          uint32_t slot = (instruction == OP_SET_GLOBAL_SLOT)
+              ? READ_BYTE()
+              : READ_THREE_BYTES();
+          Value* global = &vm->globalValues.values[slot];
+          if (IS_UNDEFINED(*global)) {
+            undefinedVariableError(vm, slot);
             return INTERPRET_RUNTIME_ERROR;
           }
-          push(value);
-          break;
+          *global = peek(vm, 0);
+          DISPATCH();
         }
-      case OP_SET_GLOBAL:
-      case OP_SET_GLOBAL_LONG:
+      CASE(OP_GET_LOCAL):
+      CASE(OP_GET_LOCAL_LONG):
         {
-          ObjString* name = (instruction == OP_SET_GLOBAL) ? READ_STRING()
-                                                           : READ_STRING_LONG();
-          if (tableSet(&g_VM.globals, name, peek(0))) {
-            tableDelete(&g_VM.globals, name);
-            runtimeError("Undefined variable '%s'", name->chars);
+          uint32_t slot = (instruction == OP_GET_LOCAL) ? READ_BYTE()
+                                                        : READ_THREE_BYTES();
+          pushUnchecked(vm, vm->stack.values[slot]);
+          DISPATCH();
+        }
+      CASE(OP_SET_LOCAL):
+      CASE(OP_SET_LOCAL_LONG):
+        {
+          uint32_t slot = (instruction == OP_SET_LOCAL) ? READ_BYTE()
+                                                        : READ_THREE_BYTES();
+          vm->stack.values[slot] = peek(vm, 0);
+          DISPATCH();
+        }
+      CASE(OP_EQUAL):
+        {
+          bool equal = valuesEqual(vm, peek(vm, 1), peek(vm, 0));
+          drop(vm, 2);
+          pushUnchecked(vm, BOOL_VAL(equal));
+          DISPATCH();
+        }
+      CASE(OP_GREATER):
+        BINARY_OP(OP_GREATER_NUM, BOOL_VAL, >);
+        DISPATCH();
+      CASE(OP_LESS):
+        BINARY_OP(OP_LESS_NUM, BOOL_VAL, <);
+        DISPATCH();
+      CASE(OP_ADD):
+        QUICKEN(OP_ADD_NUM);
+        if (IS_NUMBER(peek(vm, 0)) && IS_NUMBER(peek(vm, 1))) {
+          double b = AS_NUMBER(popUnchecked(vm));
+          double a = AS_NUMBER(popUnchecked(vm));
+          pushUnchecked(vm, NUMBER_VAL(a + b));
+        } else if (IS_TEXT(peek(vm, 0)) && IS_TEXT(peek(vm, 1))) {
+          concatenate(vm);
+        } else {
+          runtimeError(vm, "Operands must be two numbers or two strings.");
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        DISPATCH();
+      CASE(OP_SUBTRACT):
+        BINARY_OP(OP_SUBTRACT_NUM, NUMBER_VAL, -);
+        DISPATCH();
+      CASE(OP_MULTIPLY):
+        BINARY_OP(OP_MULTIPLY_NUM, NUMBER_VAL, *);
+        DISPATCH();
+      CASE(OP_DIVIDE):
+        BINARY_OP(OP_DIVIDE_NUM, NUMBER_VAL, /);
+        DISPATCH();
+      CASE(OP_NOT):
+        pushUnchecked(vm, BOOL_VAL(isFalsey(popUnchecked(vm))));
+        DISPATCH();
+      CASE(OP_NEGATE):
+        {
+          if (!IS_NUMBER(peek(vm, 0))) {
+            runtimeError(vm, "Operand must be a number.");
             return INTERPRET_RUNTIME_ERROR;
           }
-          break;
+          pushUnchecked(vm, NUMBER_VAL(-AS_NUMBER(popUnchecked(vm))));
+          DISPATCH();
         }
-      case OP_GET_LOCAL:
-      case OP_GET_LOCAL_LONG:
+      CASE(OP_PRINT):
+        printLine(vm);
+        DISPATCH();
+      CASE(OP_NOT_EQUAL):
         {
-          uint8_t slot = (instruction == OP_GET_LOCAL) ? READ_BYTE()
-                                                       : READ_THREE_BYTES();
-          push(g_VM.stack.values[slot]);
-          break;
+          bool equal = valuesEqual(vm, peek(vm, 1), peek(vm, 0));
+          drop(vm, 2);
+          pushUnchecked(vm, BOOL_VAL(!equal));
+          DISPATCH();
         }
-      case OP_SET_LOCAL:
-      case OP_SET_LOCAL_LONG:
+      CASE(OP_GREATER_EQUAL):
+        // !(a < b) rather than a >= b, so NaN behaves like OP_LESS, OP_NOT
+        BINARY_OP(OP_GREATER_EQUAL_NUM, NOT_BOOL_VAL, <);
+        DISPATCH();
+      CASE(OP_LESS_EQUAL):
+        BINARY_OP(OP_LESS_EQUAL_NUM, NOT_BOOL_VAL, >);
+        DISPATCH();
+      CASE(OP_GET_LOCAL2):
         {
-          uint8_t slot = (instruction == OP_SET_LOCAL) ? READ_BYTE()
-                                                       : READ_THREE_BYTES();
-          g_VM.stack.values[slot] = pop();
-          break;
+          uint8_t first = READ_BYTE();
+          uint8_t second = READ_BYTE();
+          pushUnchecked(vm, vm->stack.values[first]);
+          pushUnchecked(vm, vm->stack.values[second]);
+          DISPATCH();
         }
-      case OP_EQUAL:
+      CASE(OP_ADD_LOCAL_CONST):
         {
-          Value b = pop();
-          Value a = pop();
-          push(BOOL_VAL(valuesEqual(a, b)));
-          break;
-        }
-      case OP_GREATER:
-        BINARY_OP(BOOL_VAL, >);
-        break;
-      case OP_LESS:
-        BINARY_OP(BOOL_VAL, <);
-        break;
-      case OP_ADD:
-        if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
-          concatenate();
-        } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
-          double b = AS_NUMBER(pop());
-          double a = AS_NUMBER(pop());
-          push(NUMBER_VAL(a + b));
-        } else {
-          runtimeError("Operands must be two numbers or two strings.");
-          return INTERPRET_RUNTIME_ERROR;
+          Value a = vm->stack.values[READ_BYTE()];
+          Value b = READ_CONSTANT();
+          if (IS_NUMBER(a) && IS_NUMBER(b)) {
+            pushUnchecked(vm, NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b)));
+          } else if (IS_TEXT(a) && IS_TEXT(b)) {
+            pushUnchecked(vm, a);
+            pushUnchecked(vm, b);
+            concatenate(vm);
+          } else {
+            runtimeError(vm, "Operands must be two numbers or two strings.");
+            return INTERPRET_RUNTIME_ERROR;
+          }
+          DISPATCH();
         }
-        break;
-      case OP_SUBTRACT:
-        BINARY_OP(NUMBER_VAL, -);
-        break;
-      case OP_MULTIPLY:
-        BINARY_OP(NUMBER_VAL, *);
-        break;
-      case OP_DIVIDE:
-        BINARY_OP(NUMBER_VAL, /);
-        break;
-      case OP_NOT:
-        push(BOOL_VAL(isFalsey(pop())));
-        break;
-      case OP_NEGATE:
+      CASE(OP_SET_GLOBAL_SLOT_POP):
         {
-          if (!IS_NUMBER(peek(0))) {
-            runtimeError("Operand must be a number.");
+          uint8_t slot = READ_BYTE();
+          Value* global = &vm->globalValues.values[slot];
+          if (IS_UNDEFINED(*global)) {
+            undefinedVariableError(vm, slot);
             return INTERPRET_RUNTIME_ERROR;
           }
-          push(NUMBER_VAL(-AS_NUMBER(pop())));
-          break;
+          *global = popUnchecked(vm);
+          DISPATCH();
         }
-      case OP_PRINT:
+      CASE(OP_SET_LOCAL_POP):
         {
-          printValue(pop());
-          fputs("\n", stdout);
-          break;
+          uint8_t slot = READ_BYTE();
+          vm->stack.values[slot] = popUnchecked(vm);
+          DISPATCH();
         }
-      case OP_RETURN:
+      CASE(OP_ADD_NUM):
+        NUMBER_OP(OP_ADD, NUMBER_VAL, +);
+      CASE(OP_SUBTRACT_NUM):
+        NUMBER_OP(OP_SUBTRACT, NUMBER_VAL, -);
+      CASE(OP_MULTIPLY_NUM):
+        NUMBER_OP(OP_MULTIPLY, NUMBER_VAL, *);
+      CASE(OP_DIVIDE_NUM):
+        NUMBER_OP(OP_DIVIDE, NUMBER_VAL, /);
+      CASE(OP_GREATER_NUM):
+        NUMBER_OP(OP_GREATER, BOOL_VAL, >);
+      CASE(OP_LESS_NUM):
+        NUMBER_OP(OP_LESS, BOOL_VAL, <);
+      CASE(OP_GREATER_EQUAL_NUM):
+        NUMBER_OP(OP_GREATER_EQUAL, NOT_BOOL_VAL, <);
+      CASE(OP_LESS_EQUAL_NUM):
+        NUMBER_OP(OP_LESS_EQUAL, NOT_BOOL_VAL, >);
+      CASE(OP_RETURN):
         {
           return INTERPRET_OK;
         }
     }
   }
+#undef DISPATCH
+#undef CASE
+#undef TRACE_EXECUTION
+#undef NOT_BOOL_VAL
+#undef NUMBER_OP
 #undef BINARY_OP
-#undef READ_STRING_LONG
-#undef READ_STRING
+#undef QUICKEN
 #undef READ_LONG_CONSTANT
 #undef READ_CONSTANT
 #undef READ_BYTE
@@ -291,35 +607,253 @@ static InterpretResult run() {
 
 #define CHUNK_CLEANUP ATTR_CLEANUP(freeChunk)
 
-InterpretResult interpret(const char source[static 1]) {
+InterpretResult interpret(Vm* vm, size_t length, const char source[length]) {
   Chunk CHUNK_CLEANUP chunk;
   initChunk(&chunk);
 
-  if (!compile(source, &chunk)) {
+  if (!compile(vm, &g_COMPILER_OPTIONS, length, source, &chunk)) {
     return INTERPRET_COMPILE_ERROR;
   }
 
-  g_VM.chunk = &chunk;
-  g_VM.ip = g_VM.chunk->code;
+  return interpretChunk(vm, &chunk, length, source);
+}
 
-  return run();
+// Values the runtime pushes on top of a chunk's own while it allocates, e.g.
+// to keep a new string reachable while it is interned.
+#define STACK_HEADROOM 4
+
+static void reserveStack(Vm* vm, int depth) {
+  // push() keeps a free slot above the top, and so must this
+  int needed = depth + STACK_HEADROOM + 1;
+  if (vm->stack.capacity < needed) {
+    int oldCapacity = vm->stack.capacity;
+    int capacity = GROW_CAPACITY(oldCapacity);
+    while (capacity < needed) {
+      capacity *= 2;
+    }
+    vm->stack.values
+        = GROW_ARRAY(Value, vm->stack.values, oldCapacity, capacity);
+    vm->stack.capacity = capacity;
+  }
+  resetStack(vm);
 }
 
+#pragma region "compiled code"
+
+static uint32_t readSlot(const uint8_t* ip) {
+  if (instructionLength(ip[0]) == 4) {
+    return ip[1] + ip[2] * UINT8_COUNT + ip[3] * UINT8_COUNT * UINT8_COUNT;
+  }
+  return ip[1];
+}
+
+Value* runSlowPath(Vm* vm, Value* stackTop, const uint8_t* ip) {
+  // runtimeError() finds the instruction just before ip
+  vm->stackTop = stackTop;
+  vm->ip = (uint8_t*)ip + 1;
+  switch (genericOpcode(ip[0])) {
+    case OP_GET_GLOBAL_SLOT:
+    case OP_GET_GLOBAL_SLOT_LONG:
+    case OP_SET_GLOBAL_SLOT:
+    case OP_SET_GLOBAL_SLOT_LONG:
+    case OP_SET_GLOBAL_SLOT_POP:
+      // compiled code only gets here for a slot nothing has defined
+      undefinedVariableError(vm, readSlot(ip));
+      return NULL;
+    case OP_ADD:
+      if (!IS_TEXT(peek(vm, 0)) || !IS_TEXT(peek(vm, 1))) {
+        runtimeError(vm, "Operands must be two numbers or two strings.");
+        return NULL;
+      }
+      concatenate(vm);
+      break;
+    case OP_ADD_LOCAL_CONST:
+      {
+        Value a = vm->stack.values[ip[1]];
+        Value b = vm->chunk->constants.values[ip[2]];
+        if (!IS_TEXT(a) || !IS_TEXT(b)) {
+          runtimeError(vm, "Operands must be two numbers or two strings.");
+          return NULL;
+        }
+        pushUnchecked(vm, a);
+        pushUnchecked(vm, b);
+        concatenate(vm);
+        break;
+      }
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_GREATER_EQUAL:
+    case OP_LESS_EQUAL:
+      runtimeError(vm, "Operands must be numbers.");
+      return NULL;
+    case OP_NEGATE:
+      runtimeError(vm, "Operand must be a number.");
+      return NULL;
+    case OP_EQUAL:
+    case OP_NOT_EQUAL:
+      {
+        bool equal = valuesEqual(vm, peek(vm, 1), peek(vm, 0));
+        drop(vm, 2);
+        pushUnchecked(vm, BOOL_VAL(equal == (ip[0] == OP_EQUAL)));
+        break;
+      }
+    case OP_NOT:
+      pushUnchecked(vm, BOOL_VAL(isFalsey(popUnchecked(vm))));
+      break;
+    case OP_PRINT:
+      printLine(vm);
+      break;
+    default:
+      assert(false);
+  }
+  return vm->stackTop;
+}
+
+// Runs `native` if given, else the chunk as machine code when the JIT is
+// built in and enabled, and interprets it otherwise. Tracing and profiling
+// need the interpreter.
+static InterpretResult execute(Vm* vm, Chunk* chunk, NativeChunk native) {
+  if (native) {
+    InterpretResult result = native(
+        vm,
+        vm->stack.values,
+        chunk->constants.values,
+        vm->globalValues.values,
+        chunk->code,
+        runSlowPath);
+    resetStack(vm);
+    return result;
+  }
+#if defined(JIT) && !defined(DEBUG_TRACE_EXECUTION)
+  JitCode jit;
+  if (!vm->profile && g_JIT_OPTIONS.enabled && compileJit(vm, chunk, &jit)) {
+    InterpretResult result = runJit(
+        &jit,
+        vm->stack.values,
+        chunk->constants.values,
+        vm->globalValues.values);
+    freeJit(&jit);
+    // compiled code kept the stack top in a register
+    resetStack(vm);
+    return result;
+  }
+#else
+  (void)chunk;
+#endif
+  return run(vm);
+}
+
+#pragma endregion
+
+static InterpretResult interpretWith(
+    Vm* vm,
+    Chunk* chunk,
+    NativeChunk native,
+    size_t sourceLength,
+    const char source[sourceLength]) {
+  if (chunk->maxStack < 0) {
+    Verification verification
+        = verifyChunk(chunk, (uint32_t)vm->globalValues.count);
+    if (verification.error) {
+      fprintf(
+          stderr,
+          "Invalid bytecode at offset %d: %s\n",
+          verification.offset,
+          verification.error);
+      return INTERPRET_INVALID_CODE;
+    }
+  }
+  // growing the stack may collect; root the chunk's constants first
+  vm->chunk = chunk;
+  reserveStack(vm, chunk->maxStack);
+  if (!chunk->typeProfiles) {
+    chunk->typeProfiles = ALLOCATE(uint8_t, chunk->count);
+    memset(chunk->typeProfiles, 0, chunk->count);
+  }
+  vm->ip = vm->chunk->code;
+  vm->source = source;
+  vm->sourceLength = sourceLength;
+
+  if (vm->profile) {
+    startProfile(vm->profile, chunk);
+  }
+  InterpretResult result = execute(vm, chunk, native);
+  if (vm->profile) {
+    stopProfile(vm->profile, chunk);
+  }
+#ifdef DEBUG_PRINT_CODE
+  disassembleTypeProfiles(vm, chunk);
+#endif
+  // the caller frees the chunk; stop treating its constants as roots
+  vm->chunk = NULL;
+  vm->source = NULL;
+  return result;
+}
+
+InterpretResult interpretChunk(
+    Vm* vm,
+    Chunk* chunk,
+    size_t sourceLength,
+    const char source[sourceLength]) {
+  return interpretWith(vm, chunk, NULL, sourceLength, source);
+}
+
+InterpretResult interpretNativeChunk(
+    Vm* vm,
+    Chunk* chunk,
+    NativeChunk native,
+    size_t sourceLength,
+    const char source[sourceLength]) {
+  return interpretWith(vm, chunk, native, sourceLength, source);
+}
+
+#pragma region "global slots"
+
+uint32_t globalSlot(Vm* vm, ObjString* name) {
+  Value slot;
+  if (tableGet(&vm->globalSlots, name, &slot)) {
+    return (uint32_t)AS_NUMBER(slot);
+  }
+
+  // the allocations below may collect; keep the name reachable
+  push(vm, OBJ_VAL(name));
+  uint32_t index = (uint32_t)vm->globalValues.count;
+  writeValueArray(&vm->globalValues, UNDEFINED_VAL);
+  writeValueArray(&vm->globalNames, OBJ_VAL(name));
+  tableSet(&vm->globalSlots, name, NUMBER_VAL(index));
+  pop(vm);
+  return index;
+}
+
+#pragma endregion
+
 #pragma region "stack manipulation"
 
-void push(Value value) {
-  if (g_VM.stackTop - g_VM.stack.values == g_VM.stack.count) {
-    writeValueArray(&g_VM.stack, value);
-    g_VM.stackTop = g_VM.stack.values + g_VM.stack.count;
-  } else {
-    *g_VM.stackTop = value;
-    g_VM.stackTop++;
+void push(Vm* vm, Value value) {
+  *vm->stackTop = value;
+  vm->stackTop++;
+
+  // Grow once the stack is full rather than when the next value arrives: a
+  // collection triggered by the allocation then still sees every value.
+  int count = (int)(vm->stackTop - vm->stack.values);
+  if (count == vm->stack.capacity) {
+    int oldCapacity = vm->stack.capacity;
+    vm->stack.capacity = GROW_CAPACITY(oldCapacity);
+    vm->stack.values = GROW_ARRAY(
+        Value,
+        vm->stack.values,
+        oldCapacity,
+        vm->stack.capacity);
+    vm->stackTop = vm->stack.values + count;
   }
 }
 
-Value pop(void) {
-  g_VM.stackTop--;
-  return *g_VM.stackTop;
+Value pop(Vm* vm) {
+  vm->stackTop--;
+  return *vm->stackTop;
 }
 
 #pragma endregion
@@ -0,0 +1,75 @@
+# What a Lox script expects of a run, from its comments, the way the
+# Crafting Interpreters test suite does it:
+#
+#   // expect: <output>                  a line the script prints
+#   // expect runtime error: <message>   the error the script stops with, on
+#                                        the line of the comment
+#
+# A script without a runtime error must exit successfully and print nothing
+# to stderr.
+
+# clox_expectations(<script> <output> <error> <result>) sets <output>,
+# <error> and <result> to what <script> expects to print to stdout and to
+# stderr, and the exit status it expects.
+function(clox_expectations script output_var error_var result_var)
+  file(READ "${script}" source)
+
+  set(expected_output "")
+  string(REGEX MATCHALL "// expect: [^\n]*" expectations "${source}")
+  foreach(expectation ${expectations})
+    string(REGEX REPLACE "^// expect: " "" line "${expectation}")
+    string(APPEND expected_output "${line}\n")
+  endforeach()
+
+  set(expected_error "")
+  set(expected_result 0)
+  string(FIND "${source}" "// expect runtime error: " error_at)
+  if(NOT error_at EQUAL -1)
+    string(SUBSTRING "${source}" 0 ${error_at} before)
+    string(REGEX MATCHALL "\n" newlines "${before}")
+    list(LENGTH newlines line)
+    math(EXPR line "${line} + 1")
+    string(SUBSTRING "${source}" ${error_at} -1 rest)
+    string(REGEX MATCH "^// expect runtime error: ([^\n]*)" _ "${rest}")
+    set(expected_error "${CMAKE_MATCH_1}\n[line ${line}] in script\n")
+    # EX_SOFTWARE
+    set(expected_result 70)
+  endif()
+
+  set(${output_var} "${expected_output}" PARENT_SCOPE)
+  set(${error_var} "${expected_error}" PARENT_SCOPE)
+  set(${result_var} "${expected_result}" PARENT_SCOPE)
+endfunction()
+
+# clox_check_run(<script> <command>...) runs <command> and fails unless what
+# it prints and its exit status are what <script> expects.
+function(clox_check_run script)
+  clox_expectations(
+    "${script}" expected_output expected_error expected_result
+  )
+
+  execute_process(
+    COMMAND ${ARGN}
+    OUTPUT_VARIABLE output
+    ERROR_VARIABLE error
+    RESULT_VARIABLE result
+  )
+
+  set(failed FALSE)
+  if(NOT output STREQUAL expected_output)
+    message("expected output:\n${expected_output}got:\n${output}")
+    set(failed TRUE)
+  endif()
+  if(NOT error STREQUAL expected_error)
+    message("expected errors:\n${expected_error}got:\n${error}")
+    set(failed TRUE)
+  endif()
+  if(NOT result STREQUAL expected_result)
+    message("expected exit status ${expected_result}, got ${result}")
+    set(failed TRUE)
+  endif()
+  if(failed)
+    string(REPLACE ";" " " command "${ARGN}")
+    message(FATAL_ERROR "${command} does not do what ${script} expects")
+  endif()
+endfunction()
@@ -0,0 +1,79 @@
+# Translates the Lox script SCRIPT to C and a shared object with the clox
+# executable CLOX, in the scratch directory WORK_DIR, and checks that:
+#   - running the shared object does what the script expects (see
+#     expect.cmake);
+#   - a shared object whose lox_abi or lox_image doesn't match the VM is
+#     refused.
+# Without $CC or cc there is nothing to build with, and the test prints
+# "no C compiler" for ctest to report a skip.
+
+if(NOT CLOX OR NOT SCRIPT OR NOT WORK_DIR)
+  message(FATAL_ERROR "usage: cmake -DCLOX=<clox> -DSCRIPT=<script.lox> "
+                      "-DWORK_DIR=<dir> -P run_aot.cmake"
+  )
+endif()
+
+include("${CMAKE_CURRENT_LIST_DIR}/expect.cmake")
+
+# the compiler clox builds with
+if("$ENV{CC}" STREQUAL "")
+  find_program(compiler cc)
+else()
+  find_program(compiler "$ENV{CC}")
+endif()
+if(NOT compiler)
+  message("no C compiler to build shared objects with")
+  return()
+endif()
+
+file(REMOVE_RECURSE "${WORK_DIR}")
+file(MAKE_DIRECTORY "${WORK_DIR}")
+set(script "${WORK_DIR}/script.lox")
+set(c_file "${WORK_DIR}/script.c")
+set(shared_object "${WORK_DIR}/script.so")
+configure_file("${SCRIPT}" "${script}" COPYONLY)
+
+execute_process(COMMAND "${CLOX}" --emit-c "${script}" RESULT_VARIABLE result)
+if(NOT result EQUAL 0 OR NOT EXISTS "${shared_object}")
+  message(FATAL_ERROR "clox --emit-c ${script} built no shared object")
+endif()
+clox_check_run("${script}" "${CLOX}" "${shared_object}")
+
+# clox_check_refused(<what> <regex> <replacement>) rebuilds the shared object
+# from the C file with <regex> replaced, and fails unless clox refuses it.
+function(clox_check_refused what regex replacement)
+  file(READ "${c_file}" source)
+  string(REGEX REPLACE "${regex}" "${replacement}" edited "${source}")
+  if(edited STREQUAL source)
+    message(FATAL_ERROR "${c_file} has no ${what} to change")
+  endif()
+  set(edited_c_file "${WORK_DIR}/edited.c")
+  set(edited_object "${WORK_DIR}/edited.so")
+  file(WRITE "${edited_c_file}" "${edited}")
+  execute_process(
+    COMMAND "${compiler}" -O2 -shared -fPIC -o "${edited_object}"
+            "${edited_c_file}"
+    RESULT_VARIABLE result
+  )
+  if(NOT result EQUAL 0)
+    message(FATAL_ERROR "could not build ${edited_object}")
+  endif()
+  execute_process(
+    COMMAND "${CLOX}" "${edited_object}"
+    OUTPUT_VARIABLE output
+    ERROR_VARIABLE error
+    RESULT_VARIABLE result
+  )
+  # EX_DATAERR
+  if(NOT result EQUAL 65 OR NOT error MATCHES "was not built for this VM")
+    message(FATAL_ERROR "a shared object with another ${what} was run: "
+                        "${result} ${error}"
+    )
+  endif()
+endfunction()
+
+clox_check_refused(lox_abi "lox_abi\\[\\] = \"" "lox_abi[] = \"other ")
+# the cache image's magic number
+clox_check_refused(
+  lox_image "(lox_image\\[\\] = {[ \n]*)0x4c" "\\10x00"
+)
@@ -0,0 +1,46 @@
+# Compiles the Lox script SCRIPT to a bytecode cache with the clox
+# executable CLOX, in the scratch directory WORK_DIR, and checks that:
+#   - running the cache, or the script next to it, does what the script
+#     expects (see expect.cmake);
+#   - once the script changes, its stale cache is ignored;
+#   - a corrupt cache is refused when run directly, and ignored in favour of
+#     the source otherwise.
+
+if(NOT CLOX OR NOT SCRIPT OR NOT WORK_DIR)
+  message(FATAL_ERROR "usage: cmake -DCLOX=<clox> -DSCRIPT=<script.lox> "
+                      "-DWORK_DIR=<dir> -P run_cache.cmake"
+  )
+endif()
+
+include("${CMAKE_CURRENT_LIST_DIR}/expect.cmake")
+
+file(REMOVE_RECURSE "${WORK_DIR}")
+file(MAKE_DIRECTORY "${WORK_DIR}")
+set(script "${WORK_DIR}/script.lox")
+set(cache "${WORK_DIR}/script.loxc")
+configure_file("${SCRIPT}" "${script}" COPYONLY)
+
+execute_process(COMMAND "${CLOX}" --compile "${script}" RESULT_VARIABLE result)
+if(NOT result EQUAL 0 OR NOT EXISTS "${cache}")
+  message(FATAL_ERROR "clox --compile ${script} wrote no cache")
+endif()
+clox_check_run("${script}" "${CLOX}" "${cache}")
+clox_check_run("${script}" "${CLOX}" "${script}")
+
+# the edit also moves every line down, so stale line numbers would show
+file(READ "${script}" source)
+file(WRITE "${script}" "print \"edited\"; // expect: edited\n${source}")
+clox_check_run("${script}" "${CLOX}" "${script}")
+
+file(WRITE "${cache}" "LOXC is not followed by a header here")
+execute_process(
+  COMMAND "${CLOX}" "${cache}"
+  OUTPUT_VARIABLE output
+  ERROR_VARIABLE error
+  RESULT_VARIABLE result
+)
+# EX_DATAERR
+if(NOT result EQUAL 65 OR NOT error MATCHES "is not a usable bytecode cache")
+  message(FATAL_ERROR "the corrupt ${cache} was run: ${result} ${error}")
+endif()
+clox_check_run("${script}" "${CLOX}" "${script}")
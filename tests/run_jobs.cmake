@@ -0,0 +1,67 @@
+# Runs all of the Lox scripts in SCRIPTS at once with
+# `CLOX --jobs JOBS SCRIPTS...` and fails unless:
+#   - together they print what each of them expects (see expect.cmake), in
+#     any interleaving of whole lines;
+#   - the exit status is that of the first script on the command line to
+#     fail.
+
+cmake_minimum_required(VERSION 3.12...3.21)
+
+if(NOT CLOX OR NOT SCRIPTS OR NOT JOBS)
+  message(FATAL_ERROR "usage: cmake -DCLOX=<clox> -DSCRIPTS=<scripts> "
+                      "-DJOBS=<n> -P run_jobs.cmake"
+  )
+endif()
+
+include("${CMAKE_CURRENT_LIST_DIR}/expect.cmake")
+
+# clox_sorted_lines(<text> <out>) sets <out> to the lines of <text>, sorted.
+function(clox_sorted_lines text out_var)
+  # keep semicolons in the text from splitting the list
+  string(REPLACE ";" "<semicolon>" text "${text}")
+  string(REPLACE "\n" ";" lines "${text}")
+  list(SORT lines)
+  string(REPLACE ";" "\n" text "${lines}")
+  string(REPLACE "<semicolon>" ";" text "${text}")
+  set(${out_var} "${text}" PARENT_SCOPE)
+endfunction()
+
+set(expected_output "")
+set(expected_error "")
+set(expected_result 0)
+foreach(script ${SCRIPTS})
+  clox_expectations("${script}" output error result)
+  string(APPEND expected_output "${output}")
+  string(APPEND expected_error "${error}")
+  if(expected_result EQUAL 0)
+    set(expected_result ${result})
+  endif()
+endforeach()
+
+execute_process(
+  COMMAND "${CLOX}" --jobs ${JOBS} ${SCRIPTS}
+  OUTPUT_VARIABLE output
+  ERROR_VARIABLE error
+  RESULT_VARIABLE result
+)
+
+clox_sorted_lines("${expected_output}" expected_output)
+clox_sorted_lines("${output}" output)
+clox_sorted_lines("${expected_error}" expected_error)
+clox_sorted_lines("${error}" error)
+set(failed FALSE)
+if(NOT output STREQUAL expected_output)
+  message("expected output lines:\n${expected_output}\ngot:\n${output}")
+  set(failed TRUE)
+endif()
+if(NOT error STREQUAL expected_error)
+  message("expected error lines:\n${expected_error}\ngot:\n${error}")
+  set(failed TRUE)
+endif()
+if(NOT result STREQUAL expected_result)
+  message("expected exit status ${expected_result}, got ${result}")
+  set(failed TRUE)
+endif()
+if(failed)
+  message(FATAL_ERROR "clox --jobs ${JOBS} does not do what the scripts expect")
+endif()
@@ -0,0 +1,60 @@
+# Profiles the Lox script SCRIPT with the clox executable CLOX, in the
+# scratch directory WORK_DIR, and checks that:
+#   - the script still prints what it expects to (see expect.cmake);
+#   - the report counts INSTRUCTIONS instructions in all, and as many of
+#     each opcode as COUNTS gives in <opcode>=<count> entries;
+#   - folded stacks are written only if samples were taken.
+
+if(NOT CLOX OR NOT SCRIPT OR NOT WORK_DIR OR NOT INSTRUCTIONS)
+  message(FATAL_ERROR "usage: cmake -DCLOX=<clox> -DSCRIPT=<script.lox> "
+                      "-DWORK_DIR=<dir> -DINSTRUCTIONS=<n> "
+                      "[-DCOUNTS=<opcode>=<n>;...] -P run_profile.cmake"
+  )
+endif()
+
+include("${CMAKE_CURRENT_LIST_DIR}/expect.cmake")
+
+file(REMOVE_RECURSE "${WORK_DIR}")
+file(MAKE_DIRECTORY "${WORK_DIR}")
+set(script "${WORK_DIR}/script.lox")
+set(folded "${WORK_DIR}/script.folded")
+configure_file("${SCRIPT}" "${script}" COPYONLY)
+
+clox_expectations("${script}" expected_output expected_error expected_result)
+execute_process(
+  COMMAND "${CLOX}" --profile "${script}"
+  OUTPUT_VARIABLE output
+  ERROR_VARIABLE report
+  RESULT_VARIABLE result
+)
+if(NOT output STREQUAL expected_output OR NOT result EQUAL expected_result)
+  message(FATAL_ERROR "clox --profile changed what ${script} does: "
+                      "${result}\n${output}"
+  )
+endif()
+
+set(failed FALSE)
+if(NOT report MATCHES "== profile: ${INSTRUCTIONS} instructions, ([0-9]+) ")
+  message("expected ${INSTRUCTIONS} instructions")
+  set(failed TRUE)
+endif()
+set(samples "${CMAKE_MATCH_1}")
+foreach(count ${COUNTS})
+  string(REPLACE "=" ";" count "${count}")
+  list(GET count 0 opcode)
+  list(GET count 1 expected)
+  if(NOT report MATCHES "\n  ${opcode} +${expected} ")
+    message("expected ${expected} of ${opcode}")
+    set(failed TRUE)
+  endif()
+endforeach()
+if(samples EQUAL 0 AND EXISTS "${folded}")
+  message("folded stacks were written without any samples")
+  set(failed TRUE)
+elseif(samples GREATER 0 AND NOT EXISTS "${folded}")
+  message("${samples} samples were taken but no folded stacks written")
+  set(failed TRUE)
+endif()
+if(failed)
+  message(FATAL_ERROR "unexpected profile of ${script}:\n${report}")
+endif()
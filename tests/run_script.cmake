@@ -0,0 +1,13 @@
+# Runs the Lox script SCRIPT with the clox executable CLOX, passing it the
+# options in ARGS, and fails unless the run matches what the script's
+# comments expect (see expect.cmake).
+
+if(NOT CLOX OR NOT SCRIPT)
+  message(FATAL_ERROR "usage: cmake -DCLOX=<clox> -DSCRIPT=<script.lox> "
+                      "[-DARGS=<options>] -P run_script.cmake"
+  )
+endif()
+
+include("${CMAKE_CURRENT_LIST_DIR}/expect.cmake")
+
+clox_check_run("${SCRIPT}" "${CLOX}" ${ARGS} "${SCRIPT}")
@@ -1,3 +1,261 @@
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <clox/cache.h>
+#include <clox/chunk.h>
+#include <clox/compiler.h>
+#include <clox/jit.h>
+#include <clox/object.h>
+#include <clox/verifier.h>
+#include <clox/vm.h>
 #include <tau/tau.h>
 
 TAU_MAIN()
+
+// A cache stands in for compiling its source again, so it only matches the
+// options the source would be compiled with now.
+TEST(cache, keyedOnCompilerOptions) {
+  static const char source[] = "var a = 1 + 2;\nprint a + a;\n";
+  static const char path[] = "test_clox_options.loxc";
+  size_t length = strlen(source);
+  CompilerOptions options = g_COMPILER_OPTIONS;
+  g_COMPILER_OPTIONS.wholeProgram = true;
+  Vm vm;
+  initVm(&vm);
+
+  Chunk chunk;
+  initChunk(&chunk);
+  REQUIRE(compile(&vm, &g_COMPILER_OPTIONS, length, source, &chunk));
+  REQUIRE(writeCache(&vm, path, &chunk, length, source));
+  freeChunk(&chunk);
+
+  CHECK(loadCache(&vm, path, length, source, &chunk));
+  freeChunk(&chunk);
+
+  g_COMPILER_OPTIONS.optimize = 2;
+  CHECK(!loadCache(&vm, path, length, source, &chunk));
+  // run directly, a cache is whatever it holds
+  CHECK(loadCache(&vm, path, 0, NULL, &chunk));
+  freeChunk(&chunk);
+  g_COMPILER_OPTIONS.optimize = 0;
+
+  g_COMPILER_OPTIONS.stripLines = true;
+  CHECK(!loadCache(&vm, path, length, source, &chunk));
+  g_COMPILER_OPTIONS.stripLines = false;
+
+  freeVm(&vm);
+  remove(path);
+  g_COMPILER_OPTIONS = options;
+}
+
+// Builds a chunk of `count` bytes of code, all on line 1, with no constants.
+static void writeCode(Chunk* chunk, int count, const uint8_t code[count]) {
+  initChunk(chunk);
+  for (int i = 0; i < count; ++i) {
+    writeChunk(chunk, code[i], 1);
+  }
+}
+
+// Verifies `code` with no globals; returns the error, or NULL if it passes.
+static const char* verifyCode(
+    int count,
+    const uint8_t code[count],
+    int* offset) {
+  Chunk chunk;
+  writeCode(&chunk, count, code);
+  Verification verification = verifyChunk(&chunk, 0);
+  freeChunk(&chunk);
+  *offset = verification.offset;
+  return verification.error;
+}
+
+#define VERIFY(offset, ...) \
+  verifyCode( \
+      sizeof((const uint8_t[]){__VA_ARGS__}), \
+      (const uint8_t[]){__VA_ARGS__}, \
+      (offset))
+
+TEST(verifier, acceptsCompiledCode) {
+  static const char source[] = "{ var a = 1; var b = a + 2; print b; }";
+  Vm vm;
+  initVm(&vm);
+  Chunk chunk;
+  initChunk(&chunk);
+  REQUIRE(compile(&vm, &g_COMPILER_OPTIONS, strlen(source), source, &chunk));
+  Verification verification = verifyChunk(&chunk, 0);
+  CHECK(verification.error == NULL);
+  CHECK(chunk.maxStack >= 2);
+  freeChunk(&chunk);
+  freeVm(&vm);
+}
+
+TEST(verifier, rejectsMalformedCode) {
+  Vm vm;
+  initVm(&vm);
+  int offset;
+
+  CHECK(VERIFY(&offset, OP_NIL, OP_POP, 0xff, OP_RETURN) != NULL);
+  CHECK(offset == 2);
+  // missing the constant's operand byte
+  CHECK(VERIFY(&offset, OP_NIL, OP_POP, OP_CONSTANT) != NULL);
+  CHECK(offset == 2);
+  CHECK(VERIFY(&offset, OP_CONSTANT, 0, OP_POP, OP_RETURN) != NULL);
+  CHECK(offset == 0);
+  CHECK(VERIFY(&offset, OP_GET_GLOBAL_SLOT, 0, OP_POP, OP_RETURN) != NULL);
+  CHECK(offset == 0);
+  CHECK(VERIFY(&offset, OP_NIL, OP_GET_LOCAL, 1, OP_POP, OP_RETURN) != NULL);
+  CHECK(offset == 1);
+  CHECK(VERIFY(&offset, OP_NIL, OP_POP, OP_POP, OP_RETURN) != NULL);
+  CHECK(offset == 2);
+  CHECK(VERIFY(&offset, OP_NIL, OP_RETURN) != NULL);
+  CHECK(offset == 1);
+  CHECK(VERIFY(&offset, OP_NIL, OP_POP) != NULL);
+  CHECK(offset == 2);
+
+  CHECK(VERIFY(&offset, OP_NIL, OP_GET_LOCAL, 0, OP_ADD, OP_POP, OP_RETURN)
+        == NULL);
+  freeVm(&vm);
+}
+
+TEST(verifier, invalidCodeIsNotRun) {
+  Vm vm;
+  initVm(&vm);
+  Chunk chunk;
+  writeCode(&chunk, 3, (const uint8_t[]){OP_NIL, OP_PRINT, OP_PRINT});
+  CHECK(interpretChunk(&vm, &chunk, 0, NULL) == INTERPRET_INVALID_CODE);
+  freeChunk(&chunk);
+  freeVm(&vm);
+}
+
+static Value global(Vm* vm, const char name[static 1]) {
+  ObjString* string = copyString(vm, (int)strlen(name), name);
+  return vm->globalValues.values[globalSlot(vm, string)];
+}
+
+static bool isNumber(Value value, double number) {
+  return IS_NUMBER(value) && AS_NUMBER(value) == number;
+}
+
+static bool isString(Vm* vm, Value value, const char chars[static 1]) {
+  ObjString* string = IS_ROPE(value) ? flattenRope(vm, AS_ROPE(value))
+      : IS_STRING(value)             ? AS_STRING(value)
+                                     : NULL;
+  return string && string->length == (int)strlen(chars)
+      && memcmp(string->chars, chars, string->length) == 0;
+}
+
+static bool hasOpcode(const Chunk* chunk, uint8_t op) {
+  for (int offset = 0; offset < chunk->count;
+       offset += instructionLength(chunk->code[offset])) {
+    if (chunk->code[offset] == op) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Sources are bounded by their length, not by a NUL, so a number that ends
+// one right before an unmapped page mustn't be read past.
+TEST(compiler, numberEndsWithTheSource) {
+  static const char source[] = "var x = 12";
+  long pageSize = sysconf(_SC_PAGESIZE);
+  char* pages = mmap(
+      NULL,
+      2 * pageSize,
+      PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS,
+      -1,
+      0);
+  REQUIRE(pages != MAP_FAILED);
+  REQUIRE(mprotect(pages + pageSize, pageSize, PROT_NONE) == 0);
+  char* start = pages + pageSize - strlen(source);
+  memcpy(start, source, strlen(source));
+
+  Vm vm;
+  initVm(&vm);
+  // missing its ';', but it gets as far as saying so
+  CHECK(interpret(&vm, strlen(source), start) == INTERPRET_COMPILE_ERROR);
+
+  // longer than the compiler's buffer for it
+  char digits[201];
+  memset(digits, '0', sizeof(digits));
+  memcpy(digits, "var y = 1", 9);
+  digits[sizeof(digits) - 1] = ';';
+  CHECK(interpret(&vm, sizeof(digits), digits) == INTERPRET_OK);
+  CHECK(isNumber(global(&vm, "y"), 1e191));
+  freeVm(&vm);
+  munmap(pages, 2 * pageSize);
+}
+
+// The same chunk run again meets operands of other types at sites quickened
+// on the first run. Quickening is the interpreter's, so the JIT is off.
+TEST(quickening, deoptimizesOnOtherOperands) {
+  static const char numbers[] = "var a = 1; var b = 2;";
+  static const char strings[] = "a = \"x\"; b = \"y\";";
+  static const char sum[] = "var c = a + b;";
+  static const char difference[] = "var d = a - b;";
+  bool jitEnabled = g_JIT_OPTIONS.enabled;
+  g_JIT_OPTIONS.enabled = false;
+  Vm vm;
+  initVm(&vm);
+  REQUIRE(interpret(&vm, strlen(numbers), numbers) == INTERPRET_OK);
+
+  Chunk adding;
+  initChunk(&adding);
+  REQUIRE(compile(&vm, &g_COMPILER_OPTIONS, strlen(sum), sum, &adding));
+  Chunk subtracting;
+  initChunk(&subtracting);
+  REQUIRE(compile(
+      &vm,
+      &g_COMPILER_OPTIONS,
+      strlen(difference),
+      difference,
+      &subtracting));
+
+  CHECK(interpretChunk(&vm, &adding, 0, NULL) == INTERPRET_OK);
+  CHECK(hasOpcode(&adding, OP_ADD_NUM));
+  CHECK(isNumber(global(&vm, "c"), 3));
+  CHECK(interpretChunk(&vm, &subtracting, 0, NULL) == INTERPRET_OK);
+  CHECK(hasOpcode(&subtracting, OP_SUBTRACT_NUM));
+
+  REQUIRE(interpret(&vm, strlen(strings), strings) == INTERPRET_OK);
+  CHECK(interpretChunk(&vm, &adding, 0, NULL) == INTERPRET_OK);
+  CHECK(!hasOpcode(&adding, OP_ADD_NUM));
+  CHECK(isString(&vm, global(&vm, "c"), "xy"));
+  // falls back to the generic instruction, which reports the error
+  CHECK(interpretChunk(&vm, &subtracting, 0, NULL) == INTERPRET_RUNTIME_ERROR);
+  CHECK(!hasOpcode(&subtracting, OP_SUBTRACT_NUM));
+
+  // a site that has seen other types is not quickened again
+  REQUIRE(interpret(&vm, strlen(numbers), numbers) == INTERPRET_OK);
+  CHECK(interpretChunk(&vm, &adding, 0, NULL) == INTERPRET_OK);
+  CHECK(!hasOpcode(&adding, OP_ADD_NUM));
+  CHECK(isNumber(global(&vm, "c"), 3));
+
+  freeChunk(&adding);
+  freeChunk(&subtracting);
+  freeVm(&vm);
+  g_JIT_OPTIONS.enabled = jitEnabled;
+}
+
+// Compiling allocates no type profiles, so freeing a chunk that never ran
+// must give back exactly what compiling took.
+TEST(quickening, unrunChunkFreesWhatItTook) {
+  static const char source[] = "var a = 1 + 2;";
+  Vm vm;
+  initVm(&vm);
+  Chunk chunk;
+  // the first time interns the names and reserves the global slot
+  for (int i = 0; i < 2; ++i) {
+    size_t before = vm.bytesAllocated;
+    initChunk(&chunk);
+    REQUIRE(compile(&vm, &g_COMPILER_OPTIONS, strlen(source), source, &chunk));
+    freeChunk(&chunk);
+    if (i == 1) {
+      CHECK(vm.bytesAllocated == before);
+    }
+  }
+  freeVm(&vm);
+}